@@ -0,0 +1,62 @@
+#ifndef BAXTER_DEMOS_BOX_EXCLUSION_H_
+#define BAXTER_DEMOS_BOX_EXCLUSION_H_
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace baxter_demos{
+
+// Removes the points inside any of a set of oriented boxes, in one pass over
+// the cloud. Each box is stored as the transform into its own frame, so a
+// point is tested by rotating it into every box instead of transforming the
+// cloud once per box.
+//
+// The boxes are kept as structure of arrays, padded to a multiple of
+// lanes with boxes that contain nothing, and the test against all of them
+// has no branches. That is the form compilers turn into SIMD code.
+class BoxExclusion {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
+
+    //Boxes are padded to a multiple of this
+    static const int lanes = 8;
+
+private:
+    //Row i of the box's rotation (the box axes in the cloud frame), the
+    //center in box coordinates and the half sides; one entry per box
+    std::vector<float> r[9];
+    std::vector<float> offset[3];
+    std::vector<float> half[3];
+    int count;
+
+    //Union of the boxes' axis aligned bounds, to skip the far points
+    Eigen::Vector3f bounds_min, bounds_max;
+
+    bool inside(const pcl::PointXYZRGB& pt) const;
+
+public:
+    BoxExclusion();
+
+    void clear();
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    //A box of sides 2*half_sides around center, with its axes the columns
+    //of rotation, in the cloud's frame
+    void addBox(const Eigen::Vector3f& center, const Eigen::Matrix3f& rotation,
+                const Eigen::Vector3f& half_sides);
+
+    //Indices of the points of cloud outside every box, NaN points included
+    void filter(const PointCloud& cloud, std::vector<int>& kept) const;
+    //The points outside every box. If keep_organized, the points inside are
+    //set to NaN instead of removed.
+    void filter(const PointCloud& cloud, PointCloud& output, bool keep_organized) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BAXTER_DEMOS_CLOUD_ENCODER_H_
+#define BAXTER_DEMOS_CLOUD_ENCODER_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+#include <pcl/PCLPointCloud2.h>
+#include <pcl/compression/octree_pointcloud_compression.h>
+
+#include "CloudPreprocessor.h"
+
+namespace baxter_demos{
+
+// Compact encodings of a segmented frame for the debug topics, so that a
+// GUI on another machine doesn't cost more bandwidth than the camera. The
+// clouds come out as pcl::PCLPointCloud2, which keeps this free of ROS.
+//
+// PCL pads an XYZRGB point to 32 bytes; the packed encodings here use 16
+// (x, y, z, rgb) or 14 (x, y, z, label).
+class CloudEncoder {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
+    typedef pcl::io::OctreePointCloudCompression<pcl::PointXYZRGB> Compression;
+
+    //Label of the points that are in no cluster
+    static const boost::uint16_t unlabelled = 0;
+
+private:
+    CloudPreprocessor decimator;
+    PointCloud decimated;
+    std::vector<int> selected;
+    boost::scoped_ptr<Compression> encoder;
+    boost::scoped_ptr<Compression> decoder;
+
+    static void packPoints(const PointCloud& cloud, const std::vector<int>* indices,
+                           pcl::PCLPointCloud2& out);
+    static Compression* makeCompression();
+
+public:
+    //x, y, z of every point and the cluster it is in, as 1 + its index in
+    //clusters
+    static void encodeLabels(const PointCloud& cloud,
+                             const std::vector<pcl::PointIndices>& clusters,
+                             pcl::PCLPointCloud2& out);
+    //The points of clusters[which[i]] only
+    void encodeClusters(const PointCloud& cloud,
+                        const std::vector<pcl::PointIndices>& clusters,
+                        const std::vector<int>& which, pcl::PCLPointCloud2& out);
+    //cloud averaged over voxels of side leaf
+    void encodePreview(const PointCloud& cloud, float leaf, pcl::PCLPointCloud2& out);
+    //Octree compressed, every frame on its own so a dropped message doesn't
+    //break the next
+    void compress(const PointCloud::ConstPtr& cloud, std::vector<boost::uint8_t>& data);
+
+    //Back to XYZRGB, labels in the colors RegionGrower::colorClusters uses
+    static void decodeLabels(const pcl::PCLPointCloud2& in, PointCloud& cloud);
+    void decompress(const std::vector<boost::uint8_t>& data, PointCloud::Ptr& cloud);
+};
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef BAXTER_DEMOS_CLOUD_PREPROCESSOR_H_
+#define BAXTER_DEMOS_CLOUD_PREPROCESSOR_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include "CloudView.h"
+#include "ImageROI.h"
+#include "FlatHashMap.h"
+
+namespace baxter_demos{
+
+// Replaces the removeNaNFromPointCloud -> VoxelGrid -> PassThrough chain with
+// a single sweep over the (organized) input cloud. Points are rejected as soon
+// as they are non-finite or outside [filter_min, filter_max] on z, so cropped
+// points are never binned. Surviving points are averaged per voxel, like
+// VoxelGrid does for xyz and rgb.
+class CloudPreprocessor {
+private:
+    struct VoxelAccumulator {
+        float x, y, z;
+        boost::uint32_t r, g, b;
+        boost::uint32_t count;
+        boost::uint64_t key;
+    };
+    typedef FlatHashMap<size_t> VoxelSlotMap;
+
+    float leaf_size;
+    float inverse_leaf_size;
+    float filter_min;
+    float filter_max;
+
+    //Kept across frames so the buckets and storage are only allocated once
+    VoxelSlotMap voxel_slots;
+    std::vector<VoxelAccumulator> accumulators;
+    std::vector<boost::uint64_t> voxel_keys;
+
+    void begin();
+    //Bin the points in columns [u_begin, u_end) of row v
+    void sweep(const CloudView& input, size_t v, size_t u_begin, size_t u_end);
+    void end(pcl::PointCloud<pcl::PointXYZRGB>& output);
+
+public:
+    CloudPreprocessor();
+
+    void setLeafSize(float leaf);
+    void setFilterLimits(float min, float max);
+
+    float getLeafSize() const { return leaf_size; }
+
+    static boost::uint64_t voxelKey(int ix, int iy, int iz);
+    static void voxelCoords(boost::uint64_t key, int& ix, int& iy, int& iz);
+
+    //Voxel key of each point written by the last call to filter
+    const std::vector<boost::uint64_t>& getVoxelKeys() const { return voxel_keys; }
+
+    //Reads the input buffer in place; output gets one point per occupied voxel
+    void filter(const CloudView& input, pcl::PointCloud<pcl::PointXYZRGB>& output);
+    //Only reads the pixels in roi, for an organized input of the size roi
+    //was reset to; an empty roi reads everything
+    void filter(const CloudView& input, ImageROI& roi,
+                pcl::PointCloud<pcl::PointXYZRGB>& output);
+    //input and output must not be the same cloud
+    void filter(const pcl::PointCloud<pcl::PointXYZRGB>& input,
+                pcl::PointCloud<pcl::PointXYZRGB>& output);
+};
+
+}
+
+#endif
@@ -6,24 +6,41 @@
 #include <cmath>
 #include <cstdlib>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <deque>
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
 
 #include "ros/ros.h"
 #include <nodelet/nodelet.h>
 #include "tf/transform_listener.h"
 
 #include "std_msgs/Header.h"
+#include "std_msgs/Float64.h"
+#include "diagnostic_msgs/DiagnosticArray.h"
 #include "sensor_msgs/PointCloud2.h"
+#include "sensor_msgs/CameraInfo.h"
 #include "geometry_msgs/PoseArray.h"
 #include "geometry_msgs/Pose.h"
 #include "geometry_msgs/Point.h"
 #include "geometry_msgs/Quaternion.h"
 #include "moveit_msgs/CollisionObject.h"
 #include <baxter_demos/CollisionObjectArray.h>
-
-#include "OrientedBoundingBox.h"
+#include <baxter_demos/CompressedCloud.h>
+#include <baxter_demos/VoxelOccupancy.h>
+
+#include "SegmentationPipeline.h"
+#include "CloudEncoder.h"
+#include "BoxExclusion.h"
+#include "OccupancyGrid.h"
+#include "FrameSlot.h"
+#include "Snapshot.h"
+#include "ObjectTracker.h"
+#include "SceneDiffer.h"
 
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
@@ -31,7 +48,6 @@
 #include <pcl/recognition/color_gradient_dot_modality.h>
 #include <pcl/common/centroid.h>
 #include <pcl/common/transforms.h>
-#include <pcl/filters/conditional_removal.h>
 #include <pcl/filters/passthrough.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/filters/radius_outlier_removal.h>
@@ -40,11 +56,11 @@
 #include <pcl/search/search.h>
 #include <pcl/search/kdtree.h>
 #include <pcl/visualization/cloud_viewer.h>
-#include <pcl/features/moment_of_inertia_estimation.h>
 
 #include <pcl/conversions.h>
 #include <pcl/PCLPointCloud2.h>
 #include <pcl_conversions/pcl_conversions.h>
+#include <pcl_ros/point_cloud.h>
 
 
 using namespace std;
@@ -52,110 +68,201 @@ using namespace std;
 namespace baxter_demos{
 
 Eigen::Vector3f positionToVector(geometry_msgs::Point p);
+geometry_msgs::Pose trackToPose(const Track& track);
+
+// A color the segmenter looks for. Each target gets its color from
+// /object_tracker/<name>/picked_color and publishes the poses of its blocks
+// on /object_tracker/<name>/goal_poses.
+struct SegmentationTarget {
+    string name;
+    bool has_color;
+    pcl::PointRGB color;
+    ros::Subscriber color_sub;
+    ros::Publisher goal_pub;
 
-const float threshold = 0.002;
-//Compare goal poses by greater magnitude from origin
-class pose_compare{
-    public:
-    bool operator()(geometry_msgs::Pose pose_a, geometry_msgs::Pose pose_b);
-    static bool position_equal(geometry_msgs::Pose pose_a, geometry_msgs::Pose pose_b){
-        return abs(pose_a.position.x - pose_b.position.x) < threshold &&
-               abs(pose_a.position.y - pose_b.position.y) < threshold &&
-               abs(pose_a.position.z - pose_b.position.z) < threshold;
-    }
+    SegmentationTarget() : has_color(false) {}
 };
 
+// Everything one point cloud needs on its way through the pipeline. Each
+// stage only touches the frame it was handed, so consecutive frames can be
+// in different stages at the same time.
+struct SegmentationFrame : public PipelineFrame {
+    typedef boost::shared_ptr<SegmentationFrame> Ptr;
 
-typedef pcl::PointCloud<pcl::PointXYZRGB> PointColorCloud;
-typedef pair<PointColorCloud::Ptr, OrientedBoundingBox> CloudPtrBoxPair;
-typedef map<PointColorCloud::Ptr, OrientedBoundingBox> CloudPtrBoxMap;
-typedef map<string, geometry_msgs::Pose > IDPoseMap; 
-typedef map<geometry_msgs::Pose, string, pose_compare > PoseIDMap; 
-typedef map<string, moveit_msgs::CollisionObject > IDObjectMap; 
+    std_msgs::Header header;
+
+    //Shared with the driver; read in place during preprocessing
+    sensor_msgs::PointCloud2::ConstPtr msg;
 
-class CloudSegmenter : public nodelet::Nodelet {
-private:
-    int radius;
-    int filter_min;
-    int filter_max;
-    int distance_threshold;
-    int point_color_threshold;
-    int region_color_threshold;
-    int min_cluster_size;
-    int max_cluster_size;
-    double tolerance;
-    float leaf_size;
-    double outlier_radius;
-    int min_neighbors;
-
-    int object_sequence;
-
-    bool has_desired_color;
-    bool has_cloud;
     bool segmented;
+    //Index into CloudSegmenter::targets for each of PipelineFrame::targets
+    vector<int> target_ids;
+    //Confirmed poses, indexed like CloudSegmenter::targets
+    vector<vector<geometry_msgs::Pose> > goal_poses;
+
+    //Whether the tracker's changes in this frame are a resync
+    bool scene_resync;
+
+    //base to camera, if the transform was looked up for this frame. Frames
+    //without boxes only look it up if need_transform is set.
+    bool need_transform;
+    bool has_camera_transform;
+    Eigen::Matrix3f base_to_camera_rotation;
+    Eigen::Vector3f base_to_camera_translation;
+
+    SegmentationFrame() : segmented(false), scene_resync(false),
+                          need_transform(false), has_camera_transform(false) {}
+};
 
-    bool published_goals;
+class CloudSegmenter : public nodelet::Nodelet {
+private:
+    SegmenterParams params;
 
-    float object_side;
-    double exclusion_padding;
-    int  sample_size;
+    //Read by the viewer
+    boost::atomic<bool> segmented;
+    //Set by an in-process viewer: fill the viewer snapshots, and color the
+    //clusters even without debug subscribers
+    boost::atomic<bool> viewer_attached;
 
-    boost::mutex cloud_mutex;
     boost::thread* visualizer;
 
-    string frame_id;
-    pcl::PointRGB desired_color;
+    //Every color is scored in the same segmentation pass. Set up in onInit
+    //and never resized after, only the colors change.
+    vector<SegmentationTarget> targets;
+    boost::mutex targets_mutex;
     
-    pcl::IndicesPtr indices;
     ros::NodeHandle n;
 
     ros::Subscriber cloud_sub;
+    //Legacy topic, sets the first target
     ros::Subscriber color_sub;
 
     ros::Publisher object_pub;
+    //Debug views of the segmentation, each only made while subscribed to
     ros::Publisher cloud_pub;
-    ros::Publisher goal_pub;
-
-    pcl::RegionGrowingRGB<pcl::PointXYZRGB> reg;
-
-    //Lock cloud pointer
-    pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud;
-    pcl::PointCloud <pcl::PointXYZRGB>::Ptr obstacle_cloud;
-    pcl::PointCloud <pcl::PointXYZRGB>::Ptr colored_cloud;
-
-    vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> cloud_ptrs;
-    CloudPtrBoxMap cloud_boxes;
-
-    vector<geometry_msgs::Pose> goal_poses;
-    //vector<moveit_msgs::CollisionObject> prev_diffs;
-    //vector<moveit_msgs::CollisionObject> cur_diffs;
-    IDObjectMap prev_diffs;
-    IDObjectMap cur_diffs;
-
-    IDObjectMap all_objects;
+    ros::Publisher labels_pub;
+    ros::Publisher targets_pub;
+    ros::Publisher preview_pub;
+    ros::Publisher compressed_pub;
+    //The cloud without the blocks, for MoveIt's occupancy map, as points
+    //and as changes to a voxel grid in the base frame
+    ros::Publisher obstacle_pub;
+    ros::Publisher occupancy_pub;
+    ros::Publisher age_pub;
+    ros::Publisher diagnostics_pub;
+
+    //Pipeline: points_callback -> preprocess -> segment -> transform -> publish.
+    //Frames come from frame_pool, which only the ingest thread touches.
+    FramePool<SegmentationFrame> frame_pool;
+    FrameSlot<SegmentationFrame::Ptr> ingest_slot;
+    FrameSlot<SegmentationFrame::Ptr> preprocess_slot;
+    FrameSlot<SegmentationFrame::Ptr> segment_slot;
+    FrameSlot<SegmentationFrame::Ptr> transform_slot;
+    boost::thread_group stage_threads;
+    //Frames whose transform never arrived; only the transform thread writes it
+    boost::atomic<size_t> tf_dropped;
+
+    SegmentationPipeline pipeline;
+    PipelineStats stats;
+    //Only used on the publish thread
+    CloudEncoder encoder;
+    BoxExclusion exclusion;
+    //The obstacles of the last frame that wasn't cropped to the ROI, which
+    //is what cropped frames publish
+    PointColorCloud::ConstPtr last_obstacles;
+    OccupancyGrid occupancy;
+    vector<int> obstacle_indices;
+    vector<boost::uint64_t> voxels_added;
+    vector<boost::uint64_t> voxels_removed;
+
+    //The latest filtered and colored clouds for the viewer, only filled
+    //while one is attached. They are copies: a frame's own cloud that was
+    //handed out couldn't be recycled (see FrameWorkspace.h), while the
+    //snapshots double buffer their copies.
+    Snapshot<PointColorCloud> cloud_snapshot;
+    Snapshot<PointColorCloud> colored_snapshot;
+
+    vector<vector<geometry_msgs::Pose> > goal_poses;
+    ObjectTracker tracker;
+    //What the tracker was last configured with
+    SegmenterParams tracker_params;
+    bool tracker_configured;
+    TrackerUpdate track_update;
+    //What of the tracker's state goes to the planning scene
+    SceneDiffer scene_differ;
+    TrackerUpdate scene_update;
+    //Planning scene changes from the last frame, one per object ID
+    vector<moveit_msgs::CollisionObject> cur_diffs;
+    //Changes the publish thread hasn't sent yet, in order. Frames may be
+    //dropped on the way to publishing, but SceneDiffer has already counted
+    //their changes as sent, so those have to go out with a later frame.
+    vector<moveit_msgs::CollisionObject> unsent_objects;
+    bool unsent_resync;
+    bool has_unsent_objects;
+    boost::mutex scene_mutex;
+    //Tracker input, kept between frames
+    vector<Eigen::Vector3f> track_positions;
+    QuaternionList track_orientations;
+    vector<int> track_labels;
+
+    //ROI mode: the confirmed tracks as of the last tracked frame, in the
+    //base frame, and whether the next frame has to be read in full. Written
+    //by the transform thread, read on ingest.
+    struct ROITrack {
+        Eigen::Vector3f position;
+        Eigen::Vector3f velocity;
+    };
+    vector<ROITrack> roi_tracks;
+    //Scratch, kept between frames: updateROITracks' (transform thread) and
+    //buildROI's copy of roi_tracks (ingest)
+    vector<ROITrack> roi_confirmed;
+    vector<char> roi_has_track;
+    vector<ROITrack> roi_crop_tracks;
+    double roi_stamp;
+    bool roi_full_scan;
+    int frames_since_full_scan;
+    CameraIntrinsics camera;
+    boost::mutex roi_mutex;
+    ros::Subscriber info_sub;
 
     tf::TransformListener tf_listener;
 
-    sensor_msgs::PointCloud2 cloud_msg;
+    enum TransformStatus { TRANSFORM_DONE, TRANSFORM_PENDING, TRANSFORM_EXPIRED };
+    TransformStatus transformBoxes(SegmentationFrame& frame,
+                                   vector<geometry_msgs::Pose>& poses);
 
     float getFloatParam(string param_name);
-    void match_prev_cur_poses(vector<geometry_msgs::Pose> cur_poses,
-                              vector<moveit_msgs::CollisionObject>& next_objs,
-                              vector<moveit_msgs::CollisionObject>& remove_objs  );
-    void mergeCollidingBoxes();
-    moveit_msgs::CollisionObject constructCollisionObject(geometry_msgs::Pose pose);
-    void match_objects(vector<geometry_msgs::Pose> cur_poses);
-    //static void addComparison(pcl::ConditionAnd<pcl::PointXYZRGB>::Ptr range_cond, const char* channel, pcl::ComparisonOps::CompareOp op, float value);
+    moveit_msgs::CollisionObject constructCollisionObject(const Track& track,
+                                                          float object_side);
+    void track_objects(const vector<geometry_msgs::Pose>& cur_poses,
+                       SegmentationFrame& frame);
+    void updateROITracks(const SegmentationFrame& frame);
+    void buildROI(SegmentationFrame& frame);
     void updateParams();
 
+    void publishSnapshot(const PointColorCloud& cloud, Snapshot<PointColorCloud>& snapshot,
+                         SegmentationFrame& frame);
+
+    void preprocessLoop();
+    void segmentLoop();
+    void transformLoop();
+    void publishLoop();
+    void publishDiagnostics();
+
 public:
 
     //pcl::visualization::CloudViewer cloud_viewer;
     CloudSegmenter();
+    ~CloudSegmenter();
 
     pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr getCloudPtr();
     pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr getDisplayCloudPtr();
     pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr getClusteredCloudPtr();
+    //For viewers in the same process, see CloudViewerThread
+    const Snapshot<PointColorCloud>& getCloudSnapshot() const;
+    const Snapshot<PointColorCloud>& getClusteredSnapshot() const;
+    //Only filled while a viewer is attached
+    void setViewerAttached(bool attached);
     
     bool hasCloud();
     bool hasColor();
@@ -166,8 +273,15 @@ public:
     static bool isPointWithinDesiredRange(const pcl::PointRGB input_pt,
                                const pcl::PointRGB desired_pt, int radius);
 
+    static bool viewFromMessage(const sensor_msgs::PointCloud2& msg, CloudView& view);
+
     void onInit();
-    void publish_poses();
+    //false if the message can't be read; the frame has to be dropped
+    bool preprocess(SegmentationFrame& frame);
+    void publish_poses(SegmentationFrame& frame);
+    void publishSegmentedClouds(SegmentationFrame& frame);
+    void publishObstacles(SegmentationFrame& frame, bool publish_cloud, bool publish_voxels);
+    void publishOccupancy(SegmentationFrame& frame);
     void mouseoverCallback(const pcl::visualization::MouseEvent event, void* args);
     //remember to shift-click!
     void getClickedPoint(const pcl::visualization::PointPickingEvent& event,
@@ -175,16 +289,12 @@ public:
     pcl::PointRGB getCloudColorAt(int x, int y);
     pcl::PointRGB getCloudColorAt(size_t n);
    
-    void segmentation();
+    void segmentation(SegmentationFrame& frame);
     void points_callback(const sensor_msgs::PointCloud2::ConstPtr& msg);
+    void info_callback(const sensor_msgs::CameraInfo::ConstPtr& msg);
     void color_callback(const geometry_msgs::Point msg);
+    void target_color_callback(const geometry_msgs::Point::ConstPtr& msg, int target);
 
-
-    void exclude_object(const geometry_msgs::Pose object,
-                        const PointColorCloud::ConstPtr src_cloud,
-                        PointColorCloud::Ptr dst_cloud );
-    void exclude_all_objects(vector<geometry_msgs::Pose> cur_poses);
-    void goal_callback(const geometry_msgs::Pose msg);
 };
 
 
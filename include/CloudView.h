@@ -0,0 +1,80 @@
+#ifndef BAXTER_DEMOS_CLOUD_VIEW_H_
+#define BAXTER_DEMOS_CLOUD_VIEW_H_
+
+#include <cstddef>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace baxter_demos{
+
+// Typed, read-only view of a packed XYZRGB point buffer that somebody else
+// owns, e.g. the data of a sensor_msgs/PointCloud2 shared by the camera
+// driver. Nothing is copied; the owner has to outlive the view.
+struct CloudView {
+    const boost::uint8_t* data;
+    boost::uint32_t width;
+    boost::uint32_t height;
+    boost::uint32_t point_step;
+    boost::uint32_t row_step;
+    boost::uint32_t x_offset;
+    boost::uint32_t y_offset;
+    boost::uint32_t z_offset;
+    boost::uint32_t rgb_offset;
+
+    CloudView() : data(NULL), width(0), height(0), point_step(0), row_step(0),
+                  x_offset(0), y_offset(0), z_offset(0), rgb_offset(0) {}
+
+    bool valid() const { return data != NULL; }
+    size_t size() const { return (size_t) width*height; }
+
+    const boost::uint8_t* point(size_t u, size_t v) const {
+        return data + v*row_step + u*point_step;
+    }
+
+    //Fields may be unaligned in the buffer, so go through memcpy
+    static float readFloat(const boost::uint8_t* p){
+        float f;
+        std::memcpy(&f, p, sizeof(float));
+        return f;
+    }
+
+    void getPoint(const boost::uint8_t* p, float& x, float& y, float& z) const {
+        x = readFloat(p + x_offset);
+        y = readFloat(p + y_offset);
+        z = readFloat(p + z_offset);
+    }
+
+    void getColor(const boost::uint8_t* p, boost::uint8_t& r, boost::uint8_t& g,
+                  boost::uint8_t& b) const {
+        boost::uint32_t rgb;
+        std::memcpy(&rgb, p + rgb_offset, sizeof(boost::uint32_t));
+        r = (rgb >> 16) & 0xff;
+        g = (rgb >> 8) & 0xff;
+        b = rgb & 0xff;
+    }
+
+    static CloudView fromCloud(const pcl::PointCloud<pcl::PointXYZRGB>& cloud){
+        CloudView view;
+        if(cloud.points.empty()){
+            return view;
+        }
+        view.data = reinterpret_cast<const boost::uint8_t*>(&cloud.points[0]);
+        view.width = cloud.width;
+        view.height = cloud.height;
+        view.point_step = sizeof(pcl::PointXYZRGB);
+        view.row_step = cloud.width*sizeof(pcl::PointXYZRGB);
+        view.x_offset = offsetof(pcl::PointXYZRGB, x);
+        view.y_offset = offsetof(pcl::PointXYZRGB, y);
+        view.z_offset = offsetof(pcl::PointXYZRGB, z);
+        view.rgb_offset = offsetof(pcl::PointXYZRGB, rgb);
+        return view;
+    }
+};
+
+}
+
+#endif
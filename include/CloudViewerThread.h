@@ -0,0 +1,68 @@
+#ifndef BAXTER_DEMOS_CLOUD_VIEWER_THREAD_H_
+#define BAXTER_DEMOS_CLOUD_VIEWER_THREAD_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/atomic.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include "Snapshot.h"
+
+namespace baxter_demos{
+
+// A PCL CloudViewer that runs on its own thread and reads clouds from
+// Snapshots, so whoever makes the clouds never waits for rendering.
+//
+// It shows the first of its sources that has published anything (say the
+// segmented cloud once there is one, the camera's until then), and only
+// hands the viewer a cloud it hasn't shown yet, at most max_rate times a
+// second. Clouds of more than max_points points are decimated first; an
+// organized cloud keeps every n-th pixel of every n-th row, so it stays
+// organized.
+class CloudViewerThread {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+
+    CloudViewerThread(const std::string& title);
+    ~CloudViewerThread();
+
+    //These have to be set before start()
+    //Sources in order of preference. They have to outlive the thread.
+    void addSource(const Snapshot<Cloud>& source);
+    void setMaxRate(double hz){ max_rate = hz; }
+    //0 shows every point
+    void setMaxPoints(size_t n){ max_points = n; }
+
+    void start();
+    //Closes the window; start() opens a new one
+    void stop();
+    //The window was closed, or stop() was called
+    bool wasStopped() const { return stopped; }
+
+    //Every step-th point of in (or pixel of every step-th row), the fewest
+    //steps that make it at most max_points
+    static void decimate(const Cloud& in, size_t max_points, Cloud& out);
+
+private:
+    std::string title;
+    std::vector<const Snapshot<Cloud>*> sources;
+    double max_rate;
+    size_t max_points;
+
+    boost::thread thread;
+    boost::atomic<bool> running;
+    boost::atomic<bool> stopped;
+
+    //Decimated clouds; the viewer holds on to the one it shows
+    Snapshot<Cloud> decimated;
+
+    void loop();
+};
+
+}
+
+#endif
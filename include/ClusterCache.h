@@ -0,0 +1,133 @@
+#ifndef BAXTER_DEMOS_CLUSTER_CACHE_H_
+#define BAXTER_DEMOS_CLUSTER_CACHE_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+
+#include "OrientedBoundingBox.h"
+#include "VoxelSearch.h"
+#include "FrameWorkspace.h"
+#include "FlatHashMap.h"
+
+namespace baxter_demos{
+
+// What is known about a cluster besides its points. Filled in by the box
+// fitting stage and carried over with the cluster while it doesn't change.
+struct ClusterSummary {
+    //ClusterCache ID, -1 when the cluster isn't cached
+    int id;
+    bool has_color;
+    pcl::PointRGB color;
+    bool has_box;
+    OrientedBoundingBox box;
+
+    ClusterSummary(int i = -1) : id(i), has_color(false), color(0, 0, 0), has_box(false) {}
+};
+
+// The clusters of the last frame by voxel, so that the next frame only
+// re-segments what changed.
+//
+// A voxel has changed if it is new, or its color moved further than the
+// change threshold from the color it had when it was last segmented. A
+// region is dirty if it lost a voxel, holds a changed voxel, or is among
+// the nearest neighbours of one. Every other cluster is carried over as it
+// was, summary included; the changed voxels and the points of dirty regions
+// are segmented again. Regions too small to be clusters are kept as well,
+// so that they are never cut in half.
+//
+// This approximates a full pass; it doesn't reproduce one. Regions are
+// grown again over the resegmented points only, so a dirty region can't
+// take in points of a clean neighbour it never touched, the mean color
+// merge only sees the segments grown this frame, and a region that shrinks
+// below the cluster size keeps its old neighbours. Differences last until
+// the next full pass (SegmenterParams::incremental_refresh);
+// segmentation_benchmark --verify measures them.
+//
+// Regions too big to be clusters (the table) are background. They are
+// never segmented again as a whole: only the band of background next to a
+// change is, and whatever that band grows into stays background. So the
+// cost of a frame follows the size of the change, not of the table.
+//
+// Voxels are matched on the keys from CloudPreprocessor, so this only works
+// for a fixed camera and voxel size; clear() whenever anything the clusters
+// depend on changes. Every frame fills a second map with the voxels it saw
+// and the two are swapped, so voxels that are gone simply aren't carried
+// over; a region lost a voxel if fewer of its voxels were seen than it had.
+class ClusterCache {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
+
+private:
+    static const int unsegmented = -1;
+    static const int background = -2;
+
+    struct VoxelState {
+        boost::uint8_t r, g, b;
+        int region;
+    };
+    typedef FlatHashMap<VoxelState> VoxelMap;
+
+    struct CachedRegion {
+        bool alive;
+        //false for regions smaller than a cluster
+        bool is_cluster;
+        //Voxels labelled with this region
+        int voxels;
+        ClusterSummary summary;
+    };
+
+    VoxelMap voxels;
+    //The voxels of the frame being diffed, swapped with voxels at the end
+    VoxelMap next_voxels;
+    std::vector<CachedRegion> cached;
+    std::vector<int> free_ids;
+
+    std::vector<int> point_region;
+    std::vector<int> seen;
+    std::vector<char> marked;
+    std::vector<char> dirty;
+    std::vector<int> changed;
+    std::vector<int> carried_slot;
+    std::vector<int> nn;
+    std::vector<float> nn_distances;
+
+    int allocateRegion(bool is_cluster);
+
+public:
+    ClusterCache() {}
+
+    void clear();
+    bool empty() const { return voxels.empty(); }
+
+    //Split indices into the clusters carried over from the last frame and
+    //the points that have to be segmented again. Without a usable cache, or
+    //if more than half the points changed, everything is segmented again.
+    //search is masked to indices on the way.
+    void diff(const PointCloud::ConstPtr& cloud, const std::vector<boost::uint64_t>& voxel_keys,
+              const pcl::IndicesPtr& indices, VoxelSearch& search, int neighbours,
+              int change_threshold, std::vector<pcl::PointIndices>& carried,
+              std::vector<ClusterSummary>& carried_summaries, std::vector<int>& resegment);
+
+    //Record the regions grown over the points diff() asked for. Regions of
+    //more than max_size points, or holding background, are background; the
+    //rest get IDs, and the ones of at least min_size points come out as
+    //clusters.
+    void update(const std::vector<boost::uint64_t>& voxel_keys,
+                const std::vector<pcl::PointIndices>& regions, int min_size, int max_size,
+                std::vector<pcl::PointIndices>& found,
+                std::vector<ClusterSummary>& found_summaries);
+
+    //Keep the colors and boxes worked out for the cached clusters
+    void storeSummaries(const std::vector<ClusterSummary>& summaries);
+
+    size_t getLastChanged() const { return changed.size(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef BAXTER_DEMOS_CLUSTER_VIEW_H_
+#define BAXTER_DEMOS_CLUSTER_VIEW_H_
+
+#include <cstddef>
+#include <vector>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+
+namespace baxter_demos{
+
+// The points of a cluster as a span of indices into the frame's cloud.
+// Reads like a cloud (size() and operator[]), so the box fitting and color
+// averaging code runs on it as is, but no point is copied. The cloud and
+// the indices have to outlive the view.
+template<typename PointT>
+struct ClusterView {
+    const pcl::PointCloud<PointT>* cloud;
+    const int* indices;
+    size_t count;
+
+    ClusterView(const pcl::PointCloud<PointT>& c, const pcl::PointIndices& cluster)
+        : cloud(&c), indices(cluster.indices.empty() ? NULL : &cluster.indices[0]),
+          count(cluster.indices.size()) {}
+
+    ClusterView(const pcl::PointCloud<PointT>& c, const int* begin, const int* end)
+        : cloud(&c), indices(begin), count(end - begin) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const PointT& operator[](size_t i) const {
+        return cloud->points[indices[i]];
+    }
+};
+
+}
+
+#endif
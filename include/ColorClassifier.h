@@ -0,0 +1,98 @@
+#ifndef BAXTER_DEMOS_COLOR_CLASSIFIER_H_
+#define BAXTER_DEMOS_COLOR_CLASSIFIER_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace baxter_demos{
+
+// Answers "which of the target colors is this color within radius of in
+// HSV" with a table lookup instead of two RGB->HSV conversions per test.
+//
+// Colors are quantized to 6 bits per channel. A shared table holds the HSV
+// value of every quantized color (computed once, with the same conversion
+// and integer truncation as CloudSegmenter::isPointWithinDesiredRange), and
+// each classifier keeps a table with one bit per target for every color.
+// That table is only rebuilt when the targets or the radius change, and
+// classifying against many targets costs the same single lookup.
+//
+// Quantization moves a color up to half a bin, so colors near the edge of
+// a target's range can come out either way. That is fine for gating
+// points, not for a decision that rests on one color: matchExact() does the
+// two conversions, for things like a cluster's average color.
+class ColorClassifier {
+public:
+    static const int bits = 6;
+    static const int table_size = 1 << (3*bits);
+
+    //Bit t is set if the color matches target t
+    typedef boost::uint32_t TargetMask;
+    static const int max_targets = 32;
+
+    struct HSV {
+        boost::int16_t h, s, v;
+    };
+
+    //Kept as separate arrays so the accept table build vectorizes
+    struct HSVTable {
+        std::vector<boost::int16_t> h, s, v;
+    };
+
+private:
+    std::vector<pcl::PointRGB> targets;
+    int radius;
+    bool configured;
+    std::vector<TargetMask> accept;
+
+    static const HSVTable& hsvTable();
+    static void buildHSVTable();
+    static HSV toHSV(boost::uint8_t r, boost::uint8_t g, boost::uint8_t b);
+
+public:
+    ColorClassifier();
+
+    //Rebuild the accept table if anything changed. Targets past max_targets
+    //are ignored.
+    void setTargets(const std::vector<pcl::PointRGB>& colors, int color_radius);
+    void setTarget(const pcl::PointRGB& desired_color, int color_radius){
+        setTargets(std::vector<pcl::PointRGB>(1, desired_color), color_radius);
+    }
+
+    static bool sameColors(const std::vector<pcl::PointRGB>& a,
+                           const std::vector<pcl::PointRGB>& b);
+
+    static inline int tableIndex(boost::uint8_t r, boost::uint8_t g, boost::uint8_t b){
+        return ((r >> (8 - bits)) << (2*bits)) | ((g >> (8 - bits)) << bits) |
+               (b >> (8 - bits));
+    }
+
+    static HSV lookupHSV(boost::uint8_t r, boost::uint8_t g, boost::uint8_t b);
+
+    TargetMask match(boost::uint8_t r, boost::uint8_t g, boost::uint8_t b) const {
+        return accept[tableIndex(r, g, b)];
+    }
+
+    //Same test as match(), on the exact HSV of the color and the targets
+    //(CloudSegmenter::isPointWithinDesiredRange for each target). Needs no
+    //table.
+    static TargetMask matchExact(const std::vector<pcl::PointRGB>& targets, int radius,
+                                 boost::uint8_t r, boost::uint8_t g, boost::uint8_t b);
+
+    //Within range of any target
+    bool contains(boost::uint8_t r, boost::uint8_t g, boost::uint8_t b) const {
+        return accept[tableIndex(r, g, b)] != 0;
+    }
+
+    //Append the indices whose point is within range of any target to accepted
+    void classify(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                  const std::vector<int>& indices,
+                  std::vector<int>& accepted) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef BAXTER_DEMOS_FLAT_HASH_MAP_H_
+#define BAXTER_DEMOS_FLAT_HASH_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+namespace baxter_demos{
+
+// Hash map from 64 bit keys (voxel keys) to small values, stored in one
+// array with linear probing. Unlike boost::unordered_map, inserting doesn't
+// allocate a node per entry, and clear() keeps the storage and only bumps
+// a generation, so a map that is refilled every frame stops allocating
+// once it has grown to the largest frame.
+//
+// Pointers to values stay valid until the next insert or erase.
+template<typename Value>
+class FlatHashMap {
+private:
+    struct Entry {
+        boost::uint64_t key;
+        //Entries of an older generation are empty
+        unsigned int generation;
+        Value value;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask;
+    size_t count;
+    unsigned int generation;
+
+    static size_t hash(boost::uint64_t key){
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return (size_t) key;
+    }
+
+    bool occupied(size_t i) const { return entries[i].generation == generation; }
+
+    void grow(){
+        std::vector<Entry> old;
+        old.swap(entries);
+        const unsigned int old_generation = generation;
+        entries.resize(old.empty() ? 64 : old.size()*2);
+        mask = entries.size() - 1;
+        generation = 1;
+        for(size_t i = 0; i < entries.size(); i++){
+            entries[i].generation = 0;
+        }
+        count = 0;
+        for(size_t i = 0; i < old.size(); i++){
+            if(old[i].generation == old_generation){
+                insert(old[i].key, old[i].value);
+            }
+        }
+    }
+
+public:
+    FlatHashMap() : mask(0), count(0), generation(1) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear(){
+        count = 0;
+        generation++;
+        if(generation == 0){
+            //Wrapped around: stale entries could look current again
+            for(size_t i = 0; i < entries.size(); i++){
+                entries[i].generation = 0;
+            }
+            generation = 1;
+        }
+    }
+
+    //Exchange contents with other without copying either
+    void swap(FlatHashMap& other){
+        entries.swap(other.entries);
+        std::swap(mask, other.mask);
+        std::swap(count, other.count);
+        std::swap(generation, other.generation);
+    }
+
+    //Room for n entries without growing
+    void reserve(size_t n){
+        while(entries.size() < 2*n){
+            grow();
+        }
+    }
+
+    Value* find(boost::uint64_t key){
+        if(entries.empty()){
+            return NULL;
+        }
+        for(size_t i = hash(key) & mask; occupied(i); i = (i + 1) & mask){
+            if(entries[i].key == key){
+                return &entries[i].value;
+            }
+        }
+        return NULL;
+    }
+
+    const Value* find(boost::uint64_t key) const {
+        return const_cast<FlatHashMap*>(this)->find(key);
+    }
+
+    //The value for key, and whether it was inserted; an existing value is
+    //left alone
+    std::pair<Value*, bool> insert(boost::uint64_t key, const Value& value){
+        //At most half full, so probe sequences stay short
+        if(2*(count + 1) > entries.size()){
+            grow();
+        }
+        size_t i = hash(key) & mask;
+        for(; occupied(i); i = (i + 1) & mask){
+            if(entries[i].key == key){
+                return std::make_pair(&entries[i].value, false);
+            }
+        }
+        entries[i].key = key;
+        entries[i].generation = generation;
+        entries[i].value = value;
+        count++;
+        return std::make_pair(&entries[i].value, true);
+    }
+
+    //Backward shift deletion: later entries of the same probe sequence move
+    //up into the hole, so lookups never need tombstones
+    bool erase(boost::uint64_t key){
+        if(entries.empty()){
+            return false;
+        }
+        size_t i = hash(key) & mask;
+        for(; occupied(i); i = (i + 1) & mask){
+            if(entries[i].key == key){
+                break;
+            }
+        }
+        if(!occupied(i)){
+            return false;
+        }
+        size_t hole = i;
+        for(size_t j = (i + 1) & mask; occupied(j); j = (j + 1) & mask){
+            const size_t home = hash(entries[j].key) & mask;
+            //Move j into the hole unless its home lies cyclically in (hole, j]
+            const bool stays = hole <= j ? (hole < home && home <= j)
+                                         : (hole < home || home <= j);
+            if(!stays){
+                entries[hole] = entries[j];
+                hole = j;
+            }
+        }
+        entries[hole].generation = 0;
+        count--;
+        return true;
+    }
+};
+
+}
+
+#endif
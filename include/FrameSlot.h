@@ -0,0 +1,96 @@
+#ifndef BAXTER_DEMOS_FRAME_SLOT_H_
+#define BAXTER_DEMOS_FRAME_SLOT_H_
+
+#include <cstddef>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+namespace baxter_demos{
+
+// Single-slot handoff between two pipeline stages. put() never blocks: if the
+// consumer hasn't picked up the previous value yet, it is overwritten and
+// counted as dropped, so the consumer always gets the newest frame.
+template<typename T>
+class FrameSlot {
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    T value;
+    bool full;
+    bool closed;
+    size_t dropped;
+
+public:
+    FrameSlot() : full(false), closed(false), dropped(0) {}
+
+    void put(const T& v){
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            if(full){
+                dropped++;
+            }
+            value = v;
+            full = true;
+        }
+        cond.notify_one();
+    }
+
+    //Blocks until a value is available; returns false once the slot is closed
+    bool take(T& out){
+        boost::mutex::scoped_lock lock(mutex);
+        while(!full && !closed){
+            cond.wait(lock);
+        }
+        if(!full){
+            return false;
+        }
+        out = value;
+        value = T();
+        full = false;
+        return true;
+    }
+
+    //Like take(), but gives up after timeout. Returns false on timeout too;
+    //check isClosed() to tell the two apart.
+    bool take(T& out, const boost::posix_time::time_duration& timeout){
+        const boost::system_time deadline = boost::get_system_time() + timeout;
+        boost::mutex::scoped_lock lock(mutex);
+        while(!full && !closed){
+            if(!cond.timed_wait(lock, deadline)){
+                break;
+            }
+        }
+        if(!full){
+            return false;
+        }
+        out = value;
+        value = T();
+        full = false;
+        return true;
+    }
+
+    bool isClosed(){
+        boost::mutex::scoped_lock lock(mutex);
+        return closed;
+    }
+
+    //Wake up the consumer for shutdown
+    void close(){
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            closed = true;
+        }
+        cond.notify_all();
+    }
+
+    size_t getDropped(){
+        boost::mutex::scoped_lock lock(mutex);
+        return dropped;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef BAXTER_DEMOS_FRAME_WORKSPACE_H_
+#define BAXTER_DEMOS_FRAME_WORKSPACE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+
+#include <pcl/PointIndices.h>
+
+namespace baxter_demos{
+
+// Frames are the pipeline's workspace: a frame that has left the pipeline
+// is handed out again, and every stage refills the buffers of the frame it
+// is given instead of allocating new ones. Once the buffers have grown to
+// the largest frame seen, a frame in steady state allocates nothing.
+//
+// A buffer is only refilled if the frame holds the only reference to it;
+// anything that was published or kept for a viewer is left alone and
+// replaced.
+//
+// unique() is a relaxed read of the reference count. Whoever dropped the
+// last other reference may have been using the buffer on another thread
+// right before, so an acquire fence follows a unique() that comes back
+// true; it pairs with the release in the other thread's decrement, and
+// the refill can't overlap what that thread did with the buffer.
+
+//Point ptr at an object to refill: the one it points at if nobody else
+//holds it, otherwise a new one. Returns whether it had to allocate.
+template<typename T>
+bool recycle(boost::shared_ptr<T>& ptr){
+    if(ptr && ptr.unique()){
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        return false;
+    }
+    ptr = boost::shared_ptr<T>(new T);
+    return true;
+}
+
+//Make clusters n empty clusters, keeping the storage of the ones that are
+//already there
+inline void resetClusters(std::vector<pcl::PointIndices>& clusters, size_t n){
+    clusters.resize(n);
+    for(size_t i = 0; i < n; i++){
+        clusters[i].indices.clear();
+    }
+}
+
+// Frames to recycle. A frame is free again once the pool holds the only
+// reference to it, like the spatial indices in SegmentationPipeline. Only
+// one thread may acquire.
+template<typename Frame>
+class FramePool {
+public:
+    typedef boost::shared_ptr<Frame> FramePtr;
+
+private:
+    std::vector<FramePtr> frames;
+
+public:
+    //A free frame, with its buffers as the last frame that used it left
+    //them. allocated is set if the pool had to make a new one.
+    FramePtr acquire(bool& allocated){
+        allocated = false;
+        for(size_t i = 0; i < frames.size(); i++){
+            if(frames[i].unique()){
+                boost::atomic_thread_fence(boost::memory_order_acquire);
+                return frames[i];
+            }
+        }
+        allocated = true;
+        frames.push_back(FramePtr(new Frame));
+        return frames.back();
+    }
+
+    size_t size() const { return frames.size(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef BAXTER_DEMOS_IMAGE_ROI_H_
+#define BAXTER_DEMOS_IMAGE_ROI_H_
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+namespace baxter_demos{
+
+// Pinhole intrinsics of the image an organized cloud comes from (the K of a
+// sensor_msgs/CameraInfo). width and height are the image size they were
+// calibrated for; clouds of another resolution are scaled to match.
+struct CameraIntrinsics {
+    float fx, fy, cx, cy;
+    unsigned int width, height;
+
+    CameraIntrinsics() : fx(0), fy(0), cx(0), cy(0), width(0), height(0) {}
+
+    bool valid() const { return fx > 0 && fy > 0 && width > 0 && height > 0; }
+
+    //The same camera for an image of w x h pixels
+    CameraIntrinsics scaled(unsigned int w, unsigned int h) const;
+
+    //Pixel that p (camera frame: z forward, x right, y down) lands on;
+    //false if p is not in front of the camera
+    bool project(const Eigen::Vector3f& p, float& u, float& v) const {
+        if(!(p[2] > 0)){
+            return false;
+        }
+        u = fx*p[0]/p[2] + cx;
+        v = fy*p[1]/p[2] + cy;
+        return true;
+    }
+};
+
+// The pixels of an organized cloud worth looking at, as a union of
+// rectangles. Rectangles may overlap; spans() merges them row by row so that
+// no pixel is visited twice.
+//
+// An empty ROI means the whole image.
+class ImageROI {
+public:
+    //Columns [begin, end) of one row
+    struct Span {
+        int row, begin, end;
+
+        bool operator<(const Span& o) const {
+            return row < o.row || (row == o.row && begin < o.begin);
+        }
+    };
+
+private:
+    unsigned int width, height;
+    std::vector<Span> rows;
+    bool merged;
+
+    void merge();
+
+public:
+    ImageROI() : width(0), height(0), merged(true) {}
+
+    //Forget every rectangle, for an image of width x height pixels
+    void reset(unsigned int w, unsigned int h);
+    bool empty() const { return rows.empty(); }
+
+    //Columns [u_min, u_max) of rows [v_min, v_max), clipped to the image
+    void addRect(int u_min, int v_min, int u_max, int v_max);
+
+    //The pixels a cube of side 2*half_side around center (in the camera
+    //frame: z forward, x right, y down) can cover. Fails without adding
+    //anything if the cube reaches behind the camera.
+    bool addCube(const CameraIntrinsics& camera, const Eigen::Vector3f& center,
+                 float half_side);
+
+    //Row spans in row order, disjoint within each row
+    const std::vector<Span>& spans();
+    //Pixels covered
+    size_t area();
+};
+
+}
+
+#endif
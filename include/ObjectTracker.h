@@ -0,0 +1,132 @@
+#ifndef BAXTER_DEMOS_OBJECT_TRACKER_H_
+#define BAXTER_DEMOS_OBJECT_TRACKER_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <Eigen/Eigen>
+#include <Eigen/StdVector>
+
+#include "UnionFind.h"
+#include "FlatHashMap.h"
+
+namespace baxter_demos{
+
+struct Track {
+    int id;
+    //What kind of object this is (e.g. which target color); detections only
+    //match tracks with the same label
+    int label;
+    //Filtered state
+    Eigen::Vector3f position;
+    Eigen::Vector3f velocity;
+    Eigen::Quaternionf orientation;
+    //Consecutive frames with and without a detection
+    int hits;
+    int misses;
+    //Set once hits reaches min_hits; only confirmed tracks are reported
+    bool confirmed;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+//Quaternionf is 16 byte aligned, so containers need Eigen's allocator
+typedef std::vector<Track, Eigen::aligned_allocator<Track> > TrackList;
+typedef std::vector<Eigen::Quaternionf, Eigen::aligned_allocator<Eigen::Quaternionf> >
+        QuaternionList;
+
+struct TrackerUpdate {
+    TrackList added;
+    TrackList moved;
+    TrackList removed;
+
+    void clear(){
+        added.clear();
+        moved.clear();
+        removed.clear();
+    }
+};
+
+// Keeps persistent IDs on the detected objects from frame to frame.
+//
+// Every track predicts its position with a constant velocity model. The
+// predictions go into a hash grid with cells one gate wide, so each
+// detection only looks at the tracks in the 27 cells around it. Candidate
+// pairs split into independent clusters (union-find over tracks and
+// detections), and each cluster is assigned with the Hungarian method, which
+// gives the assignment with the smallest total squared distance. Matched
+// tracks are corrected with an alpha-beta filter, unmatched detections start
+// new tracks and tracks that miss more than max_misses frames are dropped.
+class ObjectTracker {
+public:
+    ObjectTracker();
+
+    //Detections further than gate from a prediction are never matched to it
+    void setGate(float g){ gate = g; }
+    void setMaxMisses(int m){ max_misses = m; }
+    void setMinHits(int h){ min_hits = h; }
+    //Alpha-beta filter gains for position and velocity
+    void setGains(float a, float b){ alpha = a; beta = b; }
+
+    //Detections are in a fixed frame, stamp is in seconds
+    void update(const std::vector<Eigen::Vector3f>& positions,
+                const QuaternionList& orientations,
+                const std::vector<int>& labels,
+                double stamp, TrackerUpdate& result);
+
+    const TrackList& getTracks() const { return tracks; }
+
+    void clear();
+
+private:
+    //Cell key to the first track in it; the rest follow through grid_next
+    typedef FlatHashMap<int> CellMap;
+
+    //Dense Hungarian working space
+    struct HungarianScratch {
+        std::vector<double> u, v, minv;
+        std::vector<int> p, way;
+        std::vector<char> used;
+    };
+
+    float gate;
+    int max_misses;
+    int min_hits;
+    float alpha;
+    float beta;
+
+    TrackList tracks;
+    int next_id;
+    double last_stamp;
+    bool has_stamp;
+
+    //Scratch space, kept between frames
+    std::vector<Eigen::Vector3f> predicted;
+    CellMap grid;
+    std::vector<int> grid_next;
+    UnionFind clusters;
+    //Members of the first num_clusters clusters; later ones keep their
+    //storage for the next frame
+    std::vector<int> cluster_slot;
+    std::vector<std::vector<int> > cluster_tracks;
+    std::vector<std::vector<int> > cluster_detections;
+    size_t num_clusters;
+    std::vector<int> track_match;
+    std::vector<int> detection_match;
+    std::vector<double> cost;
+    std::vector<int> assignment;
+    HungarianScratch hungarian_scratch;
+
+    boost::uint64_t cellKey(const Eigen::Vector3f& p, int dx, int dy, int dz) const;
+    void assignCluster(const std::vector<int>& cluster_tracks,
+                       const std::vector<int>& cluster_detections,
+                       const std::vector<Eigen::Vector3f>& positions,
+                       const std::vector<int>& labels);
+    static void hungarian(const std::vector<double>& cost, int n,
+                          std::vector<int>& row_assignment, HungarianScratch& scratch);
+};
+
+}
+
+#endif
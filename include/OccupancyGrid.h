@@ -0,0 +1,66 @@
+#ifndef BAXTER_DEMOS_OCCUPANCY_GRID_H_
+#define BAXTER_DEMOS_OCCUPANCY_GRID_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <Eigen/Eigen>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace baxter_demos{
+
+// The voxels of a fixed frame (the robot's base) that hold obstacle points,
+// and how they changed since the last frame. Voxels are kept as sorted keys
+// (CloudPreprocessor::voxelKey), so the change between two frames is two
+// set differences and costs the number of occupied voxels, not points.
+//
+// A voxel is occupied if at least min_points points fall into it, which
+// keeps single noisy points out of the planning scene. Like SceneDiffer,
+// every resync_period seconds the whole grid is reported again, so that a
+// receiver that missed a change catches up.
+class OccupancyGrid {
+public:
+    OccupancyGrid();
+
+    void setVoxelSize(float size);
+    void setMinPoints(int n){ min_points = n; }
+    //0 never resyncs
+    void setResyncPeriod(double seconds){ resync_period = seconds; }
+    float getVoxelSize() const { return voxel_size; }
+
+    //Occupancy of the points of cloud at indices, with (rotation,
+    //translation) taking them into the fixed frame, at stamp (seconds).
+    //added and removed get the keys of the voxels that changed. On a resync
+    //(the first frame after clear() or a change of voxel size, and every
+    //resync_period seconds) every voxel is added and this returns true.
+    bool update(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                const std::vector<int>& indices,
+                const Eigen::Matrix3f& rotation, const Eigen::Vector3f& translation,
+                double stamp, std::vector<boost::uint64_t>& added,
+                std::vector<boost::uint64_t>& removed);
+
+    //Keys of the occupied voxels, sorted
+    const std::vector<boost::uint64_t>& getVoxels() const { return occupied; }
+
+    //Forget the last frame; the next update reports every voxel
+    void clear();
+
+private:
+    float voxel_size;
+    int min_points;
+    double resync_period;
+    bool has_frame;
+    double last_resync;
+
+    std::vector<boost::uint64_t> occupied;
+    //Scratch, kept between frames
+    std::vector<boost::uint64_t> keys;
+    std::vector<boost::uint64_t> next;
+};
+
+}
+
+#endif
@@ -1,10 +1,24 @@
 #ifndef ORIENTED_BOUNDING_BOX_H
 #define ORIENTED_BOUNDING_BOX_H
 
+#include <limits>
+#include <vector>
+
 #include <Eigen/Eigen>
 #include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
 
-//TODO:
+// Box conventions follow pcl::MomentOfInertiaEstimation::getOBB: the
+// rotation's columns are the major, middle and minor axes of the point
+// distribution, position is the box center and min/max are the corners in
+// the box frame.
+//
+// The box also carries the point count, sum and sum of outer products it
+// was fit from. Those are all that is needed for the axes, so boxes can be
+// merged without their points: their statistics add up and the extents come
+// from projecting every box's corners onto the new axes. A group of boxes
+// is best merged in one go (merge_group), since each merge can leave some
+// slack around the corners and merging one box at a time piles it up.
 
 class OrientedBoundingBox {
     Eigen::Vector3f min_point_OBB;
@@ -15,8 +29,80 @@ class OrientedBoundingBox {
     //keeping these around for kicks
     Eigen::Vector3f min_point_AABB;
     Eigen::Vector3f max_point_AABB;
+
+    //Accumulated second order moments
+    size_t count;
+    Eigen::Vector3d sum;
+    Eigen::Matrix3d sum_sq;
+
+    void clear_statistics(){
+        count = 0;
+        sum.setZero();
+        sum_sq.setZero();
+        const float inf = std::numeric_limits<float>::max();
+        min_point_AABB = Eigen::Vector3f(inf, inf, inf);
+        max_point_AABB = -min_point_AABB;
+    }
+
+    void add_point(const Eigen::Vector3f& p){
+        const Eigen::Vector3d pd = p.cast<double>();
+        count++;
+        sum += pd;
+        sum_sq += pd*pd.transpose();
+        min_point_AABB = min_point_AABB.cwiseMin(p);
+        max_point_AABB = max_point_AABB.cwiseMax(p);
+    }
+
+    //Mean and principal axes from the accumulated moments
+    void compute_axes(Eigen::Vector3f& mean, Eigen::Matrix3f& axes) const {
+        const Eigen::Vector3d m = sum/(double) count;
+        const Eigen::Matrix3d covariance = sum_sq/(double) count - m*m.transpose();
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+        //Eigenvalues come sorted in increasing order
+        const Eigen::Vector3f major = solver.eigenvectors().col(2).cast<float>();
+        const Eigen::Vector3f middle = solver.eigenvectors().col(1).cast<float>();
+        axes.col(0) = major;
+        axes.col(1) = middle;
+        axes.col(2) = major.cross(middle);
+        mean = m.cast<float>();
+    }
+
+    void add_statistics(const OrientedBoundingBox& box){
+        count += box.count;
+        sum += box.sum;
+        sum_sq += box.sum_sq;
+        min_point_AABB = min_point_AABB.cwiseMin(box.min_point_AABB);
+        max_point_AABB = max_point_AABB.cwiseMax(box.max_point_AABB);
+    }
+
+    //Grow [lo, hi] to box's corners, measured from mean along the axes
+    //to_local maps to
+    static void extend_to_corners(const OrientedBoundingBox& box, const Eigen::Vector3f& mean,
+                                  const Eigen::Matrix3f& to_local,
+                                  Eigen::Vector3f& lo, Eigen::Vector3f& hi){
+        Eigen::Vector3f corners[8];
+        box.get_corners(corners);
+        for(int i = 0; i < 8; i++){
+            const Eigen::Vector3f local = to_local*(corners[i] - mean);
+            lo = lo.cwiseMin(local);
+            hi = hi.cwiseMax(local);
+        }
+    }
+
+    //Center the box on local extents [lo, hi] measured from mean along axes
+    void set_extents(const Eigen::Vector3f& mean, const Eigen::Matrix3f& axes,
+                     const Eigen::Vector3f& lo, const Eigen::Vector3f& hi){
+        const Eigen::Vector3f shift = (lo + hi)/2;
+        rotational_matrix_OBB = axes;
+        position_OBB = mean + axes*shift;
+        min_point_OBB = lo - shift;
+        max_point_OBB = hi - shift;
+    }
+
     public:
-    OrientedBoundingBox() {}
+    OrientedBoundingBox() {
+        clear_statistics();
+    }
 
     OrientedBoundingBox(Eigen::Vector3f min_point_O,
                         Eigen::Vector3f max_point_O,
@@ -24,10 +110,11 @@ class OrientedBoundingBox {
                         Eigen::Matrix3f rotational_matrix_O,
                         Eigen::Vector3f min_point_AA,
                         Eigen::Vector3f max_point_AA ){
+        clear_statistics();
         min_point_OBB = min_point_O;
         max_point_OBB = max_point_O;
         position_OBB = position_O;
-        rotational_matrix_O = rotational_matrix_O;
+        rotational_matrix_OBB = rotational_matrix_O;
         min_point_AABB = min_point_AA;
         max_point_AABB = max_point_AA;
     }
@@ -38,6 +125,7 @@ class OrientedBoundingBox {
                         Eigen::Matrix3f rotational_matrix_O,
                         pcl::PointXYZRGB min_point_AA,
                         pcl::PointXYZRGB max_point_AA){
+        clear_statistics();
         min_point_OBB = Eigen::Vector3f(min_point_O.x, min_point_O.y, min_point_O.z);
         max_point_OBB = Eigen::Vector3f(max_point_O.x, max_point_O.y, max_point_O.z);
         position_OBB  = Eigen::Vector3f(position_O.x, position_O.y, position_O.z);
@@ -71,6 +159,13 @@ class OrientedBoundingBox {
         return rotational_matrix_OBB;
     }
 
+    Eigen::Vector3f get_min_point_AABB() const {
+        return min_point_AABB;
+    }
+    Eigen::Vector3f get_max_point_AABB() const {
+        return max_point_AABB;
+    }
+
     void set_min_point(Eigen::Vector3f min_point_O){
         min_point_OBB = min_point_O;
     }
@@ -84,17 +179,105 @@ class OrientedBoundingBox {
         rotational_matrix_OBB = rotational_matrix_O;
     }
 
+    size_t get_count() const {
+        return count;
+    }
+
     Eigen::Vector3f get_sides(){
-        //Calculate the length of a side based on min_point, max_point and rotation
-        Eigen::Matrix3f rot_inv = rotational_matrix_OBB.inverse();
+        //min_point and max_point are already in the box frame
+        return max_point_OBB - min_point_OBB;
+    }
+
+    //Corners of the box in the frame of the points
+    //The 8 corners into corners[0..7]
+    void get_corners(Eigen::Vector3f* corners) const {
+        for(int i = 0; i < 8; i++){
+            Eigen::Vector3f local((i & 1) ? max_point_OBB[0] : min_point_OBB[0],
+                                  (i & 2) ? max_point_OBB[1] : min_point_OBB[1],
+                                  (i & 4) ? max_point_OBB[2] : min_point_OBB[2]);
+            corners[i] = position_OBB + rotational_matrix_OBB*local;
+        }
+    }
+
+    void get_corners(std::vector<Eigen::Vector3f>& corners) const {
+        Eigen::Vector3f box_corners[8];
+        get_corners(box_corners);
+        corners.insert(corners.end(), box_corners, box_corners + 8);
+    }
+
+    //Fit the box to points: one pass for the moments, one to measure
+    //extents. Points is anything with size() and operator[] that gives
+    //PCL points, e.g. a pcl::PointCloud or a baxter_demos::ClusterView.
+    template<typename Points>
+    static OrientedBoundingBox fit(const Points& points){
+        OrientedBoundingBox box;
+        for(size_t i = 0; i < points.size(); i++){
+            box.add_point(points[i].getVector3fMap());
+        }
+        if(box.count == 0){
+            return box;
+        }
+        Eigen::Vector3f mean;
+        Eigen::Matrix3f axes;
+        box.compute_axes(mean, axes);
+
+        const float inf = std::numeric_limits<float>::max();
+        Eigen::Vector3f lo(inf, inf, inf), hi(-inf, -inf, -inf);
+        const Eigen::Matrix3f to_local = axes.transpose();
+        for(size_t i = 0; i < points.size(); i++){
+            const Eigen::Vector3f local = to_local*(points[i].getVector3fMap() - mean);
+            lo = lo.cwiseMin(local);
+            hi = hi.cwiseMax(local);
+        }
+        box.set_extents(mean, axes, lo, hi);
+        return box;
+    }
+
+    //Grow this box to cover input_box as well, without touching any points.
+    //The extents are those of both boxes' corners along the merged axes, so
+    //the result contains every point of both, possibly with some slack.
+    void merge(const OrientedBoundingBox& input_box){
+        const OrientedBoundingBox self = *this;
+        add_statistics(input_box);
+
+        Eigen::Vector3f mean;
+        Eigen::Matrix3f axes;
+        compute_axes(mean, axes);
+
+        const float inf = std::numeric_limits<float>::max();
+        Eigen::Vector3f lo(inf, inf, inf), hi(-inf, -inf, -inf);
+        const Eigen::Matrix3f to_local = axes.transpose();
+        extend_to_corners(self, mean, to_local, lo, hi);
+        extend_to_corners(input_box, mean, to_local, lo, hi);
+        set_extents(mean, axes, lo, hi);
+    }
 
-        //First rotate min_point and max_point
-        Eigen::Vector3f min_point = rot_inv * min_point;
-        Eigen::Vector3f max_point = rot_inv * max_point;
+    //The box over boxes[members[0]], ..., boxes[members[n - 1]]: the axes
+    //come from all of their moments at once, the extents from all of their
+    //own corners, so the slack is that of a single merge however many
+    //boxes there are.
+    static OrientedBoundingBox merge_group(const std::vector<OrientedBoundingBox>& boxes,
+                                           const int* members, size_t n){
+        OrientedBoundingBox merged = boxes[members[0]];
+        if(n == 1){
+            return merged;
+        }
+        for(size_t i = 1; i < n; i++){
+            merged.add_statistics(boxes[members[i]]);
+        }
 
-        //Translate by the inverse of the new min_point
-        return max_point - min_point;
+        Eigen::Vector3f mean;
+        Eigen::Matrix3f axes;
+        merged.compute_axes(mean, axes);
 
+        const float inf = std::numeric_limits<float>::max();
+        Eigen::Vector3f lo(inf, inf, inf), hi(-inf, -inf, -inf);
+        const Eigen::Matrix3f to_local = axes.transpose();
+        for(size_t i = 0; i < n; i++){
+            extend_to_corners(boxes[members[i]], mean, to_local, lo, hi);
+        }
+        merged.set_extents(mean, axes, lo, hi);
+        return merged;
     }
 
     void set_sides(const float x, const float y, const float z){
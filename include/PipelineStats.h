@@ -0,0 +1,115 @@
+#ifndef BAXTER_DEMOS_PIPELINE_STATS_H_
+#define BAXTER_DEMOS_PIPELINE_STATS_H_
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace baxter_demos{
+
+// Rolling latency and throughput figures for each pipeline stage. Every
+// stage keeps its last window_size samples; summaries are computed from
+// those when somebody asks, so recording is just a lock and a store.
+//
+// Item counts are points for the point cloud stages and boxes for the box
+// stages. Next to the stages, a window of how many recycled buffers (see
+// FrameWorkspace.h) each frame had to replace with new ones shows whether
+// the pipeline has reached its steady state. That is not an allocation
+// count: vectors that grow, ROS messages and PCL's own temporaries are not
+// in it. segmentation_benchmark counts every allocation.
+class PipelineStats {
+public:
+    enum Stage {
+        CONVERSION,     //message to view, header conversion
+        FILTER,         //NaN removal, z passthrough and voxel grid (fused)
+        INDEX,          //spatial index update
+        OUTLIERS,
+        COLOR_GATE,
+        CHANGES,        //finding what to segment again, incremental only
+        REGION_GROWING,
+        COLOR_FILTER,   //picking the clusters of the desired color
+        OBB,
+        MERGE,
+        TF,
+        TRACKING,
+        PUBLISH,
+        NUM_STAGES
+    };
+
+    struct Summary {
+        size_t samples;
+        //milliseconds
+        double p50, p90, p99, max, mean;
+        //averages over the window
+        double items_in, items_out;
+    };
+
+    static const char* stageName(Stage stage);
+
+    PipelineStats(size_t window = 256);
+
+    void record(Stage stage, double milliseconds, size_t items_in, size_t items_out);
+    void summarize(Stage stage, Summary& summary);
+
+    //Buffers a frame had to allocate rather than reuse
+    void recordReplacedBuffers(size_t replaced_buffers);
+    //As summarize, with replaced buffer counts in place of milliseconds
+    void summarizeReplacedBuffers(Summary& summary);
+
+private:
+    struct Sample {
+        double milliseconds;
+        size_t items_in, items_out;
+    };
+    struct StageWindow {
+        std::vector<Sample> samples;
+        size_t next;
+    };
+
+    boost::mutex mutex;
+    size_t window_size;
+    StageWindow stages[NUM_STAGES];
+    StageWindow replaced_buffers;
+    std::vector<double> scratch;
+
+    void store(StageWindow& w, const Sample& sample);
+    void summarize(const StageWindow& w, Summary& summary);
+};
+
+// Times the enclosing scope into stats. With stats == NULL nothing is read
+// or recorded, so stages can be instrumented unconditionally.
+class ScopedStageTimer {
+private:
+    typedef boost::chrono::steady_clock Clock;
+
+    PipelineStats* stats;
+    PipelineStats::Stage stage;
+    size_t items_in;
+    size_t items_out;
+    Clock::time_point start;
+
+public:
+    ScopedStageTimer(PipelineStats* s, PipelineStats::Stage st, size_t in = 0) :
+            stats(s), stage(st), items_in(in), items_out(0) {
+        if(stats){
+            start = Clock::now();
+        }
+    }
+
+    void setItemsIn(size_t n){ items_in = n; }
+    void setItemsOut(size_t n){ items_out = n; }
+
+    ~ScopedStageTimer(){
+        if(stats){
+            const double ms = boost::chrono::duration<double, boost::milli>(
+                                    Clock::now() - start).count();
+            stats->record(stage, ms, items_in, items_out);
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef BAXTER_DEMOS_REGION_GROWER_H_
+#define BAXTER_DEMOS_REGION_GROWER_H_
+
+#include <vector>
+#include <utility>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+
+#include "VoxelSearch.h"
+#include "UnionFind.h"
+#include "FrameWorkspace.h"
+
+namespace baxter_demos{
+
+// Color region growing with the thresholds of pcl::RegionGrowingRGB, spread
+// over several threads.
+//
+// Instead of growing regions from seeds one at a time, the point stage is a
+// connected components pass: every point looks up its nearest neighbours
+// within distance_threshold and is united with the ones within
+// point_color_threshold of its own color. The points are split in equal
+// chunks between the threads, which all unite into one lock-free
+// union-find. The neighbours that fail the color test are kept as
+// candidate edges between segments. The threads are started the first
+// time they are needed and then wait for the next frame, so a frame never
+// pays for starting them.
+//
+// The rest runs on the calling thread and only visits segments:
+//  - adjacent segments whose mean colors are closer than
+//    region_color_threshold are merged,
+//  - regions smaller than min_cluster_size are merged into the adjacent
+//    region with the closest mean color,
+//  - regions between min_cluster_size and max_cluster_size points are the
+//    clusters.
+//
+// Components don't depend on the order the unions happen in, so the output
+// is the same for any number of threads: clusters are ordered by their
+// smallest point index and hold their indices in ascending order.
+class RegionGrower {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
+
+    //RegionGrowingRGB's region neighbour number
+    static const int default_neighbours = 100;
+
+private:
+    typedef std::pair<int, int> Edge;
+
+    struct Region {
+        int count;
+        double r, g, b;
+    };
+
+    float distance_threshold;
+    float point_color_threshold;
+    float region_color_threshold;
+    int min_cluster_size;
+    int max_cluster_size;
+    int neighbours;
+    int num_threads;
+
+    AtomicUnionFind points;
+    //Edges between points that failed the color test, one list per thread
+    std::vector<std::vector<Edge> > thread_edges;
+    //Neighbour search results, one buffer per thread
+    std::vector<std::vector<int> > thread_nn;
+    std::vector<std::vector<float> > thread_distances;
+
+    std::vector<int> segment_of;
+    std::vector<Region> regions;
+    std::vector<Edge> adjacency;
+    UnionFind region_sets;
+    std::vector<int> neighbour_offsets;
+    std::vector<int> neighbour_list;
+    std::vector<int> member_next;
+    std::vector<int> member_tail;
+    std::vector<int> cluster_of;
+
+    //Workers run linkPoints on the chunks the calling thread hands out.
+    //Everything below pool_mutex is guarded by it.
+    boost::thread_group workers;
+    boost::mutex pool_mutex;
+    boost::condition_variable work_ready;
+    boost::condition_variable work_done;
+    //Counts the jobs handed out
+    unsigned int generation;
+    bool stopping;
+    //Workers [0, job_workers) take part in the current job
+    int job_workers;
+    int pending;
+    const PointCloud* job_cloud;
+    const std::vector<int>* job_indices;
+    const VoxelSearch* job_search;
+    size_t job_chunk;
+
+    void startWorkers(int n);
+    void workerLoop(int worker, unsigned int started_at);
+    void linkPoints(const PointCloud& cloud, const std::vector<int>& indices,
+                    const VoxelSearch& search, size_t begin, size_t end, int thread);
+    void buildSegments(const std::vector<int>& indices);
+    void mergeRegions();
+    void absorbSmallRegions();
+    void grow(const PointCloud& cloud, const std::vector<int>& indices,
+              const VoxelSearch& search, std::vector<pcl::PointIndices>& clusters,
+              bool size_filter);
+
+    static float colorDistance(const Region& a, const Region& b);
+
+public:
+    RegionGrower();
+    ~RegionGrower();
+
+    void setDistanceThreshold(float d){ distance_threshold = d; }
+    void setPointColorThreshold(float t){ point_color_threshold = t; }
+    void setRegionColorThreshold(float t){ region_color_threshold = t; }
+    void setMinClusterSize(int n){ min_cluster_size = n; }
+    void setMaxClusterSize(int n){ max_cluster_size = n; }
+    //Neighbours each point looks at
+    void setNumberOfNeighbours(int k){ neighbours = k; }
+    //0 for one thread per core
+    void setNumberOfThreads(int n){ num_threads = n; }
+
+    //search has to be set up with cloud and indices already, so that it only
+    //returns points in indices
+    void extract(const PointCloud& cloud, const std::vector<int>& indices,
+                 const VoxelSearch& search, std::vector<pcl::PointIndices>& clusters);
+    //Every region, including the ones that are too big or still too small
+    //to be clusters
+    void extractRegions(const PointCloud& cloud, const std::vector<int>& indices,
+                        const VoxelSearch& search, std::vector<pcl::PointIndices>& all_regions);
+
+    //A copy of cloud with each cluster in its own color and everything else
+    //red, like RegionGrowingRGB::getColoredCloud. Empty without clusters.
+    static void colorClusters(const PointCloud& cloud,
+                              const std::vector<pcl::PointIndices>& clusters,
+                              PointCloud& colored);
+};
+
+}
+
+#endif
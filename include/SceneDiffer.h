@@ -0,0 +1,79 @@
+#ifndef BAXTER_DEMOS_SCENE_DIFFER_H_
+#define BAXTER_DEMOS_SCENE_DIFFER_H_
+
+#include <vector>
+
+#include <Eigen/Eigen>
+#include <Eigen/StdVector>
+
+#include "ObjectTracker.h"
+
+namespace baxter_demos{
+
+// Decides which changes to the confirmed tracks are worth sending to the
+// planning scene. It remembers the pose each object was last sent with and
+// only reports:
+//  - new objects (added), right away
+//  - objects that moved more than the translation or rotation threshold
+//    from the pose they were last sent with (moved), at most once per
+//    min_interval seconds each
+//  - objects that are no longer tracked (removed), right away
+//
+// Every resync_period seconds the whole scene goes out instead: added holds
+// every confirmed track, and receivers drop whatever they know that isn't
+// in it. A moved object that is held back by the rate limit is sent once
+// the interval has passed, as long as it is still past the threshold.
+class SceneDiffer {
+public:
+    SceneDiffer();
+
+    //Meters, and radians between orientations
+    void setThresholds(float translation, float rotation){
+        translation_threshold = translation;
+        rotation_threshold = rotation;
+    }
+    void setMinInterval(double seconds){ min_interval = seconds; }
+    //0 never resyncs
+    void setResyncPeriod(double seconds){ resync_period = seconds; }
+
+    //Changes since the last call for the tracks at stamp (seconds). Tracks
+    //have to be in ID order, as ObjectTracker keeps them. Returns whether
+    //this is a full resync.
+    bool update(const TrackList& tracks, double stamp, TrackerUpdate& result);
+
+    //Forget what was sent; the next update is a resync
+    void clear();
+
+private:
+    struct SentObject {
+        int id;
+        int label;
+        Eigen::Vector3f position;
+        Eigen::Quaternionf orientation;
+        double stamp;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<SentObject, Eigen::aligned_allocator<SentObject> > SentList;
+
+    float translation_threshold;
+    float rotation_threshold;
+    double min_interval;
+    double resync_period;
+
+    //In ID order
+    SentList sent;
+    double last_resync;
+    bool has_resync;
+
+    //Scratch, kept between calls
+    SentList next;
+
+    bool changed(const SentObject& object, const Track& track) const;
+    static void remember(const Track& track, double stamp, SentObject& object);
+    static void forget(const SentObject& object, TrackList& removed);
+};
+
+}
+
+#endif
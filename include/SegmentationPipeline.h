@@ -0,0 +1,281 @@
+#ifndef BAXTER_DEMOS_SEGMENTATION_PIPELINE_H_
+#define BAXTER_DEMOS_SEGMENTATION_PIPELINE_H_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+#include <pcl/segmentation/region_growing_rgb.h>
+
+#include "OrientedBoundingBox.h"
+#include "CloudPreprocessor.h"
+#include "CloudView.h"
+#include "ClusterView.h"
+#include "FrameWorkspace.h"
+#include "ImageROI.h"
+#include "VoxelSearch.h"
+#include "ColorClassifier.h"
+#include "RegionGrower.h"
+#include "ClusterCache.h"
+#include "UnionFind.h"
+#include "PipelineStats.h"
+
+namespace baxter_demos{
+
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointColorCloud;
+
+//Values loaded from the parameter server (see config/object_finder_3d.yaml).
+//The defaults are the ones in that file.
+struct SegmenterParams {
+    int radius;
+    int filter_min;
+    int filter_max;
+    int distance_threshold;
+    int point_color_threshold;
+    int region_color_threshold;
+    int min_cluster_size;
+    int max_cluster_size;
+    double tolerance;
+    float leaf_size;
+    double outlier_radius;
+    int min_neighbors;
+
+    float object_side;
+    double exclusion_padding;
+    int  sample_size;
+
+    //Drop points further than gate_radius from the desired color before
+    //region growing
+    bool color_gate;
+    int gate_radius;
+
+    //Use RegionGrower instead of pcl::RegionGrowingRGB, with region_threads
+    //threads (0 for one per core)
+    bool parallel_regions;
+    int region_threads;
+
+    //Only segment again what changed since the last frame (see
+    //ClusterCache), with a full segmentation every incremental_refresh
+    //frames. Voxels whose color moved more than change_threshold count as
+    //changed. Always grows regions with RegionGrower.
+    bool incremental;
+    int incremental_refresh;
+    int change_threshold;
+
+    //Only read the pixels around the confirmed tracks, padded by roi_padding
+    //meters, with a full frame every roi_full_scan frames and whenever a
+    //track goes missing
+    bool roi;
+    double roi_padding;
+    int roi_full_scan;
+
+    //Object tracking (see ObjectTracker)
+    double track_gate;
+    int track_max_misses;
+    int track_min_hits;
+    double track_alpha;
+    double track_beta;
+
+    //Planning scene updates (see SceneDiffer): an object is only sent again
+    //once it moved scene_translation_threshold meters or turned
+    //scene_rotation_threshold radians, at most every scene_min_interval
+    //seconds, with the whole scene every scene_resync_period seconds
+    double scene_translation_threshold;
+    double scene_rotation_threshold;
+    double scene_min_interval;
+    double scene_resync_period;
+
+    //Voxel side of /object_tracker/obstacle_voxels, and the points a voxel
+    //needs to count as occupied. Resyncs with the planning scene.
+    double occupancy_voxel;
+    int occupancy_min_points;
+
+    //Voxel size of /object_tracker/segmented_preview
+    double preview_leaf;
+
+    //Seconds a frame may wait for its camera to base transform
+    double tf_timeout;
+
+    //Publish stage timings on /diagnostics every diagnostics_period seconds
+    bool diagnostics;
+    double diagnostics_period;
+
+    SegmenterParams() : radius(6), filter_min(0), filter_max(4),
+                        distance_threshold(10), point_color_threshold(5),
+                        region_color_threshold(6), min_cluster_size(200),
+                        max_cluster_size(1000), tolerance(0.01), leaf_size(0.005),
+                        outlier_radius(0.008), min_neighbors(6),
+                        object_side(0.071), exclusion_padding(0.01), sample_size(100),
+                        color_gate(false), gate_radius(12),
+                        parallel_regions(false), region_threads(0),
+                        incremental(false), incremental_refresh(30), change_threshold(10),
+                        roi(false), roi_padding(0.05), roi_full_scan(15),
+                        track_gate(0.09), track_max_misses(5), track_min_hits(3),
+                        track_alpha(0.5), track_beta(0.1),
+                        scene_translation_threshold(0.01), scene_rotation_threshold(0.1),
+                        scene_min_interval(0.2), scene_resync_period(5.0),
+                        occupancy_voxel(0.02), occupancy_min_points(3),
+                        preview_leaf(0.02), tf_timeout(1.0), diagnostics(true), diagnostics_period(1.0) {}
+
+    //Whether the parameters a stage is configured with are the same
+    bool sameRegionGrowing(const SegmenterParams& o) const {
+        return distance_threshold == o.distance_threshold &&
+               point_color_threshold == o.point_color_threshold &&
+               region_color_threshold == o.region_color_threshold &&
+               min_cluster_size == o.min_cluster_size &&
+               max_cluster_size == o.max_cluster_size;
+    }
+
+    //Everything the clusters of a frame depend on
+    bool sameSegmentation(const SegmenterParams& o) const {
+        return sameRegionGrowing(o) && leaf_size == o.leaf_size &&
+               filter_min == o.filter_min && filter_max == o.filter_max &&
+               outlier_radius == o.outlier_radius && min_neighbors == o.min_neighbors &&
+               color_gate == o.color_gate && gate_radius == o.gate_radius &&
+               parallel_regions == o.parallel_regions;
+    }
+
+    bool sameTracking(const SegmenterParams& o) const {
+        return track_gate == o.track_gate && track_max_misses == o.track_max_misses &&
+               track_min_hits == o.track_min_hits && track_alpha == o.track_alpha &&
+               track_beta == o.track_beta;
+    }
+};
+
+// The part of a frame the segmentation core works on. Nothing in here
+// depends on ROS.
+struct PipelineFrame {
+    //Parameters and target colors as they were when the frame came in. A
+    //cluster belongs to the first target its average color matches.
+    SegmenterParams params;
+    std::vector<pcl::PointRGB> targets;
+
+    //Pixels of the input to read, empty for all of them. Set up before
+    //filter() for the size of the input.
+    ImageROI roi;
+    //Whether filter() only read the ROI. Cropped frames bypass the cluster
+    //cache, which has to see the whole scene.
+    bool cropped;
+
+    PointColorCloud::Ptr cloud;
+    pcl::IndicesPtr indices;
+    //The inliers that passed the color gate
+    pcl::IndicesPtr gate_indices;
+    VoxelSearch::Ptr search;
+    //Voxel of each point in cloud, only kept for incremental segmentation
+    std::vector<boost::uint64_t> voxel_keys;
+
+    std::vector<pcl::PointIndices> clusters;
+    //Average color and box of each cluster, as far as they are known
+    std::vector<ClusterSummary> summaries;
+    //Whether to make colored_cloud, the cloud with each cluster in its own
+    //color; NULL otherwise
+    bool color_clusters;
+    PointColorCloud::Ptr colored_cloud;
+    //Index into clusters of each cluster that matched a target
+    std::vector<int> target_clusters;
+    //Boxes around the clusters of the target colors, in the cloud's frame,
+    //with colliding boxes of the same target merged
+    std::vector<OrientedBoundingBox> boxes;
+    //Index into targets for each box
+    std::vector<int> box_targets;
+
+    //Where the stages record their timings; NULL to skip timing
+    PipelineStats* stats;
+    //Recycled buffers the stages had to replace with new ones for this
+    //frame instead of refilling them (see FrameWorkspace.h); not a count of
+    //allocations. Whoever starts the frame resets it; the stages add to it.
+    size_t replaced_buffers;
+
+    PipelineFrame() : cropped(false), color_clusters(true), stats(NULL), replaced_buffers(0) {}
+};
+
+// Preprocessing, segmentation and box fitting without ROS, so that the
+// same code runs in the nodelet and in offline tools.
+//
+// The stages are meant to be run in order on a frame. filter() and
+// removeOutliers() only touch the preprocessing state, growRegions() and
+// fitBoxes() only the segmentation state, so the two halves can run on
+// different threads with different frames.
+class SegmentationPipeline {
+private:
+    CloudPreprocessor preprocessor;
+    //Spatial indices handed out to frames, one per frame in flight. An index
+    //is free again once no frame holds a reference to it.
+    std::vector<VoxelSearch::Ptr> search_pool;
+    //Scratch for removeOutliers
+    std::vector<int> outlier_neighbors;
+    std::vector<float> outlier_distances;
+
+    pcl::RegionGrowingRGB<pcl::PointXYZRGB> reg;
+    //What reg was last configured with
+    SegmenterParams reg_params;
+    bool reg_configured;
+    RegionGrower grower;
+    SegmenterParams grower_params;
+    bool grower_configured;
+    ColorClassifier gate_classifier;
+
+    //Clusters of the last frame, and what they were segmented with
+    ClusterCache cluster_cache;
+    SegmenterParams cache_params;
+    std::vector<pcl::PointRGB> cache_targets;
+    int frames_since_refresh;
+    pcl::IndicesPtr grow_indices;
+    std::vector<pcl::PointIndices> found_regions;
+    std::vector<pcl::PointIndices> found_clusters;
+    std::vector<ClusterSummary> found_summaries;
+    //Scratch for mergeCollidingBoxes; merged_* swap with the frame's boxes
+    UnionFind merge_groups;
+    std::vector<std::pair<float, int> > merge_order;
+    std::vector<int> merge_active;
+    std::vector<int> merge_slot;
+    std::vector<int> merge_offsets;
+    std::vector<int> merge_members;
+    std::vector<OrientedBoundingBox> merged_boxes;
+    std::vector<int> merged_labels;
+
+    void configureGrower(const SegmenterParams& params);
+    void extractClusters(PipelineFrame& frame, const pcl::IndicesPtr& segment_indices,
+                         std::vector<pcl::PointIndices>& clusters);
+    void growRegionsIncremental(PipelineFrame& frame, const pcl::IndicesPtr& segment_indices);
+
+    VoxelSearch::Ptr acquireSearch(const SegmenterParams& params);
+
+public:
+    SegmentationPipeline() : reg_configured(false), grower_configured(false),
+                             frames_since_refresh(0) {}
+
+    //NaN removal, z crop and voxel grid straight out of the view (or the
+    //frame's ROI of it), then an update of the frame's spatial index
+    void filter(const CloudView& view, PipelineFrame& frame);
+    //Radius outlier removal; the inliers become frame.indices
+    void removeOutliers(PipelineFrame& frame);
+    //Region growing over the inliers (or the ones passing the color gate).
+    //The last stage to use frame.search, which lets go of the frame's
+    //cloud and indices afterwards.
+    void growRegions(PipelineFrame& frame);
+    //Keep the clusters of the target colors and box them
+    void fitBoxes(PipelineFrame& frame);
+
+    void preprocess(const CloudView& view, PipelineFrame& frame){
+        filter(view, frame);
+        removeOutliers(frame);
+    }
+
+    void segment(PipelineFrame& frame){
+        growRegions(frame);
+        fitBoxes(frame);
+    }
+
+    //Only boxes with the same label are merged
+    void mergeCollidingBoxes(std::vector<OrientedBoundingBox>& boxes,
+                             std::vector<int>& labels);
+};
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef BAXTER_DEMOS_SNAPSHOT_H_
+#define BAXTER_DEMOS_SNAPSHOT_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+
+namespace baxter_demos{
+
+// The latest value one thread produces for others to read, published
+// read-copy-update style: the producer fills a buffer nobody else can see
+// and then swaps the pointer in, readers take a reference counted snapshot
+// and keep it for as long as they like. Neither side waits for the other
+// to finish its work; the swap and the snapshot are a pointer copy under
+// boost's atomic shared_ptr operations.
+//
+// Buffers are double buffered: acquire() hands out the buffer that is not
+// published, if no reader still holds it, so a producer in steady state
+// doesn't allocate. A published value must not be written again.
+//
+// Only one thread may acquire() and publish().
+template<typename T>
+class Snapshot {
+public:
+    typedef boost::shared_ptr<T> Ptr;
+    typedef boost::shared_ptr<const T> ConstPtr;
+
+private:
+    ConstPtr current;
+    boost::atomic<unsigned int> published;
+    //Owned by the producer
+    Ptr buffers[2];
+    int next;
+
+public:
+    Snapshot() : published(0), next(0) {}
+
+    //A buffer to fill and publish. Its old contents are whatever was
+    //published with it two frames ago; allocated is set if it is new.
+    Ptr acquire(bool& allocated){
+        //The published buffer is held by current too
+        for(int i = 0; i < 2; i++){
+            Ptr& buffer = buffers[(next + i) % 2];
+            if(buffer && buffer.unique()){
+                //A reader may have let go of it just now (see
+                //FrameWorkspace.h)
+                boost::atomic_thread_fence(boost::memory_order_acquire);
+                next = (next + i + 1) % 2;
+                allocated = false;
+                return buffer;
+            }
+        }
+        //Both taken (or not made yet): a reader keeps the old one
+        Ptr& buffer = buffers[next];
+        next = (next + 1) % 2;
+        buffer = Ptr(new T);
+        allocated = true;
+        return buffer;
+    }
+
+    Ptr acquire(){
+        bool allocated;
+        return acquire(allocated);
+    }
+
+    //Make value the one readers see. value may also come from elsewhere
+    //than acquire(), as long as nobody writes to it afterwards.
+    void publish(const ConstPtr& value){
+        boost::atomic_store(&current, value);
+        published++;
+    }
+
+    //The latest value, NULL before the first publish
+    ConstPtr get() const {
+        return boost::atomic_load(&current);
+    }
+
+    //Counts the publishes, so readers can tell whether anything is new
+    unsigned int version() const {
+        return published;
+    }
+};
+
+}
+
+#endif
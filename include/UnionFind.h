@@ -0,0 +1,125 @@
+#ifndef BAXTER_DEMOS_UNION_FIND_H_
+#define BAXTER_DEMOS_UNION_FIND_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+
+namespace baxter_demos{
+
+// Disjoint sets over 0..n-1 with path halving. unite() always hangs the
+// larger root under the smaller one, so the representative of a set is its
+// smallest member no matter in which order the unions happen.
+class UnionFind {
+private:
+    std::vector<int> parent;
+
+public:
+    UnionFind(int n = 0){
+        reset(n);
+    }
+
+    void reset(int n){
+        parent.resize(n);
+        for(int i = 0; i < n; i++){
+            parent[i] = i;
+        }
+    }
+
+    int size() const { return parent.size(); }
+
+    int find(int i){
+        while(parent[i] != i){
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    //Returns true if a and b were in different sets
+    bool unite(int a, int b){
+        a = find(a);
+        b = find(b);
+        if(a == b){
+            return false;
+        }
+        if(a < b){
+            parent[b] = a;
+        } else {
+            parent[a] = b;
+        }
+        return true;
+    }
+};
+
+// UnionFind that many threads can unite() and find() on at once, without
+// locks. Links are made with a compare-and-swap that hangs the larger root
+// under the smaller one, so parents only ever decrease and, as above, the
+// representative of a set is its smallest member whatever the thread
+// interleaving was. reset() is not thread safe.
+class AtomicUnionFind {
+private:
+    boost::scoped_array<boost::atomic<int> > parent;
+    int n;
+    int capacity;
+
+public:
+    AtomicUnionFind(int size = 0) : n(0), capacity(0) {
+        reset(size);
+    }
+
+    void reset(int size){
+        if(size > capacity){
+            parent.reset(new boost::atomic<int>[size]);
+            capacity = size;
+        }
+        n = size;
+        for(int i = 0; i < n; i++){
+            parent[i].store(i, boost::memory_order_relaxed);
+        }
+    }
+
+    int size() const { return n; }
+
+    int find(int i){
+        while(true){
+            int p = parent[i].load(boost::memory_order_acquire);
+            if(p == i){
+                return i;
+            }
+            const int gp = parent[p].load(boost::memory_order_acquire);
+            if(gp != p){
+                //Path halving; losing the race to another thread is harmless
+                parent[i].compare_exchange_weak(p, gp, boost::memory_order_release,
+                                                boost::memory_order_relaxed);
+            }
+            i = gp;
+        }
+    }
+
+    //Returns true if this call joined the sets of a and b
+    bool unite(int a, int b){
+        while(true){
+            a = find(a);
+            b = find(b);
+            if(a == b){
+                return false;
+            }
+            if(a > b){
+                std::swap(a, b);
+            }
+            //Only succeeds if b is still a root
+            int expected = b;
+            if(parent[b].compare_exchange_strong(expected, a, boost::memory_order_acq_rel,
+                                                 boost::memory_order_acquire)){
+                return true;
+            }
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef BAXTER_DEMOS_VOXEL_SEARCH_H_
+#define BAXTER_DEMOS_VOXEL_SEARCH_H_
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/search/search.h>
+
+#include "FlatHashMap.h"
+
+namespace baxter_demos{
+
+// Spatial hash over the voxelized cloud, shared by every stage of a frame
+// that needs neighbours (outlier removal, region growing).
+//
+// Points are bucketed into cells that are a whole number of voxels wide, so
+// a voxel always lands in the same cell. update() takes the voxel keys from
+// CloudPreprocessor and only touches voxels that appeared or disappeared
+// since the last frame; voxels that persist just have their point index
+// refreshed. With a static sensor that is a small fraction of the cloud.
+//
+// setInputCloud() with the cloud that was last passed to update() does not
+// rebuild anything; the indices are used as a mask so that neighbours
+// outside the subset are never returned. This is what lets RegionGrowingRGB
+// reuse the index instead of building its own KdTree.
+class VoxelSearch : public pcl::search::Search<pcl::PointXYZRGB> {
+public:
+    typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
+    typedef PointCloud::ConstPtr PointCloudConstPtr;
+    typedef boost::shared_ptr<VoxelSearch> Ptr;
+
+    using pcl::search::Search<pcl::PointXYZRGB>::nearestKSearch;
+    using pcl::search::Search<pcl::PointXYZRGB>::radiusSearch;
+
+private:
+    struct Slot {
+        boost::uint64_t voxel;
+        boost::uint64_t cell;
+        int point;
+        unsigned int generation; //0 if the slot is free
+    };
+    typedef FlatHashMap<int> VoxelSlotMap;
+    //Cell key to the index of its list in cell_lists
+    typedef FlatHashMap<int> CellMap;
+
+    float leaf_size;
+    float min_cell_size;
+    int voxels_per_cell;
+    float cell_size;
+
+    VoxelSlotMap voxel_slots;
+    CellMap cells;
+    //The slots in each cell. Lists of cells that emptied keep their storage
+    //and are handed to the next new cell.
+    std::vector<std::vector<int> > cell_lists;
+    std::vector<int> free_lists;
+    std::vector<Slot> slots;
+    std::vector<int> free_slots;
+    unsigned int generation;
+    //false after a rebuild from raw points, which have no stable voxel keys
+    bool incremental;
+
+    int min_cell[3];
+    int max_cell[3];
+
+    //Nonzero for points in indices_, empty when searching the whole cloud
+    std::vector<char> mask;
+
+    size_t last_added;
+    size_t last_removed;
+
+    void clear();
+    int insertSlot(boost::uint64_t voxel, boost::uint64_t cell, int point);
+    void removeSlot(int slot);
+    void cellCoordsOfPoint(const pcl::PointXYZRGB& pt, int& cx, int& cy, int& cz) const;
+    void cellCoordsOfVoxel(boost::uint64_t voxel, int& cx, int& cy, int& cz) const;
+    void growBounds(int cx, int cy, int cz);
+    void setMask(const IndicesConstPtr& indices);
+
+public:
+    VoxelSearch(float leaf, float min_cell);
+
+    //Change the voxel size or minimum cell size; forces a rebuild on the next update
+    void setResolution(float leaf, float min_cell);
+
+    //Bring the index up to date with cloud, whose points carry voxel_keys
+    void update(const PointCloudConstPtr& cloud,
+                const std::vector<boost::uint64_t>& voxel_keys);
+
+    void setInputCloud(const PointCloudConstPtr& cloud,
+                       const IndicesConstPtr& indices = IndicesConstPtr());
+    //Drop the references to the last cloud and indices, so that their
+    //owner can refill them. The voxels stay for the next update().
+    void releaseInput();
+
+    int nearestKSearch(const pcl::PointXYZRGB& point, int k,
+                       std::vector<int>& k_indices,
+                       std::vector<float>& k_sqr_distances) const;
+
+    int radiusSearch(const pcl::PointXYZRGB& point, double radius,
+                     std::vector<int>& k_indices,
+                     std::vector<float>& k_sqr_distances,
+                     unsigned int max_nn = 0) const;
+
+    float getLeafSize() const { return leaf_size; }
+    float getMinCellSize() const { return min_cell_size; }
+    size_t getLastAdded() const { return last_added; }
+    size_t getLastRemoved() const { return last_removed; }
+};
+
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef BAXTER_DEMOS_BOX_EXCLUSION_CPP_
+#define BAXTER_DEMOS_BOX_EXCLUSION_CPP_
+
+#include "BoxExclusion.h"
+
+#include <cmath>
+#include <limits>
+
+namespace baxter_demos{
+
+const int BoxExclusion::lanes;
+
+BoxExclusion::BoxExclusion(){
+    clear();
+}
+
+void BoxExclusion::clear(){
+    for(int i = 0; i < 9; i++){
+        r[i].clear();
+    }
+    for(int i = 0; i < 3; i++){
+        offset[i].clear();
+        half[i].clear();
+    }
+    count = 0;
+    const float far = std::numeric_limits<float>::max();
+    bounds_min = Eigen::Vector3f(far, far, far);
+    bounds_max = -bounds_min;
+}
+
+void BoxExclusion::addBox(const Eigen::Vector3f& center, const Eigen::Matrix3f& rotation,
+                          const Eigen::Vector3f& half_sides){
+    if(count % lanes == 0){
+        //A new block of boxes that contain nothing: no |x| is <= -1
+        for(int i = 0; i < 9; i++){
+            r[i].resize(count + lanes, 0);
+        }
+        for(int i = 0; i < 3; i++){
+            offset[i].resize(count + lanes, 0);
+            half[i].resize(count + lanes, -1);
+        }
+    }
+
+    //Into box coordinates: p' = R^T p - R^T c
+    const Eigen::Vector3f local_center = rotation.transpose()*center;
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 3; j++){
+            r[3*i + j][count] = rotation(j, i);
+        }
+        offset[i][count] = local_center[i];
+        half[i][count] = half_sides[i];
+    }
+    count++;
+
+    //The box's extent along each axis of the cloud frame
+    const Eigen::Vector3f extent = rotation.cwiseAbs()*half_sides;
+    bounds_min = bounds_min.cwiseMin(center - extent);
+    bounds_max = bounds_max.cwiseMax(center + extent);
+}
+
+bool BoxExclusion::inside(const pcl::PointXYZRGB& pt) const {
+    //Also false for NaN points
+    if(!(pt.x >= bounds_min[0] && pt.x <= bounds_max[0] &&
+         pt.y >= bounds_min[1] && pt.y <= bounds_max[1] &&
+         pt.z >= bounds_min[2] && pt.z <= bounds_max[2])){
+        return false;
+    }
+
+    const size_t padded = half[0].size();
+    const float* r0 = &r[0][0]; const float* r1 = &r[1][0]; const float* r2 = &r[2][0];
+    const float* r3 = &r[3][0]; const float* r4 = &r[4][0]; const float* r5 = &r[5][0];
+    const float* r6 = &r[6][0]; const float* r7 = &r[7][0]; const float* r8 = &r[8][0];
+    const float* o0 = &offset[0][0]; const float* o1 = &offset[1][0];
+    const float* o2 = &offset[2][0];
+    const float* h0 = &half[0][0]; const float* h1 = &half[1][0]; const float* h2 = &half[2][0];
+    const float x = pt.x, y = pt.y, z = pt.z;
+    //A block of lanes boxes at a time: the fixed trip count lets the inner
+    //loop be vectorized without a scalar remainder
+    int hit = 0;
+    for(size_t block = 0; block < padded; block += lanes){
+        for(int l = 0; l < lanes; l++){
+            const size_t b = block + l;
+            const float lx = r0[b]*x + r1[b]*y + r2[b]*z - o0[b];
+            const float ly = r3[b]*x + r4[b]*y + r5[b]*z - o1[b];
+            const float lz = r6[b]*x + r7[b]*y + r8[b]*z - o2[b];
+            hit |= (std::fabs(lx) <= h0[b]) & (std::fabs(ly) <= h1[b]) &
+                   (std::fabs(lz) <= h2[b]);
+        }
+    }
+    return hit != 0;
+}
+
+void BoxExclusion::filter(const PointCloud& cloud, std::vector<int>& kept) const {
+    kept.clear();
+    kept.reserve(cloud.size());
+    for(size_t i = 0; i < cloud.size(); i++){
+        if(count == 0 || !inside(cloud.points[i])){
+            kept.push_back(i);
+        }
+    }
+}
+
+void BoxExclusion::filter(const PointCloud& cloud, PointCloud& output,
+                          bool keep_organized) const {
+    const size_t size = cloud.size();
+    const bool was_dense = cloud.is_dense;
+    if(&output != &cloud){
+        output.header = cloud.header;
+        output.sensor_origin_ = cloud.sensor_origin_;
+        output.sensor_orientation_ = cloud.sensor_orientation_;
+        output.width = cloud.width;
+        output.height = cloud.height;
+        output.points.resize(size);
+    }
+
+    //Points only ever move to a lower index, so this also works in place
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    size_t n = 0;
+    bool removed = false;
+    for(size_t i = 0; i < size; i++){
+        const pcl::PointXYZRGB pt = cloud.points[i];
+        const bool excluded = count > 0 && inside(pt);
+        removed |= excluded;
+        if(keep_organized){
+            output.points[i] = pt;
+            if(excluded){
+                output.points[i].x = output.points[i].y = output.points[i].z = nan;
+            }
+        } else if(!excluded){
+            output.points[n++] = pt;
+        }
+    }
+
+    if(keep_organized){
+        output.is_dense = was_dense && !removed;
+    } else {
+        output.points.resize(n);
+        output.width = n;
+        output.height = 1;
+        output.is_dense = was_dense;
+    }
+}
+
+}
+#endif
@@ -0,0 +1,147 @@
+#ifndef BAXTER_DEMOS_CLOUD_ENCODER_CPP_
+#define BAXTER_DEMOS_CLOUD_ENCODER_CPP_
+
+#include "CloudEncoder.h"
+
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+namespace baxter_demos{
+
+const boost::uint16_t CloudEncoder::unlabelled;
+
+static const boost::uint32_t packed_step = 16;
+static const boost::uint32_t label_step = 14;
+
+static void addField(pcl::PCLPointCloud2& out, const char* name, boost::uint32_t offset,
+                     boost::uint8_t datatype){
+    pcl::PCLPointField field;
+    field.name = name;
+    field.offset = offset;
+    field.datatype = datatype;
+    field.count = 1;
+    out.fields.push_back(field);
+}
+
+static void setLayout(pcl::PCLPointCloud2& out, size_t size, boost::uint32_t point_step){
+    out.height = 1;
+    out.width = size;
+    out.is_bigendian = false;
+    out.is_dense = true;
+    out.point_step = point_step;
+    out.row_step = point_step*size;
+    out.data.resize(out.row_step);
+    out.fields.clear();
+    addField(out, "x", 0, pcl::PCLPointField::FLOAT32);
+    addField(out, "y", 4, pcl::PCLPointField::FLOAT32);
+    addField(out, "z", 8, pcl::PCLPointField::FLOAT32);
+}
+
+void CloudEncoder::packPoints(const PointCloud& cloud, const std::vector<int>* indices,
+                              pcl::PCLPointCloud2& out){
+    const size_t size = indices ? indices->size() : cloud.size();
+    setLayout(out, size, packed_step);
+    addField(out, "rgb", 12, pcl::PCLPointField::FLOAT32);
+    boost::uint8_t* dst = out.data.empty() ? NULL : &out.data[0];
+    for(size_t i = 0; i < size; i++, dst += packed_step){
+        const pcl::PointXYZRGB& pt = cloud[indices ? (*indices)[i] : i];
+        std::memcpy(dst, &pt.x, 3*sizeof(float));
+        std::memcpy(dst + 12, &pt.rgb, sizeof(float));
+    }
+}
+
+void CloudEncoder::encodeLabels(const PointCloud& cloud,
+                                const std::vector<pcl::PointIndices>& clusters,
+                                pcl::PCLPointCloud2& out){
+    setLayout(out, cloud.size(), label_step);
+    addField(out, "label", 12, pcl::PCLPointField::UINT16);
+    boost::uint8_t* data = out.data.empty() ? NULL : &out.data[0];
+    for(size_t i = 0; i < cloud.size(); i++){
+        std::memcpy(data + i*label_step, &cloud[i].x, 3*sizeof(float));
+        std::memcpy(data + i*label_step + 12, &unlabelled, sizeof(boost::uint16_t));
+    }
+    //Labels past the range of uint16 wrap; there are never that many clusters
+    for(size_t c = 0; c < clusters.size(); c++){
+        const boost::uint16_t label = c + 1;
+        const std::vector<int>& members = clusters[c].indices;
+        for(size_t i = 0; i < members.size(); i++){
+            std::memcpy(data + members[i]*label_step + 12, &label, sizeof(boost::uint16_t));
+        }
+    }
+}
+
+void CloudEncoder::encodeClusters(const PointCloud& cloud,
+                                  const std::vector<pcl::PointIndices>& clusters,
+                                  const std::vector<int>& which, pcl::PCLPointCloud2& out){
+    selected.clear();
+    for(size_t i = 0; i < which.size(); i++){
+        const std::vector<int>& members = clusters[which[i]].indices;
+        selected.insert(selected.end(), members.begin(), members.end());
+    }
+    packPoints(cloud, &selected, out);
+}
+
+void CloudEncoder::encodePreview(const PointCloud& cloud, float leaf, pcl::PCLPointCloud2& out){
+    //The cloud is already cropped, so keep everything
+    const float far = std::numeric_limits<float>::max();
+    decimator.setLeafSize(leaf);
+    decimator.setFilterLimits(-far, far);
+    decimator.filter(cloud, decimated);
+    packPoints(decimated, NULL, out);
+}
+
+CloudEncoder::Compression* CloudEncoder::makeCompression(){
+    //1 mm points in 1 cm octree cells with 6 bit color; an I-frame rate of
+    //0 makes every frame an I-frame
+    return new Compression(pcl::io::MANUAL_CONFIGURATION, false, 0.001, 0.01,
+                           false, 0, true, 6);
+}
+
+void CloudEncoder::compress(const PointCloud::ConstPtr& cloud,
+                            std::vector<boost::uint8_t>& data){
+    if(!encoder){
+        encoder.reset(makeCompression());
+    }
+    std::stringstream stream;
+    encoder->encodePointCloud(cloud, stream);
+    const std::string encoded = stream.str();
+    data.assign(encoded.begin(), encoded.end());
+}
+
+void CloudEncoder::decodeLabels(const pcl::PCLPointCloud2& in, PointCloud& cloud){
+    cloud.clear();
+    if(in.point_step != label_step || in.data.size() < (size_t) in.width*in.height*label_step){
+        return;
+    }
+    const size_t size = (size_t) in.width*in.height;
+    cloud.resize(size);
+    for(size_t i = 0; i < size; i++){
+        const boost::uint8_t* src = &in.data[i*label_step];
+        pcl::PointXYZRGB& pt = cloud[i];
+        std::memcpy(&pt.x, src, 3*sizeof(float));
+        boost::uint16_t label;
+        std::memcpy(&label, src + 12, sizeof(boost::uint16_t));
+        if(label == unlabelled){
+            pt.r = 255; pt.g = 0; pt.b = 0;
+        } else {
+            const unsigned int hash = label*2654435761u;
+            pt.r = hash >> 24; pt.g = hash >> 16; pt.b = hash >> 8;
+        }
+    }
+}
+
+void CloudEncoder::decompress(const std::vector<boost::uint8_t>& data,
+                              PointCloud::Ptr& cloud){
+    if(!decoder){
+        decoder.reset(makeCompression());
+    }
+    std::stringstream stream(std::string(data.begin(), data.end()));
+    if(!cloud){
+        cloud = PointCloud::Ptr(new PointCloud);
+    }
+    decoder->decodePointCloud(stream, cloud);
+}
+
+}
+#endif
@@ -0,0 +1,132 @@
+#ifndef BAXTER_DEMOS_CLOUD_PREPROCESSOR_CPP_
+#define BAXTER_DEMOS_CLOUD_PREPROCESSOR_CPP_
+
+#include "CloudPreprocessor.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <pcl/pcl_macros.h>
+
+namespace baxter_demos{
+
+CloudPreprocessor::CloudPreprocessor() : leaf_size(0.005), inverse_leaf_size(200),
+                                         filter_min(0), filter_max(4) {
+}
+
+void CloudPreprocessor::setLeafSize(float leaf){
+    leaf_size = leaf;
+    inverse_leaf_size = 1.0f/leaf;
+}
+
+void CloudPreprocessor::setFilterLimits(float min, float max){
+    filter_min = min;
+    filter_max = max;
+}
+
+//21 bits per axis, offset so that negative voxel coordinates stay positive
+boost::uint64_t CloudPreprocessor::voxelKey(int ix, int iy, int iz){
+    const boost::uint64_t offset = 1 << 20;
+    const boost::uint64_t mask = (1 << 21) - 1;
+    return (((boost::uint64_t) ix + offset) & mask) |
+           ((((boost::uint64_t) iy + offset) & mask) << 21) |
+           ((((boost::uint64_t) iz + offset) & mask) << 42);
+}
+
+void CloudPreprocessor::voxelCoords(boost::uint64_t key, int& ix, int& iy, int& iz){
+    const boost::uint64_t offset = 1 << 20;
+    const boost::uint64_t mask = (1 << 21) - 1;
+    ix = (int) ((key & mask) - offset);
+    iy = (int) (((key >> 21) & mask) - offset);
+    iz = (int) (((key >> 42) & mask) - offset);
+}
+
+void CloudPreprocessor::filter(const pcl::PointCloud<pcl::PointXYZRGB>& input,
+                               pcl::PointCloud<pcl::PointXYZRGB>& output){
+    filter(CloudView::fromCloud(input), output);
+    output.header = input.header;
+}
+
+void CloudPreprocessor::filter(const CloudView& input,
+                               pcl::PointCloud<pcl::PointXYZRGB>& output){
+    begin();
+    for(size_t v = 0; v < input.height; v++){
+        sweep(input, v, 0, input.width);
+    }
+    end(output);
+}
+
+void CloudPreprocessor::filter(const CloudView& input, ImageROI& roi,
+                               pcl::PointCloud<pcl::PointXYZRGB>& output){
+    if(roi.empty()){
+        filter(input, output);
+        return;
+    }
+    begin();
+    const std::vector<ImageROI::Span>& spans = roi.spans();
+    for(size_t i = 0; i < spans.size(); i++){
+        const ImageROI::Span& span = spans[i];
+        if((size_t) span.row < input.height){
+            sweep(input, span.row, span.begin, std::min((size_t) span.end, (size_t) input.width));
+        }
+    }
+    end(output);
+}
+
+void CloudPreprocessor::begin(){
+    voxel_slots.clear();
+    accumulators.clear();
+}
+
+void CloudPreprocessor::sweep(const CloudView& input, size_t v, size_t u_begin, size_t u_end){
+    const boost::uint8_t* p = input.point(u_begin, v);
+    for(size_t u = u_begin; u < u_end; u++, p += input.point_step){
+        float x, y, z;
+        input.getPoint(p, x, y, z);
+        // NaN rejection and z crop come first, so most points stop here
+        if(!pcl_isfinite(x) || !pcl_isfinite(y) || !pcl_isfinite(z) ||
+           z < filter_min || z > filter_max){
+            continue;
+        }
+        boost::uint8_t r, g, b;
+        input.getColor(p, r, g, b);
+
+        const boost::uint64_t key = voxelKey(
+                    (int) std::floor(x * inverse_leaf_size),
+                    (int) std::floor(y * inverse_leaf_size),
+                    (int) std::floor(z * inverse_leaf_size));
+
+        std::pair<size_t*, bool> slot = voxel_slots.insert(key, accumulators.size());
+        if(slot.second){
+            VoxelAccumulator acc = {x, y, z, r, g, b, 1, key};
+            accumulators.push_back(acc);
+        } else {
+            VoxelAccumulator& acc = accumulators[*slot.first];
+            acc.x += x; acc.y += y; acc.z += z;
+            acc.r += r; acc.g += g; acc.b += b;
+            acc.count++;
+        }
+    }
+}
+
+void CloudPreprocessor::end(pcl::PointCloud<pcl::PointXYZRGB>& output){
+    output.points.resize(accumulators.size());
+    voxel_keys.resize(accumulators.size());
+    for(size_t i = 0; i < accumulators.size(); i++){
+        const VoxelAccumulator& acc = accumulators[i];
+        const float inv = 1.0f/acc.count;
+        pcl::PointXYZRGB& pt = output.points[i];
+        pt.x = acc.x*inv; pt.y = acc.y*inv; pt.z = acc.z*inv;
+        pt.r = (boost::uint8_t) (acc.r/acc.count);
+        pt.g = (boost::uint8_t) (acc.g/acc.count);
+        pt.b = (boost::uint8_t) (acc.b/acc.count);
+        pt.a = 255;
+        voxel_keys[i] = acc.key;
+    }
+    output.width = output.points.size();
+    output.height = 1;
+    output.is_dense = true;
+}
+
+}
+#endif
@@ -7,17 +7,13 @@
 
 #include "pcl_ros/transforms.h"
 
+#include <boost/bind.hpp>
+
 namespace baxter_demos{
 
 PLUGINLIB_DECLARE_CLASS(baxter_demos, CloudSegmenter, baxter_demos::CloudSegmenter, nodelet::Nodelet)
 
 
-bool pose_compare::operator()(geometry_msgs::Pose pose_a, geometry_msgs::Pose pose_b){
-
-    return positionToVector(pose_a.position).norm() <
-           positionToVector(pose_b.position).norm();
-}
-
 bool CloudSegmenter::isPointWithinDesiredRange(const pcl::PointRGB input_pt,
                                const pcl::PointRGB desired_pt, int radius){
     pcl::PointXYZRGB input_xyz(input_pt.r, input_pt.g, input_pt.b),
@@ -35,50 +31,107 @@ bool CloudSegmenter::isPointWithinDesiredRange(const pcl::PointRGB input_pt,
 }
 
 bool CloudSegmenter:: hasCloud(){
-    return has_cloud;
+    return cloud_snapshot.version() > 0;
 }
 
 bool CloudSegmenter:: hasColor(){
-    return has_desired_color;
+    boost::mutex::scoped_lock lock(targets_mutex);
+    for(size_t i = 0; i < targets.size(); i++){
+        if(targets[i].has_color){
+            return true;
+        }
+    }
+    return false;
 }
 
 bool CloudSegmenter::wasSegmented(){
     return segmented;
 }
 
+//The color of the first target
 Eigen::Vector3i CloudSegmenter::getDesiredColor(){
-    return Eigen::Vector3i((int) desired_color.r, (int) desired_color.g,
-                           (int) desired_color.b);
+    boost::mutex::scoped_lock lock(targets_mutex);
+    if(targets.empty()){
+        return Eigen::Vector3i::Zero();
+    }
+    const pcl::PointRGB& color = targets[0].color;
+    return Eigen::Vector3i((int) color.r, (int) color.g, (int) color.b);
+}
+
+CloudSegmenter::CloudSegmenter() : segmented(false), viewer_attached(false),
+                                   tracker_configured(false), unsent_resync(false),
+                                   has_unsent_objects(false), tf_dropped(0), roi_stamp(0),
+                                   roi_full_scan(true), frames_since_full_scan(0) {
 }
 
-CloudSegmenter::CloudSegmenter() : has_cloud(false), has_desired_color(false), segmented(false)  {
-    cloud = PointColorCloud::Ptr(new PointColorCloud);
+CloudSegmenter::~CloudSegmenter(){
+    ingest_slot.close();
+    preprocess_slot.close();
+    segment_slot.close();
+    transform_slot.close();
+    stage_threads.join_all();
 }
 
+// getParamCached subscribes to a parameter the first time it is read; after
+// that the master pushes every change and reads are local lookups. Missing
+// parameters keep their current value (the defaults in SegmenterParams).
+// Stages compare the parameters they depend on against the ones they were
+// last configured with, so only the ones whose parameters changed do any
+// work.
 void CloudSegmenter::updateParams(){
     //load params from yaml
-    double object_height;
-
-    n.getParam("radius", radius);
-    n.getParam("filter_min", filter_min);
-    n.getParam("filter_max", filter_max);
-    n.getParam("distance_threshold", distance_threshold);
-    n.getParam("point_color_threshold", point_color_threshold);
-    n.getParam("region_color_threshold", region_color_threshold);
-    n.getParam("min_cluster_size", min_cluster_size);
-    n.getParam("max_cluster_size", max_cluster_size);
-    double l;
-    n.getParam("leaf_size", l);
-    leaf_size = (float) l;
-    n.getParam("exclusion_padding", exclusion_padding);
-    n.getParam("tolerance", tolerance);
-    n.getParam("object_height", object_height);
-    n.getParam("min_neighbors", min_neighbors);
-    n.getParam("outlier_radius", outlier_radius);
+    double object_height = params.object_side - params.exclusion_padding;
+
+    n.getParamCached("radius", params.radius);
+    n.getParamCached("filter_min", params.filter_min);
+    n.getParamCached("filter_max", params.filter_max);
+    n.getParamCached("distance_threshold", params.distance_threshold);
+    n.getParamCached("point_color_threshold", params.point_color_threshold);
+    n.getParamCached("region_color_threshold", params.region_color_threshold);
+    n.getParamCached("min_cluster_size", params.min_cluster_size);
+    n.getParamCached("max_cluster_size", params.max_cluster_size);
+    double l = params.leaf_size;
+    n.getParamCached("leaf_size", l);
+    params.leaf_size = (float) l;
+    n.getParamCached("exclusion_padding", params.exclusion_padding);
+    n.getParamCached("tolerance", params.tolerance);
+    n.getParamCached("object_height", object_height);
+    n.getParamCached("min_neighbors", params.min_neighbors);
+    n.getParamCached("outlier_radius", params.outlier_radius);
     
-    n.getParam("sample_size", sample_size);
-
-    object_side =(float) (object_height + exclusion_padding);
+    n.getParamCached("sample_size", params.sample_size);
+    n.getParamCached("color_gate", params.color_gate);
+    n.getParamCached("gate_radius", params.gate_radius);
+    n.getParamCached("parallel_regions", params.parallel_regions);
+    n.getParamCached("region_threads", params.region_threads);
+    n.getParamCached("incremental", params.incremental);
+    n.getParamCached("incremental_refresh", params.incremental_refresh);
+    n.getParamCached("change_threshold", params.change_threshold);
+    n.getParamCached("roi", params.roi);
+    n.getParamCached("roi_padding", params.roi_padding);
+    n.getParamCached("roi_full_scan", params.roi_full_scan);
+
+    n.getParamCached("track_gate", params.track_gate);
+    n.getParamCached("track_max_misses", params.track_max_misses);
+    n.getParamCached("track_min_hits", params.track_min_hits);
+    n.getParamCached("track_alpha", params.track_alpha);
+    n.getParamCached("track_beta", params.track_beta);
+
+    n.getParamCached("scene_translation_threshold", params.scene_translation_threshold);
+    n.getParamCached("scene_rotation_threshold", params.scene_rotation_threshold);
+    n.getParamCached("scene_min_interval", params.scene_min_interval);
+    n.getParamCached("scene_resync_period", params.scene_resync_period);
+
+    n.getParamCached("occupancy_voxel", params.occupancy_voxel);
+    n.getParamCached("occupancy_min_points", params.occupancy_min_points);
+
+    n.getParamCached("preview_leaf", params.preview_leaf);
+    n.getParamCached("tf_timeout", params.tf_timeout);
+
+    n.getParamCached("diagnostics", params.diagnostics);
+    n.getParamCached("diagnostics_period", params.diagnostics_period);
+
+    params.object_side =(float) (object_height + params.exclusion_padding);
 
 }
 
@@ -86,38 +139,91 @@ void CloudSegmenter::onInit(){
     n = getNodeHandle();
     updateParams();
 
-    has_desired_color = false;
-    has_cloud = false;
     segmented = false;
-    published_goals = false;
 
-    cloud_sub = n.subscribe("/camera/depth_registered/points", 100,
+    //One target per name, the first one answers to the old topics too
+    vector<string> target_names;
+    if(!n.getParam("targets", target_names) || target_names.empty()){
+        target_names.push_back("right");
+    }
+    const size_t max_targets = ColorClassifier::max_targets;
+    if(target_names.size() > max_targets){
+        ROS_WARN("Only the first %lu of %lu targets are used", (unsigned long) max_targets,
+                 (unsigned long) target_names.size());
+        target_names.resize(max_targets);
+    }
+    targets.resize(target_names.size());
+    for(size_t i = 0; i < targets.size(); i++){
+        SegmentationTarget& target = targets[i];
+        target.name = target_names[i];
+        target.color_sub = n.subscribe<geometry_msgs::Point>(
+                    "/object_tracker/" + target.name + "/picked_color", 1000,
+                    boost::bind(&CloudSegmenter::target_color_callback, this, _1, (int) i));
+        target.goal_pub = n.advertise<geometry_msgs::PoseArray>(
+                    "/object_tracker/" + target.name + "/goal_poses", 100);
+    }
+
+    //Only the newest cloud matters, the pipeline drops anything older
+    cloud_sub = n.subscribe("/camera/depth_registered/points", 1,
                                       &CloudSegmenter::points_callback, this);
 
+    //Intrinsics for ROI mode
+    info_sub = n.subscribe("/camera/depth_registered/camera_info", 1,
+                                      &CloudSegmenter::info_callback, this);
+
     color_sub = n.subscribe("/object_tracker/picked_color", 1000,
                                       &CloudSegmenter::color_callback, this);
     
     object_pub = n.advertise<CollisionObjectArray>(
                         "/object_tracker/collision_objects", 100);
     //object_pub = n.advertise<moveit_msgs::CollisionObject>("/collision_object", 100);
-    goal_pub = n.advertise<geometry_msgs::PoseArray>("/object_tracker/right/goal_poses", 100);
 
     //cloud_pub = n.advertise<sensor_msgs::PointCloud2>("/modified_points", 200);
-    cloud_pub = n.advertise<sensor_msgs::PointCloud2>("/object_tracker/segmented_cloud", 1000);
-
-    object_sequence = 0;
-    cout << "finished initialization" << endl;
+    //Published as a PCL cloud so nodelets in the same manager get the pointer
+    cloud_pub = n.advertise<PointColorCloud>("/object_tracker/segmented_cloud", 1);
+    //Cheaper views of the same for remote viewers (see CloudEncoder)
+    labels_pub = n.advertise<sensor_msgs::PointCloud2>("/object_tracker/segmented_labels", 1);
+    targets_pub = n.advertise<sensor_msgs::PointCloud2>("/object_tracker/segmented_targets", 1);
+    preview_pub = n.advertise<sensor_msgs::PointCloud2>("/object_tracker/segmented_preview", 1);
+    compressed_pub = n.advertise<CompressedCloud>("/object_tracker/segmented_compressed", 1);
+    obstacle_pub = n.advertise<PointColorCloud>("/object_tracker/obstacle_cloud", 1);
+    //Changes only, so nothing may be dropped
+    occupancy_pub = n.advertise<VoxelOccupancy>("/object_tracker/obstacle_voxels", 10);
+
+    //Seconds between capture and publishing of each frame
+    age_pub = n.advertise<std_msgs::Float64>("/object_tracker/frame_age", 10);
+
+    //Stage timings, see publishDiagnostics
+    diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+
+    stage_threads.create_thread(boost::bind(&CloudSegmenter::preprocessLoop, this));
+    stage_threads.create_thread(boost::bind(&CloudSegmenter::segmentLoop, this));
+    stage_threads.create_thread(boost::bind(&CloudSegmenter::transformLoop, this));
+    stage_threads.create_thread(boost::bind(&CloudSegmenter::publishLoop, this));
+    ROS_INFO("finished initialization");
 }
 
 Eigen::Vector3f positionToVector(geometry_msgs::Point p){
     return Eigen::Vector3f(p.x, p.y, p.z);
 }
 
+geometry_msgs::Pose trackToPose(const Track& track){
+    geometry_msgs::Pose pose;
+    pose.position.x = track.position[0];
+    pose.position.y = track.position[1];
+    pose.position.z = track.position[2];
+    pose.orientation.w = track.orientation.w();
+    pose.orientation.x = track.orientation.x();
+    pose.orientation.y = track.orientation.y();
+    pose.orientation.z = track.orientation.z();
+    return pose;
+}
 
-moveit_msgs::CollisionObject CloudSegmenter::constructCollisionObject(geometry_msgs::Pose pose){
+moveit_msgs::CollisionObject CloudSegmenter::constructCollisionObject(const Track& track,
+                                                                      float object_side){
     moveit_msgs::CollisionObject new_obj; 
-    char id[16];
-    sprintf(id, "goal_block_%d", object_sequence);
+    char id[32];
+    sprintf(id, "goal_block_%d", track.id);
     new_obj.id=id;
     shape_msgs::SolidPrimitive primitive;
     primitive.type = primitive.BOX;
@@ -126,601 +232,797 @@ moveit_msgs::CollisionObject CloudSegmenter::constructCollisionObject(geometry_m
     primitive.dimensions[1] = object_side;
     primitive.dimensions[2] = object_side;
     new_obj.primitives.push_back(primitive);
-    new_obj.primitive_poses.push_back(pose);
+    new_obj.primitive_poses.push_back(trackToPose(track));
 
     new_obj.operation = moveit_msgs::CollisionObject::ADD;
 
     new_obj.header.frame_id = "/base";
     new_obj.header.stamp = ros::Time::now();
 
-    object_sequence++;
     return new_obj;
 }
 
-void CloudSegmenter::match_objects(vector<geometry_msgs::Pose> cur_poses){
-//this matching between frames business is super buggy
-    prev_diffs = cur_diffs;
+// Feed this frame's poses to the tracker and turn what changed into
+// CollisionObject diffs. Object IDs are the track IDs, so they stay the same
+// for as long as the tracker follows the block.
+void CloudSegmenter::track_objects(const vector<geometry_msgs::Pose>& cur_poses,
+                                   SegmentationFrame& frame){
+    const SegmenterParams& params = frame.params;
+    ScopedStageTimer timer(frame.stats, PipelineStats::TRACKING, cur_poses.size());
+    if(!tracker_configured || !params.sameTracking(tracker_params)){
+        tracker.setGate(params.track_gate);
+        tracker.setMaxMisses(params.track_max_misses);
+        tracker.setMinHits(params.track_min_hits);
+        tracker.setGains(params.track_alpha, params.track_beta);
+        tracker_params = params;
+        tracker_configured = true;
+    }
+    scene_differ.setThresholds(params.scene_translation_threshold,
+                               params.scene_rotation_threshold);
+    scene_differ.setMinInterval(params.scene_min_interval);
+    scene_differ.setResyncPeriod(params.scene_resync_period);
+
+    //Tracks are labelled with the target index, so a block never changes
+    //target and the IDs of different targets never mix
+    track_positions.clear();
+    track_orientations.clear();
+    track_labels.clear();
+    for(size_t i = 0; i < cur_poses.size(); i++){
+        track_positions.push_back(positionToVector(cur_poses[i].position));
+        const geometry_msgs::Quaternion& q = cur_poses[i].orientation;
+        track_orientations.push_back(Eigen::Quaternionf(q.w, q.x, q.y, q.z));
+        track_labels.push_back(frame.target_ids[frame.box_targets[i]]);
+    }
+    tracker.update(track_positions, track_orientations, track_labels,
+                   frame.header.stamp.toSec(), track_update);
+
+    //Only the changes the planning scene needs to hear about. An object is
+    //in at most one of added, moved and removed, so the IDs are unique
+    //without a map.
+    frame.scene_resync = scene_differ.update(tracker.getTracks(), frame.header.stamp.toSec(),
+                                             scene_update);
     cur_diffs.clear();
+    for(size_t i = 0; i < scene_update.added.size(); i++){
+        cur_diffs.push_back(constructCollisionObject(scene_update.added[i],
+                                                     params.object_side));
+    }
+    for(size_t i = 0; i < scene_update.moved.size(); i++){
+        cur_diffs.push_back(constructCollisionObject(scene_update.moved[i],
+                                                     params.object_side));
+        cur_diffs.back().operation = moveit_msgs::CollisionObject::MOVE;
+    }
+    for(size_t i = 0; i < scene_update.removed.size(); i++){
+        cur_diffs.push_back(constructCollisionObject(scene_update.removed[i],
+                                                     params.object_side));
+        cur_diffs.back().operation = moveit_msgs::CollisionObject::REMOVE;
+    }
 
-    const float delta_max = 0.09;
-
-    //Match each pose in cur_poses to a unique object in all_objects
-
-    IDPoseMap matched_objects; //Key on old object IDs
-    for(int i = 0 ; i < cur_poses.size(); i++){
-        Eigen::Vector3f new_point = positionToVector(cur_poses[i].position);
-
-        for(IDObjectMap::iterator it = all_objects.begin();
-                                  it != all_objects.end(); it++){
-            moveit_msgs::CollisionObject old_object = it->second;
-            Eigen::Vector3f old_point = positionToVector(it->second.primitive_poses[0].position);
-            float dist_i = (old_point-new_point).norm();
-            if( dist_i < delta_max){
-                //match them
-                if(matched_objects.find(old_object.id) == matched_objects.end() ){
-                    matched_objects[old_object.id] = cur_poses[i];
-                } else {
-                    Eigen::Vector3f map_point = positionToVector(matched_objects[old_object.id].position);
-                    float dist_j = (old_point - map_point).norm();
-                    if( dist_i < dist_j ){
-                        matched_objects[old_object.id] = cur_poses[i]; }
-                }
-            }
+    //Goal poses are the filtered poses of the confirmed tracks, in ID order,
+    //split by target. Refilled in place, so the lists keep their storage.
+    frame.goal_poses.resize(targets.size());
+    for(size_t t = 0; t < frame.goal_poses.size(); t++){
+        frame.goal_poses[t].clear();
+    }
+    const TrackList& tracks = tracker.getTracks();
+    for(size_t i = 0; i < tracks.size(); i++){
+        if(tracks[i].confirmed){
+            frame.goal_poses[tracks[i].label].push_back(trackToPose(tracks[i]));
         }
     }
+    goal_poses = frame.goal_poses;
+    updateROITracks(frame);
+    timer.setItemsOut(cur_diffs.size());
+}
 
-    //Now, check the matched poses
-
-    for(int i = 0; i < cur_poses.size(); i++){
-        geometry_msgs::Pose cur_pose = cur_poses[i];
-        //PoseIDMap::iterator it = matched_poses.find(cur_pose);
-        IDPoseMap::iterator it;
-        for(it = matched_objects.begin();
-            it != matched_objects.end(); it++){
-            if(pose_compare::position_equal(it->second, cur_pose) ){
-                //For all the poses that are in matched_objects:
-                //If they were in prev_diffs with the ops ADD or MOVE,
-                //add them to cur_diffs with the op MOVE
-                //else, add them with the op ADD
-                moveit_msgs::CollisionObject matched_obj = all_objects[it->first];
-                matched_obj.primitive_poses[0] = cur_pose;
-                if(prev_diffs.find(matched_obj.id) != prev_diffs.end() &&
-                   prev_diffs[matched_obj.id].operation !=
-                                    moveit_msgs::CollisionObject::REMOVE ){
-                    matched_obj.operation = moveit_msgs::CollisionObject::MOVE;
-                } /*else {
-                    matched_obj.operation = moveit_msgs::CollisionObject::ADD;
-                }*/ //XXX test
-                cur_diffs[matched_obj.id] = matched_obj;
-            }
-            break;
+// Hand the confirmed tracks to the next ROI. A confirmed track that was
+// missed or dropped may have left the ROI, and a target without confirmed
+// tracks has nothing to crop around, so either one asks for a full scan.
+void CloudSegmenter::updateROITracks(const SegmentationFrame& frame){
+    const TrackList& tracks = tracker.getTracks();
+    vector<ROITrack>& confirmed = roi_confirmed;
+    vector<char>& has_track = roi_has_track;
+    confirmed.clear();
+    has_track.assign(targets.size(), 0);
+    bool lost = false;
+    for(size_t i = 0; i < tracks.size(); i++){
+        if(!tracks[i].confirmed){
+            continue;
         }
-        if(it == matched_objects.end()){
-            //Make new objects for the poses that are not keys in matched_objects
-            //and add them to cur_diffs with op ADD
-
-            moveit_msgs::CollisionObject new_obj = constructCollisionObject(cur_pose);
-            cur_diffs[new_obj.id] = new_obj;
-        } 
+        ROITrack track = {tracks[i].position, tracks[i].velocity};
+        confirmed.push_back(track);
+        has_track[tracks[i].label] = 1;
+        lost = lost || tracks[i].misses > 0;
     }
-    
-    //For all poses in prev_diffs that are not in matched_objects
-    //and do not have operation REMOVE:
-    //add them to cur_diffs with the operation REMOVE
-
-    for(IDObjectMap::iterator it = prev_diffs.begin(); it != prev_diffs.end(); it++){
-        if(matched_objects.find(it->first) == matched_objects.end() &&
-           it->second.operation != moveit_msgs::CollisionObject::REMOVE){
-            moveit_msgs::CollisionObject remove_obj = it->second;
-            remove_obj.operation = moveit_msgs::CollisionObject::REMOVE;
-            cur_diffs[remove_obj.id] = remove_obj;
-        }
+    for(size_t i = 0; i < track_update.removed.size(); i++){
+        lost = lost || track_update.removed[i].confirmed;
+    }
+    for(size_t i = 0; i < frame.target_ids.size(); i++){
+        lost = lost || !has_track[frame.target_ids[i]];
     }
 
-    //Now update each object's state in all_objects
-    for(IDObjectMap::iterator it = cur_diffs.begin(); it != cur_diffs.begin(); it++){
-        all_objects[it->first] = it->second;
+    boost::mutex::scoped_lock lock(roi_mutex);
+    roi_tracks.swap(confirmed);
+    roi_stamp = frame.header.stamp.toSec();
+    if(lost){
+        roi_full_scan = true;
     }
 }
 
-
-// Construct a vector of MoveIt CollisionObjects for the new poses that came in
-// Match the IDs of the old poses with the new ones and construct new poses if necessary
-/*void CloudSegmenter::match_prev_cur_poses(vector<geometry_msgs::Pose> cur_poses,
-                            vector<moveit_msgs::CollisionObject>& next_objs,
-                            vector<moveit_msgs::CollisionObject>& remove_objs ){
-
-    int prev_len = prev_diffs.size();
-    int cur_len = cur_poses.size();
-    set<geometry_msgs::Pose, pose_compare> added_poses;
-
-    if (prev_len != 0){
+// Crop the frame to the pixels the confirmed tracks can have moved to. Each
+// track is predicted to the frame's stamp and projected as a cube big enough
+// for the block in any orientation, plus roi_padding. Without a camera, a
+// transform or any tracks, or when a full scan is due, the ROI stays empty
+// and the whole frame is read.
+void CloudSegmenter::buildROI(SegmentationFrame& frame){
+    const sensor_msgs::PointCloud2& msg = *frame.msg;
+    frame.roi.reset(msg.width, msg.height);
+    if(!params.roi || msg.height <= 1){
         return;
-        //Map the ID of the CollisionObject from the previous frame to the best match pose
-        //from the current frame
-        IDPoseMap prev_to_cur_map; //Previous objects are mapped to their closest current pose
-        IDObjectMap id_to_obj_map;
+    }
 
-        for(int j = 0; j < prev_len; j++){
-            id_to_obj_map[prev_diffs[j].id] = prev_diffs[j];
+    vector<ROITrack>& tracks = roi_crop_tracks;
+    CameraIntrinsics intrinsics;
+    double stamp;
+    {
+        boost::mutex::scoped_lock lock(roi_mutex);
+        if(roi_full_scan || frames_since_full_scan >= params.roi_full_scan){
+            roi_full_scan = false;
+            frames_since_full_scan = 0;
+            return;
         }
+        frames_since_full_scan++;
+        tracks.assign(roi_tracks.begin(), roi_tracks.end());
+        intrinsics = camera;
+        stamp = roi_stamp;
+    }
+    if(tracks.empty() || !intrinsics.valid()){
+        return;
+    }
 
-        for(int i = 0; i < cur_len; i++){
-            geometry_msgs::Pose cur_pose = cur_poses[i];
-            Eigen::Vector3f cur_point = positionToVector( cur_pose.position );
-            float min_d = 1000; //things probably won't get bigger than this?
-            moveit_msgs::CollisionObject argmin;
-            for(int j = 0; j < prev_len; j++){
-                geometry_msgs::Pose prev_pose = prev_diffs[j].primitive_poses[0];
-                Eigen::Vector3f prev_point = positionToVector( prev_pose.position );
-                float d = (prev_point - cur_point).norm();
-                if(d < min_d){
-                    min_d = d;
-                    argmin = prev_diffs[j];
-                }
-            }
-
-            //Enforce uniqueness
-            string id = argmin.id;
-            IDPoseMap::iterator it = prev_to_cur_map.find( id ); 
-            if( it != prev_to_cur_map.end()){ //If argmin is already matched to a pose
-                geometry_msgs::Pose old_pose = prev_to_cur_map[id];
-                float old_min_d = ( positionToVector( old_pose.position ) - cur_point).norm();
-                if ( old_min_d < min_d ){
-                    //Don't add it to the map because the old match is better than this one
-                    continue;
-                }
-            }
-            prev_to_cur_map[id] = cur_pose;
-            added_poses.insert(cur_pose);
-        }
-        next_objs.clear();
-        remove_objs.clear();
-        for(IDPoseMap::iterator it = prev_to_cur_map.begin();
-                it != prev_to_cur_map.end(); it++ ){
-            geometry_msgs::Pose cur_pose = it->second;
-            string id = it->first;
-            moveit_msgs::CollisionObject cur_obj = id_to_obj_map[id];
-            cur_obj.primitive_poses[0] = cur_pose;
-            cur_obj.operation = moveit_msgs::CollisionObject::MOVE;
-            cur_obj.header.stamp = ros::Time::now();
-            cur_obj.header.frame_id = "/base";
-            next_objs.push_back(cur_obj);
-        }
+    //Tracks are in the base frame; the latest transform is close enough
+    //for a padded crop
+    tf::StampedTransform base_to_camera;
+    try {
+        tf_listener.lookupTransform(msg.header.frame_id, "base", ros::Time(0), base_to_camera);
+    } catch(tf::TransformException& e){
+        return;
+    }
 
-        //For all the poses that did not make it into the new scene, remove them
-        for(int i = 0; i < prev_diffs.size(); i ++){
-            if(prev_to_cur_map.find(prev_diffs[i].id) == prev_to_cur_map.end()){
-                moveit_msgs::CollisionObject remove_obj = prev_diffs[i];
-                remove_obj.operation = moveit_msgs::CollisionObject::REMOVE;
-                remove_obj.header.stamp = ros::Time::now();
-                remove_obj.header.frame_id = "/base";
-                remove_objs.push_back(remove_obj);
-            }
+    const float dt = std::max(0.0, frame.header.stamp.toSec() - stamp);
+    const float half_side = params.object_side*std::sqrt(3.0f)/2 + params.roi_padding;
+    for(size_t i = 0; i < tracks.size(); i++){
+        const Eigen::Vector3f predicted = tracks[i].position + tracks[i].velocity*dt;
+        const tf::Vector3 center = base_to_camera(tf::Vector3(predicted[0], predicted[1],
+                                                              predicted[2]));
+        if(!frame.roi.addCube(intrinsics, Eigen::Vector3f(center.x(), center.y(), center.z()),
+                              half_side)){
+            frame.roi.reset(msg.width, msg.height);
+            return;
         }
     }
+}
 
-    // For all the current poses that were not matched with a previous pose,
-    // add a new CollisionObject
-
-    for(int j = 0; j < cur_poses.size(); j++){
-        //if(added_poses.find(cur_poses[j]) == added_poses.end()){
-
-            moveit_msgs::CollisionObject new_obj; 
-            char id[16];
-            sprintf(id, "goal_block_%d", object_sequence);
-            new_obj.id=id;
-            shape_msgs::SolidPrimitive primitive;
-            primitive.type = primitive.BOX;
-            primitive.dimensions.resize(3);
-            primitive.dimensions[0] = object_side;
-            primitive.dimensions[1] = object_side;
-            primitive.dimensions[2] = object_side;
-            new_obj.primitives.push_back(primitive);
-            new_obj.primitive_poses.push_back(cur_poses[j]);
-            new_obj.operation = moveit_msgs::CollisionObject::ADD;
-
-            new_obj.header.frame_id = "/base";
-            new_obj.header.stamp = ros::Time::now();
-
-            object_sequence++;
+void CloudSegmenter::info_callback(const sensor_msgs::CameraInfo::ConstPtr& msg){
+    boost::mutex::scoped_lock lock(roi_mutex);
+    camera.fx = msg->K[0];
+    camera.cx = msg->K[2];
+    camera.fy = msg->K[4];
+    camera.cy = msg->K[5];
+    camera.width = msg->width;
+    camera.height = msg->height;
+}
 
-            next_objs.push_back(new_obj);
-        //}
-    }
-}*/
 
-void CloudSegmenter:: publish_poses(){
+void CloudSegmenter:: publish_poses(SegmentationFrame& frame){
     //geometry_msgs::PoseArray msg;
     //msg.poses = cur_poses;
-    if(!published_goals){
-        CollisionObjectArray msg;
-        vector<moveit_msgs::CollisionObject> cur_diffs_vec;
-        for(IDObjectMap::iterator it = cur_diffs.begin(); it != cur_diffs.end(); it++){
-            cur_diffs_vec.push_back(it->second);
-        }
-        msg.objects = cur_diffs_vec;
-        if(cur_diffs_vec.empty()){
-            cout << "Oops, no objects found!" << endl;
+    //Everything goes out as shared pointers so intra-process subscribers
+    //never see a serialized copy
+    //Whatever changed since the last frame that was published, which may
+    //be more than this frame's changes
+    CollisionObjectArray::Ptr msg;
+    {
+        boost::mutex::scoped_lock lock(scene_mutex);
+        if(has_unsent_objects){
+            msg.reset(new CollisionObjectArray);
+            msg->objects.swap(unsent_objects);
+            msg->resync = unsent_resync;
+            unsent_resync = false;
+            has_unsent_objects = false;
         }
-        /*for(int i = 0; i < cur_diffs_vec.size(); i++){
-            cur_diffs_vec[i].header.stamp = ros::Time::now();
-            object_pub.publish(cur_diffs_vec[i]);
-        }*/
-        
+    }
+    if(msg){
         object_pub.publish(msg);
-
-        published_goals=true;
     }
 
-    geometry_msgs::PoseArray pose_msg;
-    pose_msg.poses = goal_poses;
-    goal_pub.publish(pose_msg);
-    if(segmented){
+    //Only the targets that were looked for in this frame
+    for(size_t i = 0; i < frame.target_ids.size(); i++){
+        const int target = frame.target_ids[i];
+        geometry_msgs::PoseArray::Ptr pose_msg(new geometry_msgs::PoseArray);
+        pose_msg->poses = frame.goal_poses[target];
+        targets[target].goal_pub.publish(pose_msg);
+    }
+    if(frame.segmented){
         //tf_listener.waitForTransform(frame_id, "/base", cloud_msg.header.stamp, ros::Duration(4.0));
         //pcl_ros::transformPointCloud("/base", cloud_msg, cloud_msg, tf_listener);
-        cloud_msg.header.frame_id = frame_id;
-        cloud_msg.header.stamp = ros::Time::now();
-        cloud_pub.publish(cloud_msg);
+        publishSegmentedClouds(frame);
     }
 
-    /*if(has_cloud){
-        if(!goal_poses.empty()){
-            exclude_all_objects(goal_poses);
-        }
-        cout << "publishing modified points" << endl;
-        cloud_msg.header.frame_id = frame_id;
-        tf_listener.waitForTransform(frame_id, "/base", cloud_msg.header.stamp, ros::Duration(4.0));
-        pcl_ros::transformPointCloud("/base", cloud_msg, cloud_msg, tf_listener);
-        //cloud_msg.header.stamp = ros::Time::now();
-        cloud_pub.publish(cloud_msg);
-    }*/
-}
-
-PointColorCloud::ConstPtr CloudSegmenter::getCloudPtr(){
-    return cloud;
-}
+    //Voxels need the base frame and the whole view: the grid is diffed
+    //against the last full set, so a frame cropped to the ROI would report
+    //everything outside it as removed. Such frames are skipped; the next one
+    //reports what changed since the last one that was used.
+    const bool publish_cloud = obstacle_pub.getNumSubscribers() > 0;
+    const bool publish_voxels = occupancy_pub.getNumSubscribers() > 0 &&
+                                frame.has_camera_transform && !frame.cropped;
+    if(occupancy_pub.getNumSubscribers() == 0){
+        //Whoever subscribes next starts with the whole grid
+        occupancy.clear();
+    }
+    if(!publish_cloud){
+        last_obstacles.reset();
+    }
+    if(publish_cloud || publish_voxels){
+        publishObstacles(frame, publish_cloud, publish_voxels);
+    }
 
-PointColorCloud::ConstPtr CloudSegmenter::getClusteredCloudPtr(){
-    return colored_cloud;
+    std_msgs::Float64 age_msg;
+    age_msg.data = (ros::Time::now() - frame.header.stamp).toSec();
+    age_pub.publish(age_msg);
 }
 
-OrientedBoundingBox getOBBForCloud(PointColorCloud::Ptr cloud_ptr){
-
-    pcl::MomentOfInertiaEstimation<pcl::PointXYZRGB> inertia;
-
-    inertia.setInputCloud(cloud_ptr);
-
-    //get the moment of inertia
-    inertia.compute();
-
-    //this centroid will be a bit off because we get only 2-3 faces of a cube
-    //Get the oriented bounding box around this cluster
-    pcl::PointXYZRGB min_point_OBB;
-    pcl::PointXYZRGB max_point_OBB;
-    pcl::PointXYZRGB position_OBB;
-    Eigen::Matrix3f rotational_matrix_OBB;
-    inertia.getOBB(min_point_OBB, max_point_OBB, position_OBB, rotational_matrix_OBB);
-    pcl::PointXYZRGB min_point_AABB;
-    pcl::PointXYZRGB max_point_AABB;
-    inertia.getAABB(min_point_AABB, max_point_AABB);
-    return OrientedBoundingBox(min_point_OBB, max_point_OBB, position_OBB,
-                           rotational_matrix_OBB, min_point_AABB, max_point_AABB);
-
+// Every view of the segmentation that somebody listens to. The colored
+// cloud was only made if one of its views had subscribers when the frame
+// came in.
+void CloudSegmenter::publishSegmentedClouds(SegmentationFrame& frame){
+    std_msgs::Header header;
+    header.frame_id = frame.header.frame_id;
+    header.stamp = ros::Time::now();
+    const PointColorCloud::Ptr& colored = frame.colored_cloud;
+
+    if(colored && cloud_pub.getNumSubscribers() > 0){
+        pcl_conversions::toPCL(header, colored->header);
+        cloud_pub.publish(colored);
+    }
+    if(labels_pub.getNumSubscribers() > 0){
+        pcl::PCLPointCloud2 labels;
+        CloudEncoder::encodeLabels(*frame.cloud, frame.clusters, labels);
+        sensor_msgs::PointCloud2::Ptr msg(new sensor_msgs::PointCloud2);
+        pcl_conversions::moveFromPCL(labels, *msg);
+        msg->header = header;
+        labels_pub.publish(msg);
+    }
+    if(targets_pub.getNumSubscribers() > 0){
+        pcl::PCLPointCloud2 target_points;
+        encoder.encodeClusters(*frame.cloud, frame.clusters, frame.target_clusters,
+                               target_points);
+        sensor_msgs::PointCloud2::Ptr msg(new sensor_msgs::PointCloud2);
+        pcl_conversions::moveFromPCL(target_points, *msg);
+        msg->header = header;
+        targets_pub.publish(msg);
+    }
+    if(colored && preview_pub.getNumSubscribers() > 0){
+        pcl::PCLPointCloud2 preview;
+        encoder.encodePreview(*colored, frame.params.preview_leaf, preview);
+        sensor_msgs::PointCloud2::Ptr msg(new sensor_msgs::PointCloud2);
+        pcl_conversions::moveFromPCL(preview, *msg);
+        msg->header = header;
+        preview_pub.publish(msg);
+    }
+    if(colored && !colored->empty() && compressed_pub.getNumSubscribers() > 0){
+        CompressedCloud::Ptr msg(new CompressedCloud);
+        msg->header = header;
+        encoder.compress(colored, msg->data);
+        compressed_pub.publish(msg);
+    }
 }
 
-void CloudSegmenter::mergeCollidingBoxes(){
-    bool collides = true;
-    while(collides){
-        collides = false;
-        for (int i = 0; i < cloud_ptrs.size(); i++){
-            for (int j = 0; j < cloud_ptrs.size(); j++){
-                if (cloud_ptrs[i] == cloud_ptrs[j]){
-                    continue;
-                }
-                if (cloud_boxes[cloud_ptrs[i]].collides_with(cloud_boxes[cloud_ptrs[j]]) ){
-                    collides=true;
-                    PointColorCloud newcloud = *cloud_ptrs[i] + *cloud_ptrs[j];
-                    
-                    PointColorCloud::Ptr newptr = newcloud.makeShared();
-                    cloud_boxes.erase(cloud_ptrs[j]);
-                    cloud_ptrs.erase(cloud_ptrs.begin()+j);
-
-                    cloud_boxes.erase(cloud_ptrs[i]);
-                    cloud_ptrs.erase(cloud_ptrs.begin()+i);
-
-                    //push_back new box
-                    cloud_ptrs.push_back(newptr);
-                    cloud_boxes[newptr] = getOBBForCloud(cloud_ptrs.back());
-                    break;
-                }
+// Everything but the blocks, padded by exclusion_padding: as a cloud in the
+// camera frame, and as the voxels of the base frame that changed since the
+// last frame. The blocks are the boxes found in this frame and, if the frame
+// was transformed, the confirmed tracks brought back into the camera frame,
+// so that a block missed for a frame is still left out. All boxes are
+// removed in one pass over the cloud.
+void CloudSegmenter::publishObstacles(SegmentationFrame& frame, bool publish_cloud,
+                                      bool publish_voxels){
+    const SegmenterParams& params = frame.params;
+    const float half_side = params.object_side/2 + params.exclusion_padding;
+    const Eigen::Vector3f half_sides(half_side, half_side, half_side);
+
+    exclusion.clear();
+    for(size_t i = 0; i < frame.boxes.size(); i++){
+        OrientedBoundingBox& box = frame.boxes[i];
+        exclusion.addBox(box.get_position(), box.get_rotational_matrix(), half_sides);
+    }
+    if(frame.has_camera_transform){
+        const Eigen::Matrix3f& rotation = frame.base_to_camera_rotation;
+        const Eigen::Vector3f& translation = frame.base_to_camera_translation;
+        for(size_t t = 0; t < frame.goal_poses.size(); t++){
+            for(size_t i = 0; i < frame.goal_poses[t].size(); i++){
+                const geometry_msgs::Pose& pose = frame.goal_poses[t][i];
+                const Eigen::Quaternionf q(pose.orientation.w, pose.orientation.x,
+                                           pose.orientation.y, pose.orientation.z);
+                exclusion.addBox(rotation*positionToVector(pose.position) + translation,
+                                 rotation*q.toRotationMatrix(), half_sides);
             }
-            if(collides) break;
         }
     }
-}
 
-void CloudSegmenter:: segmentation(){
-
-    /* Segmentation code from:
-       http://pointclouds.org/documentation/tutorials/region_growing_rgb_segmentation.php*/
-
-    pcl::search::Search <pcl::PointXYZRGB>::Ptr tree =
-                        boost::shared_ptr<pcl::search::Search
-                        <pcl::PointXYZRGB> >
-                        (new pcl::search::KdTree<pcl::PointXYZRGB>);
-
-    cloud_ptrs.clear();
-    cloud_boxes.clear();
-    vector <pcl::PointIndices> clusters;
-    PointColorCloud obstacle_points;
-    //PointColorCloud goal_obj_points;
-    
-    reg.setInputCloud (cloud);
-    reg.setIndices (indices);
-    reg.setSearchMethod (tree);
-    reg.setDistanceThreshold (distance_threshold);
-    reg.setPointColorThreshold (point_color_threshold);
-    reg.setRegionColorThreshold (region_color_threshold);
-    reg.setMinClusterSize (min_cluster_size);
-    reg.setMaxClusterSize (max_cluster_size);
-
-    reg.extract (clusters);
-   
-    //cloud_mutex.lock(); 
-    colored_cloud = PointColorCloud(*reg.getColoredCloud()).makeShared();
-    //cloud_mutex.unlock(); 
-
-    // Select the correct color clouds from the segmentation
-    
-    cout << "Finished segmentation, starting clustering" << endl;
-    set<int> goal_indices;
-    for (int i = 0; i < clusters.size(); i++){
-        pcl::PointIndices cluster = clusters[i];
-
-        // Get a representative color in the cluster
-        const int n = cluster.indices.size();
-        const int sample_inc = n/sample_size;
-            
-        pcl::CentroidPoint<pcl::PointXYZRGB> rgb_centroid;
-        for (int j = 0; j < n; j++){
-            rgb_centroid.add(cloud->at(cluster.indices[j]));
-        }
-        pcl::PointXYZRGB avg_xyz;
-        rgb_centroid.get(avg_xyz);
-        pcl::PointRGB avg(avg_xyz.b, avg_xyz.g, avg_xyz.r);
-        /*float n_f = cluster.indices.size();
-        float r = 0; float g = 0; float b = 0;
-        // TODO: this is a major bottleneck. improve performance
-        for (int j = 0; j < n; j++){
-            pcl::PointRGB color = getCloudColorAt(cluster.indices[j]);
-            r += (float) color.r; //float typecasts suck
-            g += (float) color.g;
-            b += (float) color.b;
-        }
-        r /= n_f; g /= n_f; b /= n_f;
-        cout << "Average color: " << r << ", " << g << ", " << b << endl;
-        pcl::PointRGB avg((unsigned char) b, (unsigned char) g, (unsigned char) r);*/
-
-        cout << "Average color: " << (int) avg.r << ", " << (int) avg.g <<
-                ", " << (int) avg.b << endl;
-
-        // Check if avg is within the clicked color
-        PointColorCloud cloud_subset = PointColorCloud(*cloud, cluster.indices);
-        PointColorCloud::Ptr cloud_ptr = cloud_subset.makeShared();
-        if (isPointWithinDesiredRange(avg, desired_color, radius)){
-            cloud_ptrs.push_back(cloud_ptr);
-            for(int j = 0; j < n; j++){
-                goal_indices.insert(cluster.indices[j]);
-            }
+    //A cropped frame only holds the neighbourhood of the blocks, so the
+    //obstacles would change from frame to frame with the ROI
+    if(publish_cloud && frame.cropped){
+        if(last_obstacles){
+            obstacle_pub.publish(last_obstacles);
         }
+    } else if(publish_cloud){
+        PointColorCloud::Ptr obstacles(new PointColorCloud);
+        exclusion.filter(*frame.cloud, *obstacles, false);
+        std_msgs::Header header;
+        header.frame_id = frame.header.frame_id;
+        header.stamp = frame.header.stamp;
+        pcl_conversions::toPCL(header, obstacles->header);
+        obstacle_pub.publish(obstacles);
+        last_obstacles = obstacles;
     }
-    /*for(int i = 0; i < (*indices).size(); i++){
-        if(goal_indices.find(indices->at(i)) == goal_indices.end() ){
-            obstacle_points.push_back( cloud->at(indices->at(i)));
-        }
+    if(publish_voxels){
+        publishOccupancy(frame);
     }
-    cout<< "Modified point cloud has " << obstacle_points.size() << " points" << endl;
+}
 
-    obstacle_cloud = obstacle_points.makeShared();*/
-    pcl::toROSMsg(*colored_cloud, cloud_msg);
+static void packVoxels(const vector<boost::uint64_t>& keys, vector<int16_t>& packed){
+    packed.clear();
+    packed.reserve(3*keys.size());
+    for(size_t i = 0; i < keys.size(); i++){
+        int coords[3];
+        CloudPreprocessor::voxelCoords(keys[i], coords[0], coords[1], coords[2]);
+        for(int k = 0; k < 3; k++){
+            //Over 300 m out even with 1 cm voxels; saturate rather than wrap
+            packed.push_back((int16_t) std::max(-32768, std::min(32767, coords[k])));
+        }
+    }
+}
 
-    cout << "Clusters found: " << cloud_ptrs.size() << endl;
-    if(cloud_ptrs.empty()){
+// Only sent when something changed, or on a resync, so a static scene
+// costs nothing. exclusion has to be set up for the frame.
+void CloudSegmenter::publishOccupancy(SegmentationFrame& frame){
+    const SegmenterParams& params = frame.params;
+    occupancy.setVoxelSize((float) params.occupancy_voxel);
+    occupancy.setMinPoints(params.occupancy_min_points);
+    occupancy.setResyncPeriod(params.scene_resync_period);
+
+    exclusion.filter(*frame.cloud, obstacle_indices);
+    //camera to base, the inverse of what the frame holds
+    const Eigen::Matrix3f rotation = frame.base_to_camera_rotation.transpose();
+    const Eigen::Vector3f translation = -(rotation*frame.base_to_camera_translation);
+    const bool resync = occupancy.update(*frame.cloud, obstacle_indices, rotation, translation,
+                                         frame.header.stamp.toSec(), voxels_added,
+                                         voxels_removed);
+    if(!resync && voxels_added.empty() && voxels_removed.empty()){
         return;
     }
 
-    segmented = true;
+    VoxelOccupancy::Ptr msg(new VoxelOccupancy);
+    msg->header.frame_id = "base";
+    msg->header.stamp = frame.header.stamp;
+    msg->voxel_size = occupancy.getVoxelSize();
+    msg->resync = resync;
+    packVoxels(voxels_added, msg->added);
+    packVoxels(voxels_removed, msg->removed);
+    occupancy_pub.publish(msg);
+}
 
-    vector<geometry_msgs::Pose> cur_poses;
-    vector<OrientedBoundingBox> OBBs;
-    for (int i = 0; i < cloud_ptrs.size(); i++){
-        OBBs.push_back(getOBBForCloud(cloud_ptrs[i]));
-        //cout << "OBB position: " << OBBs.back().get_position() << endl;
-        //OBBs.back().set_sides( object_side, object_side, object_side);
-        cloud_boxes.insert(CloudPtrBoxPair(cloud_ptrs[i], OBBs.back()));
-    }
+// Copy cloud into the snapshot's free buffer, which keeps its storage from
+// two frames ago. Only one thread may publish to each snapshot.
+void CloudSegmenter::publishSnapshot(const PointColorCloud& cloud,
+                                     Snapshot<PointColorCloud>& snapshot,
+                                     SegmentationFrame& frame){
+    bool allocated;
+    PointColorCloud::Ptr copy = snapshot.acquire(allocated);
+    *copy = cloud;
+    frame.replaced_buffers += allocated;
+    snapshot.publish(copy);
+}
 
-    //Combine poses with intersecting bounding boxes
-    mergeCollidingBoxes();
+PointColorCloud::ConstPtr CloudSegmenter::getCloudPtr(){
+    return cloud_snapshot.get();
+}
 
-    //For each OBB, extract the pose
+PointColorCloud::ConstPtr CloudSegmenter::getClusteredCloudPtr(){
+    return colored_snapshot.get();
+}
 
-    for(CloudPtrBoxMap::iterator it = cloud_boxes.begin(); it != cloud_boxes.end(); it++){
-        OrientedBoundingBox box = (OrientedBoundingBox) it->second;
-        Eigen::Vector3f position_OBB = box.get_position();
-        Eigen::Matrix3f rotational_matrix_OBB = box.get_rotational_matrix();
-        
-        geometry_msgs::Point position;
-        position.x = position_OBB[0];
-        position.y = position_OBB[1];
-        position.z = position_OBB[2];
+const Snapshot<PointColorCloud>& CloudSegmenter::getCloudSnapshot() const {
+    return cloud_snapshot;
+}
 
-        Eigen::Quaternionf q(rotational_matrix_OBB);
+const Snapshot<PointColorCloud>& CloudSegmenter::getClusteredSnapshot() const {
+    return colored_snapshot;
+}
 
-        geometry_msgs::Quaternion orientation;
-        orientation.w = q.w();
-        orientation.x = q.x();
-        orientation.y = q.y();
-        orientation.z = q.z();
+void CloudSegmenter::setViewerAttached(bool attached){
+    viewer_attached = attached;
+}
 
-        geometry_msgs::PoseStamped pose_in;
-        pose_in.pose.position = position; pose_in.pose.orientation = orientation;
-        //cout << "Pose in: " << pose_in.pose << endl;
-        pose_in.header.frame_id = frame_id;
-        geometry_msgs::PoseStamped pose_out;
-        //pose_in.header.stamp = ros::Time::now();
-        tf_listener.waitForTransform(frame_id, "base", pose_in.header.stamp, ros::Duration(4.0));
-        tf_listener.transformPose("/base", pose_in, pose_out);
-        //cout << "Pose out: " << pose_out.pose << endl;
-        pose_out.header.frame_id = "/base";
-        cur_poses.push_back(pose_out.pose);
+void CloudSegmenter:: segmentation(SegmentationFrame& frame){
+    pipeline.segment(frame);
+    if(frame.colored_cloud && viewer_attached){
+        publishSnapshot(*frame.colored_cloud, colored_snapshot, frame);
     }
 
-    cout << "Found " << cur_poses.size() << " non-colliding boxes" << endl;
-    //match_objects(cur_poses);
-    if(!published_goals){
-        match_objects(cur_poses);
+    //Kept from the first segmentation on, like before
+    if(!frame.boxes.empty()){
+        segmented = true;
     }
-    goal_poses = cur_poses;
-
+    frame.segmented = segmented;
 }
 
-void CloudSegmenter::points_callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
-    updateParams();
-    //cout << "got points" << endl;
-    frame_id = msg->header.frame_id;
-    // Members: float x, y, z; uint32_t rgba
-    pcl::PCLPointCloud2 pcl_pc;
-    pcl_conversions::toPCL(*msg, pcl_pc);
-    pcl::fromPCLPointCloud2(pcl_pc, *cloud);
-    indices = pcl::IndicesPtr( new vector<int>() );
-
-    //cout << "Locking in points callback" << endl;
-    //cloud_mutex.lock();
-    pcl::removeNaNFromPointCloud(*cloud, *cloud, *indices);
-
-    pcl::VoxelGrid<pcl::PointXYZRGB> sampler;
-    sampler.setInputCloud(cloud);
-    sampler.setLeafSize(leaf_size, leaf_size, leaf_size);
-    sampler.filter(*cloud);
-
-    pcl::RadiusOutlierRemoval<pcl::PointXYZRGB> noise_filter;
-    noise_filter.setInputCloud(cloud);
-    noise_filter.setRadiusSearch(outlier_radius);
-    noise_filter.setMinNeighborsInRadius(min_neighbors);
-    noise_filter.filter(*cloud);
-
-    pcl::PassThrough<pcl::PointXYZRGB> pass;
-    pass.setInputCloud (cloud);
-    pass.setFilterFieldName ("z");
-    pass.setFilterLimits (filter_min, filter_max);
-    pass.filter (*indices);
-
-
-    //cout << "Unlocking in points callback" << endl;
-    //cloud_mutex.unlock();
-
-    if(!has_cloud){
-        cloud_msg = sensor_msgs::PointCloud2(*msg);
+// Move the boxes of a frame into the base frame with one lookup of the
+// camera to base transform at the frame's stamp. Never waits: if the
+// transform isn't there yet the frame stays queued, and once it is older
+// than tf_timeout it is given up on.
+CloudSegmenter::TransformStatus CloudSegmenter::transformBoxes(SegmentationFrame& frame,
+                                              vector<geometry_msgs::Pose>& poses){
+    poses.clear();
+    if(frame.boxes.empty() && !frame.need_transform){
+        return TRANSFORM_DONE;
     }
 
-    has_cloud = true;
+    const string& camera_frame = frame.header.frame_id;
+    const ros::Time& stamp = frame.header.stamp;
+    if(!tf_listener.canTransform("base", camera_frame, stamp)){
+        if((ros::Time::now() - stamp).toSec() > frame.params.tf_timeout){
+            return TRANSFORM_EXPIRED;
+        }
+        return TRANSFORM_PENDING;
+    }
 
-    if(has_desired_color){
-        cout << "Segmenting for desired color: " << (int) desired_color.r <<
-                ", " << (int) desired_color.g << ", " << (int) desired_color.b << endl;
+    ScopedStageTimer timer(frame.stats, PipelineStats::TF, frame.boxes.size());
+    tf::StampedTransform camera_to_base;
+    try {
+        tf_listener.lookupTransform("base", camera_frame, stamp, camera_to_base);
+    } catch(tf::TransformException& e){
+        ROS_WARN_THROTTLE(10, "Dropping frame: %s", e.what());
+        return TRANSFORM_EXPIRED;
+    }
+    const tf::Matrix3x3& basis = camera_to_base.getBasis();
+    const tf::Vector3& origin = camera_to_base.getOrigin();
+    Eigen::Matrix3f rotation;
+    Eigen::Vector3f translation;
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 3; j++){
+            rotation(i, j) = basis[i][j];
+        }
+        translation[i] = origin[i];
+    }
+    frame.has_camera_transform = true;
+    frame.base_to_camera_rotation = rotation.transpose();
+    frame.base_to_camera_translation = -(rotation.transpose()*translation);
 
-        //cloud_mutex.lock();
-        segmentation();
-        //cloud_mutex.unlock();
-        publish_poses();
+    //For each OBB, extract the pose
+    for(size_t i = 0; i < frame.boxes.size(); i++){
+        OrientedBoundingBox& box = frame.boxes[i];
+        Eigen::Vector3f position_OBB = rotation*box.get_position() + translation;
+        Eigen::Quaternionf q(rotation*box.get_rotational_matrix());
+
+        geometry_msgs::Pose pose;
+        pose.position.x = position_OBB[0];
+        pose.position.y = position_OBB[1];
+        pose.position.z = position_OBB[2];
+        pose.orientation.w = q.w();
+        pose.orientation.x = q.x();
+        pose.orientation.y = q.y();
+        pose.orientation.z = q.z();
+        poses.push_back(pose);
     }
+    timer.setItemsOut(poses.size());
+    return TRANSFORM_DONE;
 }
 
-void CloudSegmenter::color_callback(const geometry_msgs::Point msg){
-    desired_color = pcl::PointRGB(msg.z, msg.y, msg.x); //bgr!
-    has_desired_color = true;
-
+// A single 4 byte field that fits in a point
+static bool isScalarField(const sensor_msgs::PointField& field, boost::uint32_t point_step){
+    return field.count <= 1 && (boost::uint64_t) field.offset + 4 <= point_step;
 }
 
-//just a wrapper to make things more readable
-void addComparison(pcl::ConditionOr<pcl::PointXYZRGB>::Ptr range_cond,
-                   const char* channel, pcl::ComparisonOps::CompareOp op,
-                   float value){
-    range_cond->addComparison(pcl::FieldComparison<pcl::PointXYZRGB>::ConstPtr(
-                new pcl::FieldComparison<pcl::PointXYZRGB>(channel, op, value)) );
+// Point the view at the message's buffer. Fails if the cloud doesn't have
+// float x, y, z and a packed rgb field in little endian order, or if its
+// sizes don't add up, since the view is read without bounds checks.
+bool CloudSegmenter::viewFromMessage(const sensor_msgs::PointCloud2& msg, CloudView& view){
+    view = CloudView();
+    if(msg.is_bigendian || msg.data.empty()){
+        return false;
+    }
+    //64 bits, so that the products can't wrap
+    if((boost::uint64_t) msg.row_step < (boost::uint64_t) msg.width*msg.point_step ||
+       (boost::uint64_t) msg.data.size() < (boost::uint64_t) msg.row_step*msg.height){
+        return false;
+    }
+    int found = 0;
+    for(size_t i = 0; i < msg.fields.size(); i++){
+        const sensor_msgs::PointField& field = msg.fields[i];
+        if(!isScalarField(field, msg.point_step)){
+            continue;
+        }
+        if(field.name == "x" && field.datatype == sensor_msgs::PointField::FLOAT32){
+            view.x_offset = field.offset; found |= 1;
+        } else if(field.name == "y" && field.datatype == sensor_msgs::PointField::FLOAT32){
+            view.y_offset = field.offset; found |= 2;
+        } else if(field.name == "z" && field.datatype == sensor_msgs::PointField::FLOAT32){
+            view.z_offset = field.offset; found |= 4;
+        } else if((field.name == "rgb" || field.name == "rgba") &&
+                  (field.datatype == sensor_msgs::PointField::FLOAT32 ||
+                   field.datatype == sensor_msgs::PointField::UINT32)){
+            //PCL packs rgb into a float, rgba into an unsigned int
+            view.rgb_offset = field.offset; found |= 8;
+        }
+    }
+    if(found != 15){
+        return false;
+    }
+    view.data = &msg.data[0];
+    view.width = msg.width;
+    view.height = msg.height;
+    view.point_step = msg.point_step;
+    view.row_step = msg.row_step;
+    return true;
 }
 
+bool CloudSegmenter::preprocess(SegmentationFrame& frame){
+    CloudView view;
+    {
+        ScopedStageTimer timer(frame.stats, PipelineStats::CONVERSION, frame.msg->width*frame.msg->height);
+        if(!viewFromMessage(*frame.msg, view)){
+            ROS_WARN_THROTTLE(10, "Point cloud is truncated or has no float xyz and rgb "
+                                  "fields, skipping it");
+            frame.msg.reset();
+            return false;
+        }
+        timer.setItemsOut(view.size());
+    }
 
-//not in use
-void CloudSegmenter::exclude_object(const geometry_msgs::Pose object, const PointColorCloud::ConstPtr src_cloud, PointColorCloud::Ptr dst_cloud ){
-
-    //Assume the object has object_height dimensions
-    //Remove the part of the pointcloud containing the goal object (with a bit of padding)
-    const float side = object_side + exclusion_padding*2;
+    //NaN removal, z passthrough and voxel grid in one sweep, straight out
+    //of the driver's buffer
+    pipeline.filter(view, frame);
+    pcl_conversions::toPCL(frame.header, frame.cloud->header);
+    //Done with the message, let the driver have its buffer back
+    frame.msg.reset();
 
-    const float inner_side = object_side - exclusion_padding*2;
-    const float outer_side = object_side + exclusion_padding*2;
-    
-    //Transform to the object frame (so that the center of the object is the origin)
-    Eigen::Vector3f position( object.position.x, object.position.y, object.position.y ); //???
-    Eigen::Quaternionf orientation(object.orientation.w, object.orientation.x,
-                                   object.orientation.y, object.orientation.z);
-    Eigen::Isometry3f object_camera_tf;
-    object_camera_tf.setIdentity(); 
-    object_camera_tf = object_camera_tf.translate(position);
-    object_camera_tf = object_camera_tf.rotate(orientation);
+    pipeline.removeOutliers(frame);
+    return true;
+}
 
-    Eigen::Matrix4f object_camera = object_camera_tf.matrix();
-    Eigen::Matrix4f camera_object = object_camera.inverse();
+// Ingest stage: runs on the ROS callback thread and only packages the
+// frame. Frames are recycled, so everything not refilled by a later stage is
+// reset here.
+void CloudSegmenter::points_callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
+    updateParams();
+    //cout << "got points" << endl;
+    bool allocated;
+    SegmentationFrame::Ptr frame = frame_pool.acquire(allocated);
+    frame->replaced_buffers = allocated;
+    frame->header = msg->header;
+    frame->params = params;
+    frame->targets.clear();
+    frame->target_ids.clear();
+    frame->segmented = false;
+    frame->has_camera_transform = false;
+    frame->need_transform = occupancy_pub.getNumSubscribers() > 0;
+    frame->scene_resync = false;
+    {
+        boost::mutex::scoped_lock lock(targets_mutex);
+        for(size_t i = 0; i < targets.size(); i++){
+            if(targets[i].has_color){
+                frame->targets.push_back(targets[i].color);
+                frame->target_ids.push_back(i);
+            }
+        }
+    }
+    frame->msg = msg;
+    frame->stats = params.diagnostics ? &stats : NULL;
+    //Nothing but the debug views needs the colored cloud
+    frame->color_clusters = viewer_attached ||
+                            cloud_pub.getNumSubscribers() > 0 ||
+                            preview_pub.getNumSubscribers() > 0 ||
+                            compressed_pub.getNumSubscribers() > 0;
+    buildROI(*frame);
+
+    ingest_slot.put(frame);
+}
 
-    pcl::transformPointCloud(*src_cloud, *dst_cloud, camera_object);
+void CloudSegmenter::preprocessLoop(){
+    SegmentationFrame::Ptr frame;
+    while(ingest_slot.take(frame)){
+        //An empty frame would count as every block gone missing
+        if(!preprocess(*frame)){
+            //Back to the pool
+            frame.reset();
+            continue;
+        }
+        if(viewer_attached){
+            publishSnapshot(*frame->cloud, cloud_snapshot, *frame);
+        }
+        preprocess_slot.put(frame);
+    }
+}
 
-    //apply condition to exclude the cube
-    //From http://pointclouds.org/documentation/tutorials/conditional_removal.php
-    pcl::ConditionOr<pcl::PointXYZRGB>::Ptr range_cond(
-                                    new pcl::ConditionOr<pcl::PointXYZRGB>);
+void CloudSegmenter::segmentLoop(){
+    SegmentationFrame::Ptr frame;
+    while(preprocess_slot.take(frame)){
+        if(frame->targets.empty()){
+            continue;
+        }
+        segmentation(*frame);
+        //The index is not needed past segmentation, give it back to the pool
+        frame->search.reset();
+        segment_slot.put(frame);
+    }
+}
 
-    addComparison(range_cond, "x", pcl::ComparisonOps::LT, -side/2.0);
-    addComparison(range_cond, "x", pcl::ComparisonOps::GT,  side/2.0);
-    addComparison(range_cond, "y", pcl::ComparisonOps::LT, -side/2.0);
-    addComparison(range_cond, "y", pcl::ComparisonOps::GT,  side/2.0);
-    addComparison(range_cond, "z", pcl::ComparisonOps::LT, -side/2.0);
-    addComparison(range_cond, "z", pcl::ComparisonOps::GT,  side/2.0);
-                                                       
-    pcl::ConditionalRemoval<pcl::PointXYZRGB> condrem;
-    condrem.setCondition(range_cond); 
-    condrem.setInputCloud(dst_cloud);
-    condrem.setKeepOrganized(true);
-    condrem.filter(*dst_cloud);
+// Frames wait here, in order, until their transform is available. Nothing
+// is dropped on the way in; frames leave either transformed and tracked, or
+// expired.
+void CloudSegmenter::transformLoop(){
+    deque<SegmentationFrame::Ptr> pending;
+    SegmentationFrame::Ptr frame;
+    vector<geometry_msgs::Pose> cur_poses;
+    while(true){
+        if(pending.empty()){
+            if(!segment_slot.take(frame)){
+                break;
+            }
+            pending.push_back(frame);
+        } else if(segment_slot.take(frame, boost::posix_time::milliseconds(5))){
+            pending.push_back(frame);
+        } else if(segment_slot.isClosed()){
+            break;
+        }
 
-    //transform back
-    pcl::transformPointCloud(*dst_cloud, *dst_cloud, object_camera);
+        //Tracking needs the frames in order, so stop at the first one that
+        //has to keep waiting
+        while(!pending.empty()){
+            SegmentationFrame::Ptr& front = pending.front();
+            const TransformStatus status = transformBoxes(*front, cur_poses);
+            if(status == TRANSFORM_PENDING){
+                break;
+            }
+            if(status == TRANSFORM_EXPIRED){
+                tf_dropped++;
+                pending.pop_front();
+                continue;
+            }
 
+            track_objects(cur_poses, *front);
+            //A resync goes out even if the scene is empty, so that receivers
+            //drop whatever they still hold. It holds the whole scene, so it
+            //replaces anything still unsent; later changes go after it.
+            if(front->scene_resync || !cur_diffs.empty()){
+                boost::mutex::scoped_lock lock(scene_mutex);
+                if(front->scene_resync){
+                    unsent_objects.clear();
+                    unsent_resync = true;
+                }
+                unsent_objects.insert(unsent_objects.end(), cur_diffs.begin(), cur_diffs.end());
+                has_unsent_objects = true;
+            }
+            transform_slot.put(front);
+            pending.pop_front();
+        }
+    }
 }
 
-void CloudSegmenter::exclude_all_objects(vector<geometry_msgs::Pose> cur_poses){
+void CloudSegmenter::publishLoop(){
+    SegmentationFrame::Ptr frame;
+    ros::WallTime last_diagnostics = ros::WallTime::now();
+    while(transform_slot.take(frame)){
+        {
+            ScopedStageTimer timer(frame->stats, PipelineStats::PUBLISH);
+            publish_poses(*frame);
+        }
+        if(frame->stats){
+            frame->stats->recordReplacedBuffers(frame->replaced_buffers);
+        }
+        const SegmenterParams& frame_params = frame->params;
+        if(frame_params.diagnostics &&
+           (ros::WallTime::now() - last_diagnostics).toSec() >= frame_params.diagnostics_period){
+            publishDiagnostics();
+            last_diagnostics = ros::WallTime::now();
+        }
+    }
+}
 
+// One status per stage with the latency percentiles over the last frames
+// and the average number of points (or boxes) going in and out, plus one
+// for the buffers frames allocated and one for the frames the pipeline
+// dropped.
+void CloudSegmenter::publishDiagnostics(){
+    diagnostic_msgs::DiagnosticArray::Ptr msg(new diagnostic_msgs::DiagnosticArray);
+    msg->header.stamp = ros::Time::now();
+
+    PipelineStats::Summary summary;
+    char value[32];
+    for(int i = 0; i < PipelineStats::NUM_STAGES; i++){
+        const PipelineStats::Stage stage = (PipelineStats::Stage) i;
+        stats.summarize(stage, summary);
+        if(summary.samples == 0){
+            continue;
+        }
+        diagnostic_msgs::DiagnosticStatus status;
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.name = string("object_finder_3d: ") + PipelineStats::stageName(stage);
+        sprintf(value, "p50 %.2f ms, p99 %.2f ms", summary.p50, summary.p99);
+        status.message = value;
+
+        const char* keys[] = {"p50_ms", "p90_ms", "p99_ms", "max_ms", "mean_ms",
+                              "items_in", "items_out"};
+        const double values[] = {summary.p50, summary.p90, summary.p99, summary.max,
+                                 summary.mean, summary.items_in, summary.items_out};
+        for(int k = 0; k < 7; k++){
+            diagnostic_msgs::KeyValue kv;
+            kv.key = keys[k];
+            sprintf(value, "%.3f", values[k]);
+            kv.value = value;
+            status.values.push_back(kv);
+        }
+        sprintf(value, "%lu", (unsigned long) summary.samples);
+        diagnostic_msgs::KeyValue samples;
+        samples.key = "samples";
+        samples.value = value;
+        status.values.push_back(samples);
+        msg->status.push_back(status);
+    }
 
-    for(int i = 0; i < cur_poses.size(); i++){
+    stats.summarizeReplacedBuffers(summary);
+    if(summary.samples > 0){
+        //Buffers replaced rather than refilled; 0 in steady state unless
+        //a debug view holds on to a frame's clouds
+        diagnostic_msgs::DiagnosticStatus replaced;
+        replaced.level = diagnostic_msgs::DiagnosticStatus::OK;
+        replaced.name = "object_finder_3d: replaced buffers";
+        sprintf(value, "p50 %.0f, max %.0f per frame", summary.p50, summary.max);
+        replaced.message = value;
+        const char* keys[] = {"p50", "p99", "max", "mean"};
+        const double values[] = {summary.p50, summary.p99, summary.max, summary.mean};
+        for(int k = 0; k < 4; k++){
+            diagnostic_msgs::KeyValue kv;
+            kv.key = keys[k];
+            sprintf(value, "%.1f", values[k]);
+            kv.value = value;
+            replaced.values.push_back(kv);
+        }
+        msg->status.push_back(replaced);
+    }
 
-        exclude_object(cur_poses[i], obstacle_cloud, obstacle_cloud);
+    diagnostic_msgs::DiagnosticStatus dropped;
+    dropped.level = diagnostic_msgs::DiagnosticStatus::OK;
+    dropped.name = "object_finder_3d: dropped frames";
+    const char* slot_names[] = {"ingest", "preprocess", "segment", "transform",
+                                "transform timeout"};
+    const size_t slot_dropped[] = {ingest_slot.getDropped(), preprocess_slot.getDropped(),
+                                   segment_slot.getDropped(), transform_slot.getDropped(),
+                                   tf_dropped};
+    for(int k = 0; k < 5; k++){
+        diagnostic_msgs::KeyValue kv;
+        kv.key = slot_names[k];
+        sprintf(value, "%lu", (unsigned long) slot_dropped[k]);
+        kv.value = value;
+        dropped.values.push_back(kv);
     }
+    msg->status.push_back(dropped);
 
-    pcl::toROSMsg(*obstacle_cloud, cloud_msg);
+    diagnostics_pub.publish(msg);
 }
 
-void CloudSegmenter::goal_callback(const geometry_msgs::Pose msg){
-
-    PointColorCloud::Ptr transform_cloud(new PointColorCloud);
-    
-    exclude_object(msg, cloud, transform_cloud);
+void CloudSegmenter::color_callback(const geometry_msgs::Point msg){
+    boost::mutex::scoped_lock lock(targets_mutex);
+    targets[0].color = pcl::PointRGB(msg.z, msg.y, msg.x); //bgr!
+    targets[0].has_color = true;
 
-    //publish it to topic /modified_points
-    pcl::toROSMsg(*transform_cloud, cloud_msg);
+}
 
-    obstacle_cloud = transform_cloud;
+void CloudSegmenter::target_color_callback(const geometry_msgs::Point::ConstPtr& msg,
+                                           int target){
+    boost::mutex::scoped_lock lock(targets_mutex);
+    targets[target].color = pcl::PointRGB(msg->z, msg->y, msg->x); //bgr!
+    targets[target].has_color = true;
 }
 }
 #endif
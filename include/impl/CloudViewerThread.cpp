@@ -0,0 +1,110 @@
+#ifndef BAXTER_DEMOS_CLOUD_VIEWER_THREAD_CPP_
+#define BAXTER_DEMOS_CLOUD_VIEWER_THREAD_CPP_
+
+#include "CloudViewerThread.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <pcl/visualization/cloud_viewer.h>
+
+namespace baxter_demos{
+
+CloudViewerThread::CloudViewerThread(const std::string& title) : title(title),
+        max_rate(30), max_points(0), running(false), stopped(false) {}
+
+CloudViewerThread::~CloudViewerThread(){
+    stop();
+}
+
+void CloudViewerThread::addSource(const Snapshot<Cloud>& source){
+    sources.push_back(&source);
+}
+
+void CloudViewerThread::start(){
+    stop();
+    stopped = false;
+    running = true;
+    thread = boost::thread(&CloudViewerThread::loop, this);
+}
+
+void CloudViewerThread::stop(){
+    running = false;
+    if(thread.joinable()){
+        thread.join();
+    }
+}
+
+void CloudViewerThread::decimate(const Cloud& in, size_t max_points, Cloud& out){
+    out.header = in.header;
+    out.sensor_origin_ = in.sensor_origin_;
+    out.sensor_orientation_ = in.sensor_orientation_;
+    out.is_dense = in.is_dense;
+    if(in.isOrganized()){
+        //Every step-th pixel of every step-th row
+        size_t step = (size_t) std::ceil(std::sqrt((double) in.size()/max_points));
+        step = std::max(step, (size_t) 1);
+        out.width = (in.width + step - 1)/step;
+        out.height = (in.height + step - 1)/step;
+        out.points.resize(out.width*out.height);
+        size_t k = 0;
+        for(size_t v = 0; v < in.height; v += step){
+            for(size_t u = 0; u < in.width; u += step){
+                out.points[k++] = in.points[v*in.width + u];
+            }
+        }
+    } else {
+        const size_t step = std::max((in.size() + max_points - 1)/max_points, (size_t) 1);
+        out.points.resize((in.size() + step - 1)/step);
+        for(size_t i = 0, k = 0; i < in.size(); i += step, k++){
+            out.points[k] = in.points[i];
+        }
+        out.width = out.points.size();
+        out.height = 1;
+    }
+}
+
+void CloudViewerThread::loop(){
+    //The viewer renders on a thread of its own; showCloud only hands it a
+    //pointer, but every cloud it's handed is uploaded again
+    pcl::visualization::CloudViewer viewer(title);
+    const boost::posix_time::time_duration period =
+            boost::posix_time::microseconds((long) (1e6/std::max(max_rate, 0.1)));
+
+    //What is on screen
+    int shown_source = -1;
+    unsigned int shown_version = 0;
+    while(running && !viewer.wasStopped()){
+        const boost::system_time next = boost::get_system_time() + period;
+
+        for(size_t i = 0; i < sources.size(); i++){
+            const unsigned int version = sources[i]->version();
+            if(version == 0){
+                continue;
+            }
+            if((int) i != shown_source || version != shown_version){
+                //The version may be newer than the cloud, never older
+                Cloud::ConstPtr cloud = sources[i]->get();
+                if(max_points > 0 && cloud->size() > max_points){
+                    Cloud::Ptr small = decimated.acquire();
+                    decimate(*cloud, max_points, *small);
+                    decimated.publish(small);
+                    cloud = small;
+                }
+                viewer.showCloud(cloud);
+                shown_source = i;
+                shown_version = version;
+            }
+            break;
+        }
+
+        boost::this_thread::sleep(next);
+    }
+    stopped = true;
+}
+
+}
+#endif
@@ -0,0 +1,200 @@
+#ifndef BAXTER_DEMOS_CLUSTER_CACHE_CPP_
+#define BAXTER_DEMOS_CLUSTER_CACHE_CPP_
+
+#include "ClusterCache.h"
+
+namespace baxter_demos{
+
+const int ClusterCache::unsegmented;
+const int ClusterCache::background;
+
+void ClusterCache::clear(){
+    voxels.clear();
+    next_voxels.clear();
+    cached.clear();
+    free_ids.clear();
+}
+
+int ClusterCache::allocateRegion(bool is_cluster){
+    int id;
+    if(free_ids.empty()){
+        id = cached.size();
+        cached.push_back(CachedRegion());
+    } else {
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    cached[id].alive = true;
+    cached[id].is_cluster = is_cluster;
+    cached[id].voxels = 0;
+    cached[id].summary = ClusterSummary(id);
+    return id;
+}
+
+void ClusterCache::diff(const PointCloud::ConstPtr& cloud,
+                        const std::vector<boost::uint64_t>& voxel_keys,
+                        const pcl::IndicesPtr& indices, VoxelSearch& search, int neighbours,
+                        int change_threshold, std::vector<pcl::PointIndices>& carried,
+                        std::vector<ClusterSummary>& carried_summaries,
+                        std::vector<int>& resegment){
+    const PointCloud& points = *cloud;
+    const int sqr_threshold = change_threshold*change_threshold;
+    carried_summaries.clear();
+    resegment.clear();
+    changed.clear();
+
+    //Match every point to the voxel it was in last time
+    const bool had_voxels = !voxels.empty();
+    point_region.assign(points.size(), unsegmented);
+    marked.assign(points.size(), 0);
+    dirty.assign(cached.size(), 0);
+    seen.assign(cached.size(), 0);
+    next_voxels.clear();
+    next_voxels.reserve(indices->size());
+    for(size_t i = 0; i < indices->size(); i++){
+        const int p = (*indices)[i];
+        const pcl::PointXYZRGB& pt = points[p];
+        const VoxelState* last = voxels.find(voxel_keys[p]);
+        if(!last){
+            VoxelState state = {pt.r, pt.g, pt.b, unsegmented};
+            next_voxels.insert(voxel_keys[p], state);
+            changed.push_back(p);
+            marked[p] = 1;
+            continue;
+        }
+        VoxelState state = *last;
+        //A region dropped since the voxel was labelled is no region
+        if(state.region >= 0 && !cached[state.region].alive){
+            state.region = unsegmented;
+        }
+        point_region[p] = state.region;
+        if(state.region >= 0){
+            seen[state.region]++;
+        }
+        const int dr = (int) pt.r - (int) state.r;
+        const int dg = (int) pt.g - (int) state.g;
+        const int db = (int) pt.b - (int) state.b;
+        if(dr*dr + dg*dg + db*db > sqr_threshold){
+            state.r = pt.r;
+            state.g = pt.g;
+            state.b = pt.b;
+            changed.push_back(p);
+            marked[p] = 1;
+            if(state.region >= 0){
+                dirty[state.region] = 1;
+            }
+        }
+        next_voxels.insert(voxel_keys[p], state);
+    }
+
+    //Voxels that are gone weren't carried over, and take their regions
+    //with them
+    for(size_t c = 0; c < cached.size(); c++){
+        if(cached[c].alive && seen[c] < cached[c].voxels){
+            dirty[c] = 1;
+        }
+    }
+    voxels.swap(next_voxels);
+
+    search.setInputCloud(cloud, indices);
+    const bool incremental = had_voxels && changed.size()*2 <= indices->size();
+    if(incremental){
+        //Whatever a changed voxel could grow into is segmented again
+        for(size_t i = 0; i < changed.size(); i++){
+            search.nearestKSearch(points[changed[i]], neighbours, nn, nn_distances);
+            for(size_t k = 0; k < nn.size(); k++){
+                const int c = point_region[nn[k]];
+                if(c >= 0){
+                    dirty[c] = 1;
+                } else {
+                    marked[nn[k]] = 1;
+                }
+            }
+        }
+    } else {
+        //Start over from nothing, background included
+        dirty.assign(cached.size(), 1);
+        point_region.assign(points.size(), unsegmented);
+    }
+
+    //Clean clusters come out in ID order, everything else goes back in.
+    //carried keeps the storage of the clusters it held last frame.
+    carried_slot.assign(cached.size(), -1);
+    size_t slots = 0;
+    for(size_t c = 0; c < cached.size(); c++){
+        if(!cached[c].alive){
+            continue;
+        }
+        if(dirty[c]){
+            cached[c].alive = false;
+            free_ids.push_back(c);
+        } else if(cached[c].is_cluster){
+            carried_slot[c] = slots++;
+            carried_summaries.push_back(cached[c].summary);
+        }
+    }
+    resetClusters(carried, slots);
+    for(size_t i = 0; i < indices->size(); i++){
+        const int p = (*indices)[i];
+        const int c = point_region[p];
+        if(c >= 0 && !dirty[c]){
+            if(carried_slot[c] >= 0){
+                carried[carried_slot[c]].indices.push_back(p);
+            }
+        } else if(!incremental || c >= 0 || marked[p]){
+            resegment.push_back(p);
+            //Labelled again by update(), if the grower keeps it
+            voxels.find(voxel_keys[p])->region = unsegmented;
+        }
+    }
+}
+
+void ClusterCache::update(const std::vector<boost::uint64_t>& voxel_keys,
+                          const std::vector<pcl::PointIndices>& regions,
+                          int min_size, int max_size,
+                          std::vector<pcl::PointIndices>& found,
+                          std::vector<ClusterSummary>& found_summaries){
+    found.clear();
+    found_summaries.clear();
+    for(size_t r = 0; r < regions.size(); r++){
+        const std::vector<int>& members = regions[r].indices;
+        const int size = members.size();
+        bool is_background = size > max_size;
+        for(size_t i = 0; i < members.size() && !is_background; i++){
+            is_background = point_region[members[i]] == background;
+        }
+
+        //Regions too small to be clusters are cached too, so that one is
+        //always segmented again as a whole
+        int label = background;
+        if(!is_background){
+            const bool is_cluster = size >= min_size;
+            label = allocateRegion(is_cluster);
+            if(is_cluster){
+                found.push_back(regions[r]);
+                found_summaries.push_back(ClusterSummary(label));
+            }
+        }
+        for(size_t i = 0; i < members.size(); i++){
+            VoxelState* state = voxels.find(voxel_keys[members[i]]);
+            if(state){
+                state->region = label;
+                if(label >= 0){
+                    cached[label].voxels++;
+                }
+            }
+        }
+    }
+}
+
+void ClusterCache::storeSummaries(const std::vector<ClusterSummary>& summaries){
+    for(size_t i = 0; i < summaries.size(); i++){
+        const int id = summaries[i].id;
+        if(id >= 0 && id < (int) cached.size() && cached[id].alive){
+            cached[id].summary = summaries[i];
+        }
+    }
+}
+
+}
+#endif
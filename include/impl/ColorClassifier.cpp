@@ -0,0 +1,142 @@
+#ifndef BAXTER_DEMOS_COLOR_CLASSIFIER_CPP_
+#define BAXTER_DEMOS_COLOR_CLASSIFIER_CPP_
+
+#include "ColorClassifier.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+#include <boost/thread/once.hpp>
+
+#include <pcl/point_types_conversion.h>
+
+namespace baxter_demos{
+
+const int ColorClassifier::max_targets;
+
+static ColorClassifier::HSVTable* hsv_table = NULL;
+static boost::once_flag hsv_table_flag = BOOST_ONCE_INIT;
+
+ColorClassifier::HSV ColorClassifier::toHSV(boost::uint8_t r, boost::uint8_t g,
+                                            boost::uint8_t b){
+    pcl::PointXYZRGB rgb(r, g, b);
+    pcl::PointXYZHSV hsv;
+    pcl::PointXYZRGBtoXYZHSV(rgb, hsv);
+    HSV out;
+    out.h = (boost::int16_t) hsv.h;
+    out.s = (boost::int16_t) hsv.s;
+    out.v = (boost::int16_t) hsv.v;
+    return out;
+}
+
+void ColorClassifier::buildHSVTable(){
+    hsv_table = new HSVTable;
+    hsv_table->h.resize(table_size);
+    hsv_table->s.resize(table_size);
+    hsv_table->v.resize(table_size);
+    //Each bin is represented by its center color
+    const int half_bin = 1 << (8 - bits - 1);
+    for(int i = 0; i < table_size; i++){
+        const boost::uint8_t r = ((i >> (2*bits)) << (8 - bits)) + half_bin;
+        const boost::uint8_t g = (((i >> bits) & ((1 << bits) - 1)) << (8 - bits)) + half_bin;
+        const boost::uint8_t b = ((i & ((1 << bits) - 1)) << (8 - bits)) + half_bin;
+        HSV hsv = toHSV(r, g, b);
+        hsv_table->h[i] = hsv.h;
+        hsv_table->s[i] = hsv.s;
+        hsv_table->v[i] = hsv.v;
+    }
+}
+
+const ColorClassifier::HSVTable& ColorClassifier::hsvTable(){
+    boost::call_once(&ColorClassifier::buildHSVTable, hsv_table_flag);
+    return *hsv_table;
+}
+
+ColorClassifier::HSV ColorClassifier::lookupHSV(boost::uint8_t r, boost::uint8_t g,
+                                                boost::uint8_t b){
+    const HSVTable& table = hsvTable();
+    const int i = tableIndex(r, g, b);
+    HSV out;
+    out.h = table.h[i];
+    out.s = table.s[i];
+    out.v = table.v[i];
+    return out;
+}
+
+ColorClassifier::ColorClassifier() : radius(0), configured(false),
+                                     accept(table_size, 0) {
+}
+
+bool ColorClassifier::sameColors(const std::vector<pcl::PointRGB>& a,
+                                 const std::vector<pcl::PointRGB>& b){
+    if(a.size() != b.size()){
+        return false;
+    }
+    for(size_t i = 0; i < a.size(); i++){
+        if(a[i].r != b[i].r || a[i].g != b[i].g || a[i].b != b[i].b){
+            return false;
+        }
+    }
+    return true;
+}
+
+void ColorClassifier::setTargets(const std::vector<pcl::PointRGB>& colors, int color_radius){
+    if(configured && color_radius == radius && sameColors(colors, targets)){
+        return;
+    }
+    targets = colors;
+    radius = color_radius;
+    configured = true;
+
+    std::fill(accept.begin(), accept.end(), 0);
+    const HSVTable& table = hsvTable();
+    const boost::int16_t* h = &table.h[0];
+    const boost::int16_t* s = &table.s[0];
+    const boost::int16_t* v = &table.v[0];
+    const int n = std::min((int) targets.size(), max_targets);
+    for(int t = 0; t < n; t++){
+        //The target color itself is converted exactly, not through the table
+        const HSV d = toHSV(targets[t].r, targets[t].g, targets[t].b);
+        for(int i = 0; i < table_size; i++){
+            const TargetMask in_range = (std::abs(h[i] - d.h) < radius) &
+                                        (std::abs(s[i] - d.s) < radius) &
+                                        (std::abs(v[i] - d.v) < radius);
+            accept[i] |= in_range << t;
+        }
+    }
+}
+
+ColorClassifier::TargetMask ColorClassifier::matchExact(
+        const std::vector<pcl::PointRGB>& targets, int radius,
+        boost::uint8_t r, boost::uint8_t g, boost::uint8_t b){
+    const HSV c = toHSV(r, g, b);
+    TargetMask mask = 0;
+    const int n = std::min((int) targets.size(), max_targets);
+    for(int t = 0; t < n; t++){
+        const HSV d = toHSV(targets[t].r, targets[t].g, targets[t].b);
+        if(std::abs(c.h - d.h) < radius && std::abs(c.s - d.s) < radius &&
+           std::abs(c.v - d.v) < radius){
+            mask |= (TargetMask) 1 << t;
+        }
+    }
+    return mask;
+}
+
+void ColorClassifier::classify(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                               const std::vector<int>& indices,
+                               std::vector<int>& accepted) const {
+    //Write every candidate and only advance past the accepted ones, which
+    //keeps the loop free of branches
+    size_t out = accepted.size();
+    accepted.resize(out + indices.size());
+    const TargetMask* table = &accept[0];
+    for(size_t i = 0; i < indices.size(); i++){
+        const pcl::PointXYZRGB& pt = cloud.points[indices[i]];
+        accepted[out] = indices[i];
+        out += table[tableIndex(pt.r, pt.g, pt.b)] != 0;
+    }
+    accepted.resize(out);
+}
+
+}
+#endif
@@ -0,0 +1,109 @@
+#ifndef BAXTER_DEMOS_IMAGE_ROI_CPP_
+#define BAXTER_DEMOS_IMAGE_ROI_CPP_
+
+#include "ImageROI.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace baxter_demos{
+
+//Closer than this to the image plane, a cube projects to most of the image
+static const float min_depth = 0.05f;
+
+CameraIntrinsics CameraIntrinsics::scaled(unsigned int w, unsigned int h) const {
+    CameraIntrinsics out = *this;
+    if(valid()){
+        const float su = (float) w/width;
+        const float sv = (float) h/height;
+        out.fx *= su; out.cx *= su;
+        out.fy *= sv; out.cy *= sv;
+    }
+    out.width = w;
+    out.height = h;
+    return out;
+}
+
+void ImageROI::reset(unsigned int w, unsigned int h){
+    width = w;
+    height = h;
+    rows.clear();
+    merged = true;
+}
+
+void ImageROI::addRect(int u_min, int v_min, int u_max, int v_max){
+    u_min = std::max(u_min, 0);
+    v_min = std::max(v_min, 0);
+    u_max = std::min(u_max, (int) width);
+    v_max = std::min(v_max, (int) height);
+    if(u_min >= u_max || v_min >= v_max){
+        return;
+    }
+    for(int v = v_min; v < v_max; v++){
+        Span span = {v, u_min, u_max};
+        rows.push_back(span);
+    }
+    merged = false;
+}
+
+// The projection of a box is inside the projection of its corners, so the
+// bounds of the eight projected corners are enough.
+bool ImageROI::addCube(const CameraIntrinsics& camera, const Eigen::Vector3f& center,
+                       float half_side){
+    if(!camera.valid() || center[2] - half_side < min_depth){
+        return false;
+    }
+    //Intrinsics for this cloud's resolution
+    const CameraIntrinsics image = camera.scaled(width, height);
+
+    float u_min = width, u_max = 0, v_min = height, v_max = 0;
+    for(int corner = 0; corner < 8; corner++){
+        const Eigen::Vector3f p(center[0] + (corner & 1 ? half_side : -half_side),
+                                center[1] + (corner & 2 ? half_side : -half_side),
+                                center[2] + (corner & 4 ? half_side : -half_side));
+        float u, v;
+        if(!image.project(p, u, v)){
+            return false;
+        }
+        u_min = std::min(u_min, u);
+        u_max = std::max(u_max, u);
+        v_min = std::min(v_min, v);
+        v_max = std::max(v_max, v);
+    }
+    addRect((int) std::floor(u_min), (int) std::floor(v_min),
+            (int) std::ceil(u_max) + 1, (int) std::ceil(v_max) + 1);
+    return true;
+}
+
+void ImageROI::merge(){
+    std::sort(rows.begin(), rows.end());
+    size_t out = 0;
+    for(size_t i = 0; i < rows.size(); i++){
+        if(out > 0 && rows[out - 1].row == rows[i].row && rows[i].begin <= rows[out - 1].end){
+            rows[out - 1].end = std::max(rows[out - 1].end, rows[i].end);
+        } else {
+            rows[out++] = rows[i];
+        }
+    }
+    rows.resize(out);
+    merged = true;
+}
+
+const std::vector<ImageROI::Span>& ImageROI::spans(){
+    if(!merged){
+        merge();
+    }
+    return rows;
+}
+
+size_t ImageROI::area(){
+    const std::vector<Span>& s = spans();
+    size_t total = 0;
+    for(size_t i = 0; i < s.size(); i++){
+        total += s[i].end - s[i].begin;
+    }
+    return total;
+}
+
+}
+#endif
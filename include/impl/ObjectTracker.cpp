@@ -0,0 +1,272 @@
+#ifndef BAXTER_DEMOS_OBJECT_TRACKER_CPP_
+#define BAXTER_DEMOS_OBJECT_TRACKER_CPP_
+
+#include "ObjectTracker.h"
+#include "CloudPreprocessor.h"
+
+#include <cmath>
+#include <limits>
+
+namespace baxter_demos{
+
+ObjectTracker::ObjectTracker() : gate(0.09), max_misses(5), min_hits(3),
+                                 alpha(0.5), beta(0.1), next_id(0),
+                                 last_stamp(0), has_stamp(false), num_clusters(0) {
+}
+
+void ObjectTracker::clear(){
+    tracks.clear();
+    has_stamp = false;
+}
+
+boost::uint64_t ObjectTracker::cellKey(const Eigen::Vector3f& p, int dx, int dy, int dz) const {
+    return CloudPreprocessor::voxelKey((int) std::floor(p[0]/gate) + dx,
+                                       (int) std::floor(p[1]/gate) + dy,
+                                       (int) std::floor(p[2]/gate) + dz);
+}
+
+// Minimum cost perfect matching on a dense n x n cost matrix (row major),
+// O(n^3) with row and column potentials. row_assignment[i] is the column
+// given to row i.
+void ObjectTracker::hungarian(const std::vector<double>& cost, int n,
+                              std::vector<int>& row_assignment, HungarianScratch& scratch){
+    const double inf = std::numeric_limits<double>::max();
+    //1-based, column 0 is a sentinel
+    std::vector<double>& u = scratch.u;
+    std::vector<double>& v = scratch.v;
+    std::vector<double>& minv = scratch.minv;
+    std::vector<int>& p = scratch.p;
+    std::vector<int>& way = scratch.way;
+    std::vector<char>& used = scratch.used;
+    u.assign(n + 1, 0);
+    v.assign(n + 1, 0);
+    minv.resize(n + 1);
+    p.assign(n + 1, 0);
+    way.assign(n + 1, 0);
+    used.resize(n + 1);
+    for(int i = 1; i <= n; i++){
+        p[0] = i;
+        int j0 = 0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do {
+            used[j0] = 1;
+            const int i0 = p[j0];
+            double delta = inf;
+            int j1 = 0;
+            for(int j = 1; j <= n; j++){
+                if(used[j]){
+                    continue;
+                }
+                const double cur = cost[(i0 - 1)*n + (j - 1)] - u[i0] - v[j];
+                if(cur < minv[j]){
+                    minv[j] = cur;
+                    way[j] = j0;
+                }
+                if(minv[j] < delta){
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+            for(int j = 0; j <= n; j++){
+                if(used[j]){
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while(p[j0] != 0);
+        do {
+            const int j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while(j0 != 0);
+    }
+    row_assignment.assign(n, -1);
+    for(int j = 1; j <= n; j++){
+        row_assignment[p[j] - 1] = j - 1;
+    }
+}
+
+// Tracks are rows, detections are columns. Padding with dummy rows and
+// columns lets anything stay unmatched for half a gate squared, so a pair is
+// only worth matching if it is closer than the gate.
+void ObjectTracker::assignCluster(const std::vector<int>& cluster_tracks,
+                                  const std::vector<int>& cluster_detections,
+                                  const std::vector<Eigen::Vector3f>& positions,
+                                  const std::vector<int>& labels){
+    const int t = cluster_tracks.size();
+    const int d = cluster_detections.size();
+    const int n = t + d;
+    const double sqr_gate = gate*gate;
+    const double forbidden = 1e6*(sqr_gate + 1);
+
+    cost.assign(n*n, 0);
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            double c;
+            if(i < t && j < d){
+                c = (predicted[cluster_tracks[i]] - positions[cluster_detections[j]]).squaredNorm();
+                if(c >= sqr_gate ||
+                   tracks[cluster_tracks[i]].label != labels[cluster_detections[j]]){
+                    c = forbidden;
+                }
+            } else if(i < t || j < d){
+                c = sqr_gate/2;
+            } else {
+                c = 0;
+            }
+            cost[i*n + j] = c;
+        }
+    }
+
+    hungarian(cost, n, assignment, hungarian_scratch);
+    for(int i = 0; i < t; i++){
+        const int j = assignment[i];
+        if(j < d && cost[i*n + j] < sqr_gate){
+            track_match[cluster_tracks[i]] = cluster_detections[j];
+            detection_match[cluster_detections[j]] = cluster_tracks[i];
+        }
+    }
+}
+
+void ObjectTracker::update(const std::vector<Eigen::Vector3f>& positions,
+                           const QuaternionList& orientations,
+                           const std::vector<int>& labels,
+                           double stamp, TrackerUpdate& result){
+    result.clear();
+    double dt = has_stamp ? stamp - last_stamp : 0;
+    if(dt < 0){
+        dt = 0;
+    }
+    last_stamp = stamp;
+    has_stamp = true;
+
+    const int num_tracks = tracks.size();
+    const int num_detections = positions.size();
+
+    //Predict and index the tracks
+    predicted.resize(num_tracks);
+    grid.clear();
+    grid_next.resize(num_tracks);
+    for(int i = 0; i < num_tracks; i++){
+        predicted[i] = tracks[i].position + tracks[i].velocity*dt;
+        //Push i in front of the cell's list
+        std::pair<int*, bool> head = grid.insert(cellKey(predicted[i], 0, 0, 0), i);
+        grid_next[i] = head.second ? -1 : *head.first;
+        *head.first = i;
+    }
+
+    //Gather the pairs within the gate; detections are numbered after tracks
+    const float sqr_gate = gate*gate;
+    clusters.reset(num_tracks + num_detections);
+    for(int j = 0; j < num_detections; j++){
+        for(int dx = -1; dx <= 1; dx++){
+            for(int dy = -1; dy <= 1; dy++){
+                for(int dz = -1; dz <= 1; dz++){
+                    const int* head = grid.find(cellKey(positions[j], dx, dy, dz));
+                    if(!head){
+                        continue;
+                    }
+                    for(int i = *head; i >= 0; i = grid_next[i]){
+                        if(tracks[i].label == labels[j] &&
+                           (predicted[i] - positions[j]).squaredNorm() < sqr_gate){
+                            clusters.unite(i, num_tracks + j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    //Assign each cluster of competing tracks and detections on its own
+    track_match.assign(num_tracks, -1);
+    detection_match.assign(num_detections, -1);
+    cluster_slot.assign(num_tracks + num_detections, -1);
+    num_clusters = 0;
+    for(int node = 0; node < num_tracks + num_detections; node++){
+        const int root = clusters.find(node);
+        if(cluster_slot[root] < 0){
+            cluster_slot[root] = num_clusters++;
+            if(num_clusters > cluster_tracks.size()){
+                cluster_tracks.push_back(std::vector<int>());
+                cluster_detections.push_back(std::vector<int>());
+            }
+            cluster_tracks[num_clusters - 1].clear();
+            cluster_detections[num_clusters - 1].clear();
+        }
+        if(node < num_tracks){
+            cluster_tracks[cluster_slot[root]].push_back(node);
+        } else {
+            cluster_detections[cluster_slot[root]].push_back(node - num_tracks);
+        }
+    }
+    for(size_t c = 0; c < num_clusters; c++){
+        if(cluster_tracks[c].empty() || cluster_detections[c].empty()){
+            continue;
+        }
+        assignCluster(cluster_tracks[c], cluster_detections[c], positions, labels);
+    }
+
+    //Correct, coast or drop the existing tracks, keeping them in ID order
+    size_t kept = 0;
+    for(int i = 0; i < num_tracks; i++){
+        Track& track = tracks[i];
+        const int j = track_match[i];
+        if(j >= 0){
+            const Eigen::Vector3f residual = positions[j] - predicted[i];
+            track.position = predicted[i] + alpha*residual;
+            if(dt > 0){
+                track.velocity += (beta/dt)*residual;
+            }
+            track.orientation = orientations[j];
+            track.hits++;
+            track.misses = 0;
+            if(!track.confirmed && track.hits >= min_hits){
+                track.confirmed = true;
+                result.added.push_back(track);
+            } else if(track.confirmed){
+                result.moved.push_back(track);
+            }
+        } else {
+            track.position = predicted[i];
+            track.misses++;
+            if(!track.confirmed || track.misses > max_misses){
+                if(track.confirmed){
+                    result.removed.push_back(track);
+                }
+                continue;
+            }
+        }
+        if(kept != (size_t) i){
+            tracks[kept] = track;
+        }
+        kept++;
+    }
+    tracks.resize(kept);
+
+    //Whatever is left over is a new object
+    for(int j = 0; j < num_detections; j++){
+        if(detection_match[j] >= 0){
+            continue;
+        }
+        Track track;
+        track.id = next_id++;
+        track.label = labels[j];
+        track.position = positions[j];
+        track.velocity.setZero();
+        track.orientation = orientations[j];
+        track.hits = 1;
+        track.misses = 0;
+        track.confirmed = min_hits <= 1;
+        if(track.confirmed){
+            result.added.push_back(track);
+        }
+        tracks.push_back(track);
+    }
+}
+
+}
+#endif
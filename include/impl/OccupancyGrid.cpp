@@ -0,0 +1,85 @@
+#ifndef BAXTER_DEMOS_OCCUPANCY_GRID_CPP_
+#define BAXTER_DEMOS_OCCUPANCY_GRID_CPP_
+
+#include "OccupancyGrid.h"
+#include "CloudPreprocessor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include <pcl/pcl_macros.h>
+
+namespace baxter_demos{
+
+OccupancyGrid::OccupancyGrid() : voxel_size(0.02), min_points(1), resync_period(5.0),
+                                 has_frame(false), last_resync(0) {}
+
+void OccupancyGrid::setVoxelSize(float size){
+    if(size != voxel_size){
+        voxel_size = size;
+        //The old keys mean other voxels now
+        clear();
+    }
+}
+
+void OccupancyGrid::clear(){
+    occupied.clear();
+    has_frame = false;
+}
+
+bool OccupancyGrid::update(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                           const std::vector<int>& indices,
+                           const Eigen::Matrix3f& rotation, const Eigen::Vector3f& translation,
+                           double stamp, std::vector<boost::uint64_t>& added,
+                           std::vector<boost::uint64_t>& removed){
+    const float inverse_size = 1.0f/voxel_size;
+    keys.clear();
+    for(size_t i = 0; i < indices.size(); i++){
+        const pcl::PointXYZRGB& pt = cloud.points[indices[i]];
+        if(!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z)){
+            continue;
+        }
+        const Eigen::Vector3f p = rotation*Eigen::Vector3f(pt.x, pt.y, pt.z) + translation;
+        keys.push_back(CloudPreprocessor::voxelKey((int) std::floor(p[0]*inverse_size),
+                                                   (int) std::floor(p[1]*inverse_size),
+                                                   (int) std::floor(p[2]*inverse_size)));
+    }
+
+    //Equal keys end up next to each other; each run is one voxel
+    std::sort(keys.begin(), keys.end());
+    next.clear();
+    for(size_t i = 0; i < keys.size(); ){
+        size_t j = i + 1;
+        while(j < keys.size() && keys[j] == keys[i]){
+            j++;
+        }
+        if((int) (j - i) >= min_points){
+            next.push_back(keys[i]);
+        }
+        i = j;
+    }
+
+    added.clear();
+    removed.clear();
+    //A stamp from the past means a restart, start over
+    const bool resync = !has_frame || stamp < last_resync ||
+                        (resync_period > 0 && stamp - last_resync >= resync_period);
+    if(resync){
+        added = next;
+    } else {
+        std::set_difference(next.begin(), next.end(), occupied.begin(), occupied.end(),
+                            std::back_inserter(added));
+        std::set_difference(occupied.begin(), occupied.end(), next.begin(), next.end(),
+                            std::back_inserter(removed));
+    }
+    occupied.swap(next);
+    if(resync){
+        last_resync = stamp;
+        has_frame = true;
+    }
+    return resync;
+}
+
+}
+#endif
@@ -0,0 +1,101 @@
+#ifndef BAXTER_DEMOS_PIPELINE_STATS_CPP_
+#define BAXTER_DEMOS_PIPELINE_STATS_CPP_
+
+#include "PipelineStats.h"
+
+#include <algorithm>
+
+namespace baxter_demos{
+
+static const char* stage_names[PipelineStats::NUM_STAGES] = {
+    "conversion", "filter", "index", "outliers", "color gate", "changes",
+    "region growing", "color filter", "obb", "merge", "tf", "tracking", "publish"
+};
+
+const char* PipelineStats::stageName(Stage stage){
+    return stage_names[stage];
+}
+
+PipelineStats::PipelineStats(size_t window) : window_size(std::max((size_t) 1, window)) {
+    for(int i = 0; i < NUM_STAGES; i++){
+        stages[i].samples.reserve(window_size);
+        stages[i].next = 0;
+    }
+    replaced_buffers.samples.reserve(window_size);
+    replaced_buffers.next = 0;
+    scratch.reserve(window_size);
+}
+
+void PipelineStats::record(Stage stage, double milliseconds, size_t items_in,
+                           size_t items_out){
+    Sample sample;
+    sample.milliseconds = milliseconds;
+    sample.items_in = items_in;
+    sample.items_out = items_out;
+
+    boost::mutex::scoped_lock lock(mutex);
+    store(stages[stage], sample);
+}
+
+void PipelineStats::recordReplacedBuffers(size_t count){
+    Sample sample;
+    sample.milliseconds = count;
+    sample.items_in = sample.items_out = 0;
+
+    boost::mutex::scoped_lock lock(mutex);
+    store(replaced_buffers, sample);
+}
+
+void PipelineStats::store(StageWindow& w, const Sample& sample){
+    if(w.samples.size() < window_size){
+        w.samples.push_back(sample);
+    } else {
+        w.samples[w.next] = sample;
+    }
+    w.next = (w.next + 1) % window_size;
+}
+
+static double percentile(const std::vector<double>& sorted, double q){
+    return sorted[(size_t) (q*(sorted.size() - 1) + 0.5)];
+}
+
+void PipelineStats::summarize(Stage stage, Summary& summary){
+    boost::mutex::scoped_lock lock(mutex);
+    summarize(stages[stage], summary);
+}
+
+void PipelineStats::summarizeReplacedBuffers(Summary& summary){
+    boost::mutex::scoped_lock lock(mutex);
+    summarize(replaced_buffers, summary);
+}
+
+//Called with the mutex held
+void PipelineStats::summarize(const StageWindow& w, Summary& summary){
+    summary.samples = w.samples.size();
+    summary.p50 = summary.p90 = summary.p99 = summary.max = summary.mean = 0;
+    summary.items_in = summary.items_out = 0;
+    if(w.samples.empty()){
+        return;
+    }
+
+    scratch.clear();
+    for(size_t i = 0; i < w.samples.size(); i++){
+        scratch.push_back(w.samples[i].milliseconds);
+        summary.mean += w.samples[i].milliseconds;
+        summary.items_in += w.samples[i].items_in;
+        summary.items_out += w.samples[i].items_out;
+    }
+    const double n = w.samples.size();
+    summary.mean /= n;
+    summary.items_in /= n;
+    summary.items_out /= n;
+
+    std::sort(scratch.begin(), scratch.end());
+    summary.p50 = percentile(scratch, 0.5);
+    summary.p90 = percentile(scratch, 0.9);
+    summary.p99 = percentile(scratch, 0.99);
+    summary.max = scratch.back();
+}
+
+}
+#endif
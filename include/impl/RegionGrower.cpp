@@ -0,0 +1,368 @@
+#ifndef BAXTER_DEMOS_REGION_GROWER_CPP_
+#define BAXTER_DEMOS_REGION_GROWER_CPP_
+
+#include "RegionGrower.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <boost/bind.hpp>
+
+namespace baxter_demos{
+
+//Below this many points per thread, spawning threads costs more than it saves
+static const size_t min_points_per_thread = 2048;
+
+RegionGrower::RegionGrower() : distance_threshold(0.05), point_color_threshold(1225),
+                               region_color_threshold(10), min_cluster_size(1),
+                               max_cluster_size(std::numeric_limits<int>::max()),
+                               neighbours(default_neighbours), num_threads(0),
+                               generation(0), stopping(false), job_workers(0), pending(0),
+                               job_cloud(NULL), job_indices(NULL), job_search(NULL),
+                               job_chunk(0) {}
+
+RegionGrower::~RegionGrower(){
+    {
+        boost::mutex::scoped_lock lock(pool_mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    workers.join_all();
+}
+
+// Never shrinks; workers beyond the ones a job asks for sit it out
+void RegionGrower::startWorkers(int n){
+    while((int) workers.size() < n){
+        workers.create_thread(boost::bind(&RegionGrower::workerLoop, this,
+                                          (int) workers.size(), generation));
+    }
+}
+
+// Wait for a job, link the worker's chunk of it, repeat. started_at is the
+// job count when the worker was made, so a job handed out before the
+// thread got going isn't missed.
+void RegionGrower::workerLoop(int worker, unsigned int started_at){
+    unsigned int done = started_at;
+    boost::mutex::scoped_lock lock(pool_mutex);
+    while(true){
+        while(generation == done && !stopping){
+            work_ready.wait(lock);
+        }
+        if(stopping){
+            return;
+        }
+        done = generation;
+        if(worker >= job_workers){
+            continue;
+        }
+        lock.unlock();
+        linkPoints(*job_cloud, *job_indices, *job_search, worker*job_chunk,
+                   (worker + 1)*job_chunk, worker);
+        lock.lock();
+        if(--pending == 0){
+            work_done.notify_one();
+        }
+    }
+}
+
+float RegionGrower::colorDistance(const Region& a, const Region& b){
+    const double dr = a.r/a.count - b.r/b.count;
+    const double dg = a.g/a.count - b.g/b.count;
+    const double db = a.b/a.count - b.b/b.count;
+    return std::sqrt(dr*dr + dg*dg + db*db);
+}
+
+// Unite each point in indices[begin, end) with its neighbours of similar
+// color. Runs on several threads at once; apart from the union-find, each
+// thread only touches its own buffers.
+void RegionGrower::linkPoints(const PointCloud& cloud, const std::vector<int>& indices,
+                              const VoxelSearch& search, size_t begin, size_t end,
+                              int thread){
+    const float sqr_distance = distance_threshold*distance_threshold;
+    const float sqr_color = point_color_threshold*point_color_threshold;
+    std::vector<Edge>& edges = thread_edges[thread];
+    std::vector<int>& nn = thread_nn[thread];
+    std::vector<float>& nn_distances = thread_distances[thread];
+    for(size_t i = begin; i < end; i++){
+        const int p = indices[i];
+        const pcl::PointXYZRGB& pt = cloud[p];
+        search.nearestKSearch(pt, neighbours, nn, nn_distances);
+        for(size_t k = 0; k < nn.size(); k++){
+            const int q = nn[k];
+            if(q == p || nn_distances[k] > sqr_distance){
+                continue;
+            }
+            const pcl::PointXYZRGB& other = cloud[q];
+            const int dr = (int) pt.r - (int) other.r;
+            const int dg = (int) pt.g - (int) other.g;
+            const int db = (int) pt.b - (int) other.b;
+            if(dr*dr + dg*dg + db*db <= sqr_color){
+                points.unite(p, q);
+            } else if(p < q){
+                edges.push_back(Edge(p, q));
+            } else {
+                edges.push_back(Edge(q, p));
+            }
+        }
+    }
+}
+
+// Number the point components in order of their smallest point and sum up
+// their colors. The root of a component is its smallest point, so with
+// indices in ascending order a root is always seen before the rest of its
+// component.
+void RegionGrower::buildSegments(const std::vector<int>& indices){
+    regions.clear();
+    for(size_t i = 0; i < indices.size(); i++){
+        const int p = indices[i];
+        const int root = points.find(p);
+        if(segment_of[root] < 0){
+            segment_of[root] = regions.size();
+            Region region = {0, 0, 0, 0};
+            regions.push_back(region);
+        }
+        segment_of[p] = segment_of[root];
+    }
+}
+
+// Merge adjacent segments of similar mean color. Like RegionGrowingRGB,
+// this compares the segments' own colors, not those of the regions they
+// have been merged into so far.
+void RegionGrower::mergeRegions(){
+    adjacency.clear();
+    for(size_t t = 0; t < thread_edges.size(); t++){
+        const std::vector<Edge>& edges = thread_edges[t];
+        for(size_t i = 0; i < edges.size(); i++){
+            int a = segment_of[edges[i].first];
+            int b = segment_of[edges[i].second];
+            if(a == b){
+                continue;
+            }
+            if(a > b){
+                std::swap(a, b);
+            }
+            adjacency.push_back(Edge(a, b));
+        }
+    }
+    std::sort(adjacency.begin(), adjacency.end());
+    adjacency.erase(std::unique(adjacency.begin(), adjacency.end()), adjacency.end());
+
+    region_sets.reset(regions.size());
+    for(size_t i = 0; i < adjacency.size(); i++){
+        const Region& a = regions[adjacency[i].first];
+        const Region& b = regions[adjacency[i].second];
+        if(colorDistance(a, b) < region_color_threshold){
+            region_sets.unite(adjacency[i].first, adjacency[i].second);
+        }
+    }
+
+    //Totals move to the root of each region
+    for(size_t i = 0; i < regions.size(); i++){
+        const int root = region_sets.find(i);
+        if(root != (int) i){
+            regions[root].count += regions[i].count;
+            regions[root].r += regions[i].r;
+            regions[root].g += regions[i].g;
+            regions[root].b += regions[i].b;
+        }
+    }
+}
+
+// Fold every region that is too small to be a cluster into its neighbour
+// with the closest mean color, smallest region index first, until it is
+// big enough or has no neighbours left.
+void RegionGrower::absorbSmallRegions(){
+    const int n = regions.size();
+    neighbour_offsets.assign(n + 1, 0);
+    for(size_t i = 0; i < adjacency.size(); i++){
+        neighbour_offsets[adjacency[i].first + 1]++;
+        neighbour_offsets[adjacency[i].second + 1]++;
+    }
+    for(int i = 0; i < n; i++){
+        neighbour_offsets[i + 1] += neighbour_offsets[i];
+    }
+    neighbour_list.resize(neighbour_offsets[n]);
+    std::vector<int> fill(neighbour_offsets.begin(), neighbour_offsets.end() - 1);
+    for(size_t i = 0; i < adjacency.size(); i++){
+        neighbour_list[fill[adjacency[i].first]++] = adjacency[i].second;
+        neighbour_list[fill[adjacency[i].second]++] = adjacency[i].first;
+    }
+
+    //The segments of each region as a linked list, so that regions can be
+    //concatenated when they merge
+    member_next.assign(n, -1);
+    member_tail.resize(n);
+    for(int s = 0; s < n; s++){
+        member_tail[s] = s;
+        const int root = region_sets.find(s);
+        if(root != s){
+            member_next[member_tail[root]] = s;
+            member_tail[root] = s;
+        }
+    }
+
+    for(int i = 0; i < n; i++){
+        int root = i;
+        if(region_sets.find(root) != root){
+            continue;
+        }
+        while(regions[root].count < min_cluster_size){
+            int best = -1;
+            float best_distance = 0;
+            for(int s = root; s >= 0; s = member_next[s]){
+                for(int k = neighbour_offsets[s]; k < neighbour_offsets[s + 1]; k++){
+                    const int other = region_sets.find(neighbour_list[k]);
+                    if(other == root){
+                        continue;
+                    }
+                    const float d = colorDistance(regions[root], regions[other]);
+                    if(best < 0 || d < best_distance || (d == best_distance && other < best)){
+                        best = other;
+                        best_distance = d;
+                    }
+                }
+            }
+            if(best < 0){
+                break;
+            }
+            region_sets.unite(root, best);
+            const int merged = std::min(root, best);
+            const int absorbed = std::max(root, best);
+            regions[merged].count += regions[absorbed].count;
+            regions[merged].r += regions[absorbed].r;
+            regions[merged].g += regions[absorbed].g;
+            regions[merged].b += regions[absorbed].b;
+            member_next[member_tail[merged]] = absorbed;
+            member_tail[merged] = member_tail[absorbed];
+            root = merged;
+        }
+    }
+}
+
+void RegionGrower::extract(const PointCloud& cloud, const std::vector<int>& indices,
+                           const VoxelSearch& search, std::vector<pcl::PointIndices>& clusters){
+    grow(cloud, indices, search, clusters, true);
+}
+
+void RegionGrower::extractRegions(const PointCloud& cloud, const std::vector<int>& indices,
+                                  const VoxelSearch& search,
+                                  std::vector<pcl::PointIndices>& all_regions){
+    grow(cloud, indices, search, all_regions, false);
+}
+
+void RegionGrower::grow(const PointCloud& cloud, const std::vector<int>& indices,
+                        const VoxelSearch& search, std::vector<pcl::PointIndices>& clusters,
+                        bool size_filter){
+    if(indices.empty()){
+        resetClusters(clusters, 0);
+        return;
+    }
+
+    points.reset(cloud.size());
+    int threads = num_threads > 0 ? num_threads : boost::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, (int) (indices.size()/min_points_per_thread)));
+    //Never shrunk, so the buffers of every thread count seen so far stay
+    if((int) thread_edges.size() < threads){
+        thread_edges.resize(threads);
+        thread_nn.resize(threads);
+        thread_distances.resize(threads);
+    }
+    for(int t = 0; t < threads; t++){
+        thread_edges[t].clear();
+    }
+
+    //The last chunk runs here while the workers take the others
+    const size_t chunk = (indices.size() + threads - 1)/threads;
+    if(threads > 1){
+        startWorkers(threads - 1);
+        {
+            boost::mutex::scoped_lock lock(pool_mutex);
+            job_cloud = &cloud;
+            job_indices = &indices;
+            job_search = &search;
+            job_chunk = chunk;
+            job_workers = threads - 1;
+            pending = threads - 1;
+            generation++;
+        }
+        work_ready.notify_all();
+    }
+    linkPoints(cloud, indices, search, (threads - 1)*chunk, indices.size(), threads - 1);
+    if(threads > 1){
+        boost::mutex::scoped_lock lock(pool_mutex);
+        while(pending > 0){
+            work_done.wait(lock);
+        }
+    }
+
+    segment_of.assign(cloud.size(), -1);
+    buildSegments(indices);
+    for(size_t i = 0; i < indices.size(); i++){
+        const pcl::PointXYZRGB& pt = cloud[indices[i]];
+        Region& region = regions[segment_of[indices[i]]];
+        region.count++;
+        region.r += pt.r;
+        region.g += pt.g;
+        region.b += pt.b;
+    }
+
+    mergeRegions();
+    absorbSmallRegions();
+
+    //Regions of the right size become clusters, in order of their first
+    //point. Numbered first, so that clusters can be refilled in place.
+    cluster_of.assign(regions.size(), -1);
+    int found = 0;
+    for(size_t i = 0; i < indices.size(); i++){
+        const int root = region_sets.find(segment_of[indices[i]]);
+        const int count = regions[root].count;
+        if(size_filter && (count < min_cluster_size || count > max_cluster_size)){
+            continue;
+        }
+        if(cluster_of[root] < 0){
+            cluster_of[root] = found++;
+        }
+    }
+    resetClusters(clusters, found);
+    for(size_t i = 0; i < indices.size(); i++){
+        const int p = indices[i];
+        const int root = region_sets.find(segment_of[p]);
+        if(cluster_of[root] >= 0){
+            std::vector<int>& members = clusters[cluster_of[root]].indices;
+            if(members.empty()){
+                members.reserve(regions[root].count);
+            }
+            members.push_back(p);
+        }
+    }
+}
+
+void RegionGrower::colorClusters(const PointCloud& cloud,
+                                 const std::vector<pcl::PointIndices>& clusters,
+                                 PointCloud& colored){
+    colored.clear();
+    if(clusters.empty()){
+        return;
+    }
+    colored = cloud;
+    for(size_t i = 0; i < colored.size(); i++){
+        colored[i].r = 255;
+        colored[i].g = 0;
+        colored[i].b = 0;
+    }
+    for(size_t c = 0; c < clusters.size(); c++){
+        //Fixed colors, so the same clusters always look the same
+        const unsigned int hash = (c + 1)*2654435761u;
+        const boost::uint8_t r = hash >> 24, g = hash >> 16, b = hash >> 8;
+        const std::vector<int>& members = clusters[c].indices;
+        for(size_t i = 0; i < members.size(); i++){
+            colored[members[i]].r = r;
+            colored[members[i]].g = g;
+            colored[members[i]].b = b;
+        }
+    }
+}
+
+}
+#endif
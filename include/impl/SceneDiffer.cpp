@@ -0,0 +1,99 @@
+#ifndef BAXTER_DEMOS_SCENE_DIFFER_CPP_
+#define BAXTER_DEMOS_SCENE_DIFFER_CPP_
+
+#include "SceneDiffer.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace baxter_demos{
+
+SceneDiffer::SceneDiffer() : translation_threshold(0.01), rotation_threshold(0.1),
+                             min_interval(0.2), resync_period(5.0) {
+    clear();
+}
+
+void SceneDiffer::clear(){
+    sent.clear();
+    last_resync = 0;
+    has_resync = false;
+}
+
+void SceneDiffer::remember(const Track& track, double stamp, SentObject& object){
+    object.id = track.id;
+    object.label = track.label;
+    object.position = track.position;
+    object.orientation = track.orientation;
+    object.stamp = stamp;
+}
+
+//The object as a track, at the pose it was last sent with
+void SceneDiffer::forget(const SentObject& object, TrackList& removed){
+    removed.push_back(Track());
+    Track& track = removed.back();
+    track.id = object.id;
+    track.label = object.label;
+    track.position = object.position;
+    track.velocity.setZero();
+    track.orientation = object.orientation;
+    track.hits = track.misses = 0;
+    track.confirmed = true;
+}
+
+bool SceneDiffer::changed(const SentObject& object, const Track& track) const {
+    if((track.position - object.position).squaredNorm() >
+       translation_threshold*translation_threshold){
+        return true;
+    }
+    //q and -q are the same rotation
+    const float dot = std::min(1.0f, std::fabs(object.orientation.dot(track.orientation)));
+    return 2*std::acos(dot) > rotation_threshold;
+}
+
+bool SceneDiffer::update(const TrackList& tracks, double stamp, TrackerUpdate& result){
+    result.clear();
+    //A stamp from the past means a restart (or a replayed bag), start over
+    const bool resync = !has_resync || stamp < last_resync ||
+                        (resync_period > 0 && stamp - last_resync >= resync_period);
+
+    //Walk the sent objects and the tracks side by side, both in ID order
+    next.clear();
+    size_t s = 0;
+    for(size_t i = 0; i < tracks.size(); i++){
+        const Track& track = tracks[i];
+        if(!track.confirmed){
+            continue;
+        }
+        while(s < sent.size() && sent[s].id < track.id){
+            forget(sent[s++], result.removed);
+        }
+        next.push_back(SentObject());
+        SentObject& object = next.back();
+        if(s < sent.size() && sent[s].id == track.id){
+            object = sent[s++];
+            if(resync){
+                remember(track, stamp, object);
+                result.added.push_back(track);
+            } else if(stamp - object.stamp >= min_interval && changed(object, track)){
+                remember(track, stamp, object);
+                result.moved.push_back(track);
+            }
+        } else {
+            remember(track, stamp, object);
+            result.added.push_back(track);
+        }
+    }
+    for(; s < sent.size(); s++){
+        forget(sent[s], result.removed);
+    }
+    sent.swap(next);
+
+    if(resync){
+        last_resync = stamp;
+        has_resync = true;
+    }
+    return resync;
+}
+
+}
+#endif
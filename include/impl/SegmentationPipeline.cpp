@@ -0,0 +1,399 @@
+#ifndef BAXTER_DEMOS_SEGMENTATION_PIPELINE_CPP_
+#define BAXTER_DEMOS_SEGMENTATION_PIPELINE_CPP_
+
+#include "SegmentationPipeline.h"
+
+#include <algorithm>
+
+#include <pcl/common/centroid.h>
+
+namespace baxter_demos{
+
+// Hand out an index no other frame in flight is using. The pool holds one
+// reference, so use_count() == 1 means the index is free.
+VoxelSearch::Ptr SegmentationPipeline::acquireSearch(const SegmenterParams& params){
+    VoxelSearch::Ptr free_search;
+    for(size_t i = 0; i < search_pool.size(); i++){
+        if(search_pool[i].unique()){
+            free_search = search_pool[i];
+            break;
+        }
+    }
+    if(!free_search){
+        free_search = VoxelSearch::Ptr(new VoxelSearch(params.leaf_size,
+                                                       params.outlier_radius));
+        search_pool.push_back(free_search);
+    }
+    if(free_search->getLeafSize() != params.leaf_size ||
+       free_search->getMinCellSize() != (float) params.outlier_radius){
+        free_search->setResolution(params.leaf_size, params.outlier_radius);
+    }
+    return free_search;
+}
+
+void SegmentationPipeline::filter(const CloudView& view, PipelineFrame& frame){
+    frame.replaced_buffers += recycle(frame.cloud);
+    //An ROI only makes sense for the organized cloud it was made for
+    frame.cropped = !frame.roi.empty() && view.height > 1;
+    {
+        ScopedStageTimer timer(frame.stats, PipelineStats::FILTER,
+                               frame.cropped ? frame.roi.area() : view.size());
+        preprocessor.setLeafSize(frame.params.leaf_size);
+        preprocessor.setFilterLimits(frame.params.filter_min, frame.params.filter_max);
+        if(frame.cropped){
+            preprocessor.filter(view, frame.roi, *frame.cloud);
+        } else {
+            preprocessor.filter(view, *frame.cloud);
+        }
+        timer.setItemsOut(frame.cloud->size());
+    }
+
+    ScopedStageTimer timer(frame.stats, PipelineStats::INDEX, frame.cloud->size());
+    frame.search = acquireSearch(frame.params);
+    frame.search->update(frame.cloud, preprocessor.getVoxelKeys());
+    if(frame.params.incremental && !frame.cropped){
+        frame.voxel_keys = preprocessor.getVoxelKeys();
+    }
+    timer.setItemsOut(frame.search->getLastAdded() + frame.search->getLastRemoved());
+}
+
+// Same criterion as RadiusOutlierRemoval, but using the shared index and
+// stopping each search as soon as enough neighbours are found. The cloud is
+// left alone; the inliers become the indices handed to region growing.
+void SegmentationPipeline::removeOutliers(PipelineFrame& frame){
+    const PointColorCloud& points = *frame.cloud;
+    const int min_neighbors = frame.params.min_neighbors;
+    ScopedStageTimer timer(frame.stats, PipelineStats::OUTLIERS, points.size());
+    frame.replaced_buffers += recycle(frame.indices);
+    frame.indices->clear();
+    frame.indices->reserve(points.size());
+
+    for(size_t i = 0; i < points.size(); i++){
+        //the point itself is always found
+        int k = frame.search->radiusSearch(points[i], frame.params.outlier_radius,
+                                           outlier_neighbors, outlier_distances,
+                                           min_neighbors + 1);
+        if(k > min_neighbors){
+            frame.indices->push_back(i);
+        }
+    }
+    timer.setItemsOut(frame.indices->size());
+}
+
+void SegmentationPipeline::growRegions(PipelineFrame& frame){
+    /* Segmentation code from:
+       http://pointclouds.org/documentation/tutorials/region_growing_rgb_segmentation.php*/
+
+    const SegmenterParams& params = frame.params;
+    //frame.clusters is refilled in place, so it keeps its storage
+    frame.summaries.clear();
+
+    //Clearly off-color points never make it into region growing
+    pcl::IndicesPtr segment_indices = frame.indices;
+    if(params.color_gate){
+        ScopedStageTimer timer(frame.stats, PipelineStats::COLOR_GATE, frame.indices->size());
+        gate_classifier.setTargets(frame.targets, params.gate_radius);
+        frame.replaced_buffers += recycle(frame.gate_indices);
+        segment_indices = frame.gate_indices;
+        segment_indices->clear();
+        segment_indices->reserve(frame.indices->size());
+        gate_classifier.classify(*frame.cloud, *frame.indices, *segment_indices);
+        timer.setItemsOut(segment_indices->size());
+    }
+
+    if(params.incremental && !frame.cropped){
+        growRegionsIncremental(frame, segment_indices);
+        return;
+    }
+
+    ScopedStageTimer timer(frame.stats, PipelineStats::REGION_GROWING,
+                           segment_indices->size());
+    extractClusters(frame, segment_indices, frame.clusters);
+    frame.summaries.resize(frame.clusters.size());
+
+    if(!frame.color_clusters){
+        frame.colored_cloud.reset();
+    } else if(params.parallel_regions){
+        frame.replaced_buffers += recycle(frame.colored_cloud);
+        RegionGrower::colorClusters(*frame.cloud, frame.clusters, *frame.colored_cloud);
+    } else {
+        //getColoredCloud makes a new cloud every time, so it can be kept
+        //as is; it has nothing to return without clusters
+        frame.colored_cloud = reg.getColoredCloud();
+        frame.replaced_buffers++;
+        if(!frame.colored_cloud || frame.clusters.empty()){
+            frame.colored_cloud = PointColorCloud::Ptr(new PointColorCloud);
+        }
+    }
+
+    size_t clustered = 0;
+    for(size_t i = 0; i < frame.clusters.size(); i++){
+        clustered += frame.clusters[i].indices.size();
+    }
+    timer.setItemsOut(clustered);
+    frame.search->releaseInput();
+}
+
+// Region growing over segment_indices with whichever engine the
+// parameters ask for
+void SegmentationPipeline::extractClusters(PipelineFrame& frame,
+                                           const pcl::IndicesPtr& segment_indices,
+                                           std::vector<pcl::PointIndices>& clusters){
+    const SegmenterParams& params = frame.params;
+    if(params.parallel_regions){
+        configureGrower(params);
+        //Mask the index down to the points being segmented
+        frame.search->setInputCloud(frame.cloud, segment_indices);
+        grower.extract(*frame.cloud, *segment_indices, *frame.search, clusters);
+        return;
+    }
+
+    clusters.clear();
+    reg.setInputCloud (frame.cloud);
+    reg.setIndices (segment_indices);
+    reg.setSearchMethod (frame.search);
+    if(!reg_configured || !params.sameRegionGrowing(reg_params)){
+        reg.setDistanceThreshold (params.distance_threshold);
+        reg.setPointColorThreshold (params.point_color_threshold);
+        reg.setRegionColorThreshold (params.region_color_threshold);
+        reg.setMinClusterSize (params.min_cluster_size);
+        reg.setMaxClusterSize (params.max_cluster_size);
+        reg_params = params;
+        reg_configured = true;
+    }
+
+    if(!segment_indices->empty()){
+        reg.extract (clusters);
+    }
+}
+
+void SegmentationPipeline::configureGrower(const SegmenterParams& params){
+    if(!grower_configured || !params.sameRegionGrowing(grower_params)){
+        grower.setDistanceThreshold(params.distance_threshold);
+        grower.setPointColorThreshold(params.point_color_threshold);
+        grower.setRegionColorThreshold(params.region_color_threshold);
+        grower.setMinClusterSize(params.min_cluster_size);
+        grower.setMaxClusterSize(params.max_cluster_size);
+        grower_params = params;
+        grower_configured = true;
+    }
+    grower.setNumberOfThreads(params.region_threads);
+}
+
+// Carry over the clusters nothing happened to and only grow regions over
+// the rest. This always uses RegionGrower, which can hand back the regions
+// that aren't clusters too. The cache starts over whenever the parameters it
+// was built with change, or, with the color gate on, the targets do, since
+// either changes which points get clustered.
+void SegmentationPipeline::growRegionsIncremental(PipelineFrame& frame,
+                                                  const pcl::IndicesPtr& segment_indices){
+    const SegmenterParams& params = frame.params;
+    if(cluster_cache.empty() || !params.sameSegmentation(cache_params) ||
+       (params.color_gate && !ColorClassifier::sameColors(frame.targets, cache_targets)) ||
+       frames_since_refresh >= params.incremental_refresh){
+        cluster_cache.clear();
+        cache_params = params;
+        cache_targets = frame.targets;
+        frames_since_refresh = 0;
+    }
+    frames_since_refresh++;
+
+    frame.replaced_buffers += recycle(grow_indices);
+    grow_indices->clear();
+    {
+        ScopedStageTimer timer(frame.stats, PipelineStats::CHANGES, segment_indices->size());
+        //Same neighbourhood as region growing looks at
+        cluster_cache.diff(frame.cloud, frame.voxel_keys, segment_indices, *frame.search,
+                           RegionGrower::default_neighbours, params.change_threshold, frame.clusters,
+                           frame.summaries, *grow_indices);
+        timer.setItemsOut(grow_indices->size());
+    }
+
+    ScopedStageTimer timer(frame.stats, PipelineStats::REGION_GROWING, grow_indices->size());
+    configureGrower(params);
+    frame.search->setInputCloud(frame.cloud, grow_indices);
+    grower.extractRegions(*frame.cloud, *grow_indices, *frame.search, found_regions);
+    cluster_cache.update(frame.voxel_keys, found_regions,
+                         params.min_cluster_size, params.max_cluster_size,
+                         found_clusters, found_summaries);
+    frame.clusters.insert(frame.clusters.end(), found_clusters.begin(), found_clusters.end());
+    frame.summaries.insert(frame.summaries.end(), found_summaries.begin(),
+                           found_summaries.end());
+
+    if(!frame.color_clusters){
+        frame.colored_cloud.reset();
+    } else {
+        frame.replaced_buffers += recycle(frame.colored_cloud);
+        RegionGrower::colorClusters(*frame.cloud, frame.clusters, *frame.colored_cloud);
+    }
+
+    size_t clustered = 0;
+    for(size_t i = 0; i < found_clusters.size(); i++){
+        clustered += found_clusters[i].indices.size();
+    }
+    timer.setItemsOut(clustered);
+    frame.search->releaseInput();
+}
+
+// Clusters carried over from the last frame already know their color and,
+// if they were picked before, their box.
+void SegmentationPipeline::fitBoxes(PipelineFrame& frame){
+    const PointColorCloud& cloud = *frame.cloud;
+    frame.summaries.resize(frame.clusters.size());
+
+    frame.target_clusters.clear();
+    frame.boxes.clear();
+    frame.box_targets.clear();
+    ScopedStageTimer color_timer(frame.stats, PipelineStats::COLOR_FILTER);
+    size_t clustered = 0, selected = 0;
+    for (size_t i = 0; i < frame.clusters.size(); i++){
+        const ClusterView<pcl::PointXYZRGB> cluster(cloud, frame.clusters[i]);
+        ClusterSummary& summary = frame.summaries[i];
+        clustered += cluster.size();
+
+        // Get a representative color in the cluster
+        if(!summary.has_color){
+            pcl::CentroidPoint<pcl::PointXYZRGB> rgb_centroid;
+            for (size_t j = 0; j < cluster.size(); j++){
+                rgb_centroid.add(cluster[j]);
+            }
+            pcl::PointXYZRGB avg_xyz;
+            rgb_centroid.get(avg_xyz);
+            summary.color = pcl::PointRGB(avg_xyz.b, avg_xyz.g, avg_xyz.r);
+            summary.has_color = true;
+        }
+        const pcl::PointRGB& avg = summary.color;
+
+        // Check which clicked color avg is within, if any. One color per
+        // cluster, so it gets the exact test rather than the gate's table.
+        ColorClassifier::TargetMask mask = ColorClassifier::matchExact(frame.targets,
+                                                                       frame.params.radius,
+                                                                       avg.r, avg.g, avg.b);
+        if (mask != 0){
+            int target = 0;
+            while(!(mask & 1)){
+                mask >>= 1;
+                target++;
+            }
+            frame.target_clusters.push_back(i);
+            frame.box_targets.push_back(target);
+            selected += cluster.size();
+        }
+    }
+    color_timer.setItemsIn(clustered);
+    color_timer.setItemsOut(selected);
+
+    {
+        ScopedStageTimer timer(frame.stats, PipelineStats::OBB, selected);
+        for (size_t i = 0; i < frame.target_clusters.size(); i++){
+            ClusterSummary& summary = frame.summaries[frame.target_clusters[i]];
+            if(!summary.has_box){
+                const ClusterView<pcl::PointXYZRGB> cluster(cloud,
+                                                            frame.clusters[frame.target_clusters[i]]);
+                //this centroid will be a bit off because we get only 2-3 faces of a cube
+                summary.box = OrientedBoundingBox::fit(cluster);
+                summary.has_box = true;
+            }
+            frame.boxes.push_back(summary.box);
+        }
+        timer.setItemsOut(frame.boxes.size());
+    }
+    if(frame.params.incremental && !frame.cropped){
+        cluster_cache.storeSummaries(frame.summaries);
+    }
+
+    //Combine poses with intersecting bounding boxes
+    ScopedStageTimer timer(frame.stats, PipelineStats::MERGE, frame.boxes.size());
+    mergeCollidingBoxes(frame.boxes, frame.box_targets);
+    timer.setItemsOut(frame.boxes.size());
+}
+
+// Sweep and prune along x to find every pair of colliding boxes, group them
+// with union-find and merge each group in one go. Boxes are merged from
+// their moments, so no points are visited here. A merged box can be larger
+// than its parts and hit a box none of them touched, so repeat until a
+// sweep finds nothing; every round removes at least one box.
+void SegmentationPipeline::mergeCollidingBoxes(std::vector<OrientedBoundingBox>& boxes,
+                                               std::vector<int>& labels){
+    UnionFind& groups = merge_groups;
+    std::vector<std::pair<float, int> >& order = merge_order;
+    std::vector<int>& active = merge_active;
+    while(boxes.size() > 1){
+        const int n = boxes.size();
+        groups.reset(n);
+
+        order.clear();
+        for(int i = 0; i < n; i++){
+            order.push_back(std::make_pair(boxes[i].get_min_point_AABB()[0], i));
+        }
+        std::sort(order.begin(), order.end());
+
+        bool collides = false;
+        active.clear();
+        for(int k = 0; k < n; k++){
+            const int i = order[k].second;
+            const float min_x = order[k].first;
+            //Boxes that end before this one starts can't collide with anything left
+            size_t kept = 0;
+            for(size_t a = 0; a < active.size(); a++){
+                if(boxes[active[a]].get_max_point_AABB()[0] > min_x){
+                    active[kept++] = active[a];
+                }
+            }
+            active.resize(kept);
+
+            for(size_t a = 0; a < active.size(); a++){
+                if(labels[i] == labels[active[a]] &&
+                   boxes[i].collides_with(boxes[active[a]])){
+                    groups.unite(i, active[a]);
+                    collides = true;
+                }
+            }
+            active.push_back(i);
+        }
+        if(!collides){
+            break;
+        }
+
+        //The root of each group is its smallest member, so groups come out
+        //in the order of their first box. Members are bucketed by group,
+        //in index order, and then each group is merged once.
+        std::vector<int>& group_slot = merge_slot;
+        std::vector<int>& offsets = merge_offsets;
+        std::vector<int>& members = merge_members;
+        group_slot.assign(n, -1);
+        merged_labels.clear();
+        for(int i = 0; i < n; i++){
+            const int root = groups.find(i);
+            if(group_slot[root] < 0){
+                group_slot[root] = merged_labels.size();
+                merged_labels.push_back(labels[i]);
+            }
+        }
+        const int num_groups = merged_labels.size();
+        offsets.assign(num_groups + 1, 0);
+        for(int i = 0; i < n; i++){
+            offsets[group_slot[groups.find(i)] + 1]++;
+        }
+        for(int g = 0; g < num_groups; g++){
+            offsets[g + 1] += offsets[g];
+        }
+        members.resize(n);
+        for(int i = 0; i < n; i++){
+            members[offsets[group_slot[groups.find(i)]]++] = i;
+        }
+        //Filling moved every offset to the end of its group
+        merged_boxes.clear();
+        int begin = 0;
+        for(int g = 0; g < num_groups; g++){
+            merged_boxes.push_back(OrientedBoundingBox::merge_group(boxes, &members[begin],
+                                                                    offsets[g] - begin));
+            begin = offsets[g];
+        }
+        boxes.swap(merged_boxes);
+        labels.swap(merged_labels);
+    }
+}
+
+}
+#endif
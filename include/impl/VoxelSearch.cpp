@@ -0,0 +1,372 @@
+#ifndef BAXTER_DEMOS_VOXEL_SEARCH_CPP_
+#define BAXTER_DEMOS_VOXEL_SEARCH_CPP_
+
+#include "VoxelSearch.h"
+#include "CloudPreprocessor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace baxter_demos{
+
+//floor division that rounds towards negative infinity
+static inline int floorDiv(int a, int b){
+    return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+
+static inline float squaredDistance(const pcl::PointXYZRGB& a, const pcl::PointXYZRGB& b){
+    const float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+    return dx*dx + dy*dy + dz*dz;
+}
+
+// Max-heap of (distance, index) candidates kept in the two output arrays
+// themselves, so that a search stops allocating once the caller's vectors
+// have grown to k
+static inline bool heapLess(const std::vector<float>& d, const std::vector<int>& idx,
+                            size_t a, size_t b){
+    return d[a] < d[b] || (d[a] == d[b] && idx[a] < idx[b]);
+}
+
+static inline void heapSwap(std::vector<float>& d, std::vector<int>& idx, size_t a, size_t b){
+    std::swap(d[a], d[b]);
+    std::swap(idx[a], idx[b]);
+}
+
+static void siftUp(std::vector<float>& d, std::vector<int>& idx, size_t i){
+    while(i > 0){
+        const size_t parent = (i - 1)/2;
+        if(!heapLess(d, idx, parent, i)){
+            break;
+        }
+        heapSwap(d, idx, parent, i);
+        i = parent;
+    }
+}
+
+static void siftDown(std::vector<float>& d, std::vector<int>& idx, size_t i, size_t n){
+    while(true){
+        size_t largest = i;
+        const size_t left = 2*i + 1, right = 2*i + 2;
+        if(left < n && heapLess(d, idx, largest, left)){
+            largest = left;
+        }
+        if(right < n && heapLess(d, idx, largest, right)){
+            largest = right;
+        }
+        if(largest == i){
+            break;
+        }
+        heapSwap(d, idx, i, largest);
+        i = largest;
+    }
+}
+
+VoxelSearch::VoxelSearch(float leaf, float min_cell) :
+        pcl::search::Search<pcl::PointXYZRGB>("VoxelSearch", false),
+        generation(0), incremental(false), last_added(0), last_removed(0) {
+    setResolution(leaf, min_cell);
+}
+
+void VoxelSearch::setResolution(float leaf, float min_cell){
+    leaf_size = leaf;
+    min_cell_size = min_cell;
+    voxels_per_cell = std::max(1, (int) std::ceil(min_cell/leaf - 1e-4));
+    cell_size = voxels_per_cell*leaf;
+    clear();
+}
+
+void VoxelSearch::clear(){
+    voxel_slots.clear();
+    cells.clear();
+    free_lists.clear();
+    for(size_t i = 0; i < cell_lists.size(); i++){
+        cell_lists[i].clear();
+        free_lists.push_back(i);
+    }
+    slots.clear();
+    free_slots.clear();
+    incremental = false;
+    for(int i = 0; i < 3; i++){
+        min_cell[i] = std::numeric_limits<int>::max();
+        max_cell[i] = std::numeric_limits<int>::min();
+    }
+}
+
+void VoxelSearch::growBounds(int cx, int cy, int cz){
+    min_cell[0] = std::min(min_cell[0], cx); max_cell[0] = std::max(max_cell[0], cx);
+    min_cell[1] = std::min(min_cell[1], cy); max_cell[1] = std::max(max_cell[1], cy);
+    min_cell[2] = std::min(min_cell[2], cz); max_cell[2] = std::max(max_cell[2], cz);
+}
+
+void VoxelSearch::cellCoordsOfPoint(const pcl::PointXYZRGB& pt, int& cx, int& cy, int& cz) const {
+    cx = (int) std::floor(pt.x/cell_size);
+    cy = (int) std::floor(pt.y/cell_size);
+    cz = (int) std::floor(pt.z/cell_size);
+}
+
+void VoxelSearch::cellCoordsOfVoxel(boost::uint64_t voxel, int& cx, int& cy, int& cz) const {
+    int ix, iy, iz;
+    CloudPreprocessor::voxelCoords(voxel, ix, iy, iz);
+    cx = floorDiv(ix, voxels_per_cell);
+    cy = floorDiv(iy, voxels_per_cell);
+    cz = floorDiv(iz, voxels_per_cell);
+}
+
+int VoxelSearch::insertSlot(boost::uint64_t voxel, boost::uint64_t cell, int point){
+    int slot;
+    if(free_slots.empty()){
+        slot = slots.size();
+        slots.push_back(Slot());
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    Slot& s = slots[slot];
+    s.voxel = voxel;
+    s.cell = cell;
+    s.point = point;
+    s.generation = generation;
+    std::pair<int*, bool> list = cells.insert(cell, 0);
+    if(list.second){
+        if(free_lists.empty()){
+            *list.first = cell_lists.size();
+            cell_lists.push_back(std::vector<int>());
+        } else {
+            *list.first = free_lists.back();
+            free_lists.pop_back();
+        }
+    }
+    cell_lists[*list.first].push_back(slot);
+    return slot;
+}
+
+void VoxelSearch::removeSlot(int slot){
+    Slot& s = slots[slot];
+    const int* list = cells.find(s.cell);
+    if(list){
+        const int l = *list;
+        std::vector<int>& members = cell_lists[l];
+        std::vector<int>::iterator m = std::find(members.begin(), members.end(), slot);
+        if(m != members.end()){
+            *m = members.back();
+            members.pop_back();
+        }
+        if(members.empty()){
+            cells.erase(s.cell);
+            free_lists.push_back(l);
+        }
+    }
+    voxel_slots.erase(s.voxel);
+    s.generation = 0;
+    free_slots.push_back(slot);
+}
+
+void VoxelSearch::update(const PointCloudConstPtr& cloud,
+                         const std::vector<boost::uint64_t>& voxel_keys){
+    input_ = cloud;
+    indices_.reset();
+    mask.clear();
+
+    if(!incremental){
+        clear();
+        incremental = true;
+    }
+    generation++;
+    if(generation == 0){
+        generation = 1;
+    }
+
+    last_added = 0;
+    for(size_t i = 0; i < voxel_keys.size(); i++){
+        const int* existing = voxel_slots.find(voxel_keys[i]);
+        if(existing){
+            //Same voxel as last frame: the cell doesn't change
+            Slot& s = slots[*existing];
+            s.point = i;
+            s.generation = generation;
+        } else {
+            int cx, cy, cz;
+            cellCoordsOfVoxel(voxel_keys[i], cx, cy, cz);
+            growBounds(cx, cy, cz);
+            voxel_slots.insert(voxel_keys[i], insertSlot(voxel_keys[i],
+                                            CloudPreprocessor::voxelKey(cx, cy, cz), i));
+            last_added++;
+        }
+    }
+
+    //Drop the voxels that were not seen this frame
+    last_removed = 0;
+    if(voxel_slots.size() > voxel_keys.size()){
+        for(size_t i = 0; i < slots.size(); i++){
+            if(slots[i].generation != 0 && slots[i].generation != generation){
+                removeSlot(i);
+                last_removed++;
+            }
+        }
+    }
+}
+
+void VoxelSearch::setMask(const IndicesConstPtr& indices){
+    mask.clear();
+    if(indices && input_ && indices->size() != input_->points.size()){
+        mask.resize(input_->points.size(), 0);
+        for(size_t i = 0; i < indices->size(); i++){
+            mask[(*indices)[i]] = 1;
+        }
+    }
+}
+
+void VoxelSearch::setInputCloud(const PointCloudConstPtr& cloud,
+                                const IndicesConstPtr& indices){
+    if(cloud != input_ || !incremental){
+        //Not a cloud we have voxel keys for, so index the raw points
+        input_ = cloud;
+        clear();
+        generation = 1;
+        for(size_t i = 0; i < cloud->points.size(); i++){
+            int cx, cy, cz;
+            cellCoordsOfPoint(cloud->points[i], cx, cy, cz);
+            growBounds(cx, cy, cz);
+            insertSlot(0, CloudPreprocessor::voxelKey(cx, cy, cz), i);
+        }
+    }
+    indices_ = indices;
+    setMask(indices);
+}
+
+void VoxelSearch::releaseInput(){
+    input_.reset();
+    indices_.reset();
+    mask.clear();
+}
+
+int VoxelSearch::radiusSearch(const pcl::PointXYZRGB& point, double radius,
+                              std::vector<int>& k_indices,
+                              std::vector<float>& k_sqr_distances,
+                              unsigned int max_nn) const {
+    k_indices.clear();
+    k_sqr_distances.clear();
+
+    const float sqr_radius = radius*radius;
+    const int reach = (int) std::ceil(radius/cell_size);
+    int cx, cy, cz;
+    cellCoordsOfPoint(point, cx, cy, cz);
+
+    for(int x = cx - reach; x <= cx + reach; x++){
+        for(int y = cy - reach; y <= cy + reach; y++){
+            for(int z = cz - reach; z <= cz + reach; z++){
+                const int* list = cells.find(CloudPreprocessor::voxelKey(x, y, z));
+                if(!list){
+                    continue;
+                }
+                const std::vector<int>& members = cell_lists[*list];
+                for(size_t i = 0; i < members.size(); i++){
+                    const int idx = slots[members[i]].point;
+                    if(!mask.empty() && !mask[idx]){
+                        continue;
+                    }
+                    const float d = squaredDistance(point, input_->points[idx]);
+                    if(d <= sqr_radius){
+                        k_indices.push_back(idx);
+                        k_sqr_distances.push_back(d);
+                        if(max_nn > 0 && k_indices.size() >= max_nn && !sorted_results_){
+                            return k_indices.size();
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if(sorted_results_ || (max_nn > 0 && k_indices.size() > max_nn)){
+        std::vector<std::pair<float, int> > sorted(k_indices.size());
+        for(size_t i = 0; i < k_indices.size(); i++){
+            sorted[i] = std::make_pair(k_sqr_distances[i], k_indices[i]);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        if(max_nn > 0 && sorted.size() > max_nn){
+            sorted.resize(max_nn);
+        }
+        k_indices.resize(sorted.size());
+        k_sqr_distances.resize(sorted.size());
+        for(size_t i = 0; i < sorted.size(); i++){
+            k_sqr_distances[i] = sorted[i].first;
+            k_indices[i] = sorted[i].second;
+        }
+    }
+    return k_indices.size();
+}
+
+int VoxelSearch::nearestKSearch(const pcl::PointXYZRGB& point, int k,
+                                std::vector<int>& k_indices,
+                                std::vector<float>& k_sqr_distances) const {
+    k_indices.clear();
+    k_sqr_distances.clear();
+    if(k <= 0 || cells.empty()){
+        return 0;
+    }
+
+    int cx, cy, cz;
+    cellCoordsOfPoint(point, cx, cy, cz);
+
+    //Furthest ring that can still hold an occupied cell
+    int max_ring = 0;
+    const int c[3] = {cx, cy, cz};
+    for(int i = 0; i < 3; i++){
+        max_ring = std::max(max_ring, std::max(c[i] - min_cell[i], max_cell[i] - c[i]));
+    }
+
+    //max-heap on distance holding the k best candidates so far
+    std::vector<float>& best_d = k_sqr_distances;
+    std::vector<int>& best_i = k_indices;
+    for(int ring = 0; ring <= max_ring; ring++){
+        for(int x = cx - ring; x <= cx + ring; x++){
+            for(int y = cy - ring; y <= cy + ring; y++){
+                for(int z = cz - ring; z <= cz + ring; z++){
+                    //only the shell of the cube, the inside was done already
+                    if(std::abs(x - cx) != ring && std::abs(y - cy) != ring &&
+                       std::abs(z - cz) != ring){
+                        continue;
+                    }
+                    const int* list = cells.find(CloudPreprocessor::voxelKey(x, y, z));
+                    if(!list){
+                        continue;
+                    }
+                    const std::vector<int>& members = cell_lists[*list];
+                    for(size_t i = 0; i < members.size(); i++){
+                        const int idx = slots[members[i]].point;
+                        if(!mask.empty() && !mask[idx]){
+                            continue;
+                        }
+                        const float d = squaredDistance(point, input_->points[idx]);
+                        if((int) best_d.size() < k){
+                            best_d.push_back(d);
+                            best_i.push_back(idx);
+                            siftUp(best_d, best_i, best_d.size() - 1);
+                        } else if(d < best_d[0]){
+                            best_d[0] = d;
+                            best_i[0] = idx;
+                            siftDown(best_d, best_i, 0, best_d.size());
+                        }
+                    }
+                }
+            }
+        }
+        //Anything in the next ring is at least ring*cell_size away
+        const float reach = ring*cell_size;
+        if((int) best_d.size() == k && best_d[0] <= reach*reach){
+            break;
+        }
+    }
+
+    //Heap sort, nearest first
+    for(size_t n = best_d.size(); n > 1; n--){
+        heapSwap(best_d, best_i, 0, n - 1);
+        siftDown(best_d, best_i, 0, n - 1);
+    }
+    return best_d.size();
+}
+
+}
+#endif
@@ -53,15 +53,38 @@ class ObjectManager:
     # Make any necessary modifications received from this object's owner
     # Publish collision_objects to planning_scene
 
+    # Every message is a set of changes to the scene; a resync holds the
+    # whole scene, so anything not in it is removed
+    # Objects attached to a gripper are ours until they are detached; the
+    # tracker still sees them and would move or remove them otherwise
     def callback(self, data):
-        collision_objects = data.objects
-        self.collision_objects = collision_objects
-
-        for obj in collision_objects:
+        attached = set(self.attached_ids)
+        objects = list(self.collision_objects)
+        if data.resync:
+            current = set(obj.id for obj in data.objects)
+            for obj in objects:
+                if obj.id not in current and obj.id not in attached:
+                    self.id_operations[obj.id] = CollisionObject.REMOVE
+                    self.publish(obj)
+            objects = [obj for obj in objects
+                       if obj.id in current or obj.id in attached]
+
+        for obj in data.objects:
+            if obj.id in attached:
+                continue
             self.id_operations[obj.id] = obj.operation
-        if not self.published:
-            self.publish_all()
-            self.published = True
+            self.publish(obj)
+            ids = [known.id for known in objects]
+            if obj.id in ids:
+                i = ids.index(obj.id)
+                if obj.operation == CollisionObject.REMOVE:
+                    del objects[i]
+                else:
+                    objects[i] = obj
+            elif obj.operation != CollisionObject.REMOVE:
+                objects.append(obj)
+        # Replaced, not changed in place, so readers can hold on to a list
+        self.collision_objects = objects
 
     def publish(self, obj):
         obj.operation = self.id_operations[obj.id]
@@ -79,6 +102,11 @@ class ObjectManager:
         msg.link_name = side+"_gripper" 
         touch_links = [side+"_gripper", side+"_gripper_base", side+"_hand_camera", side+"_hand_range", "octomap"]
         self.attached_pub.publish(msg)
+        self.attached_ids.add(attached_obj.id)
+
+    # The tracker may change the object again
+    def detached(self, obj_id):
+        self.attached_ids.discard(obj_id)
 
     def remove_known_objects(self):
         rate = rospy.Rate(1)
@@ -89,13 +117,13 @@ class ObjectManager:
 
 
     def __init__(self):
-        self.object_sub = rospy.Subscriber("object_tracker/collision_objects",
-                                     CollisionObjectArray, self.callback)
-        self.pub = rospy.Publisher("/collision_object", CollisionObject)
-        self.attached_pub = rospy.Publisher("/attached_collision_object", AttachedCollisionObject)
         self.id_operations = {}
         self.collision_objects = []
-        self.published = False
+        self.attached_ids = set()
+        self.pub = rospy.Publisher("/collision_object", CollisionObject)
+        self.attached_pub = rospy.Publisher("/attached_collision_object", AttachedCollisionObject)
+        self.object_sub = rospy.Subscriber("object_tracker/collision_objects",
+                                     CollisionObjectArray, self.callback)
         
 
 config_folder = rospy.get_param('object_tracker/config_folder')
@@ -151,7 +179,8 @@ def main():
     obj_manager = ObjectManager()
     while len(obj_manager.collision_objects) <= 0:
         rate.sleep()
-    objects = obj_manager.collision_objects
+    # A snapshot; the manager keeps following the scene
+    objects = list(obj_manager.collision_objects)
 
     object_height = params['object_height']
     
@@ -259,6 +288,7 @@ def main():
             group.go(wait=True)
             gripper_if.open(block=True)
             group.detach_object(obj.id)
+            obj_manager.detached(obj.id)
             # Carefully rise away from the object before we plan another path
             pose = incrementPoseMsgZ(stack_pose, 2*object_height)
             ik_command.service_request_pose(iksvc, pose, limb, blocking = True)
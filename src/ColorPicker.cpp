@@ -1,7 +1,10 @@
-#include <pcl/search/search.h>
-#include <pcl/search/kdtree.h>
+#include <algorithm>
+#include <cmath>
+
+#include <boost/thread/mutex.hpp>
 
 #include "geometry_msgs/Point.h"
+#include "sensor_msgs/CameraInfo.h"
 #include "ros/ros.h"
 
 #include <pcl/conversions.h>
@@ -14,7 +17,11 @@
 #include <pcl/point_types_conversion.h>
 #include <pcl/visualization/cloud_viewer.h>
 
-#include <boost/thread/mutex.hpp>
+#include <baxter_demos/CompressedCloud.h>
+
+#include "CloudEncoder.h"
+#include "ImageROI.h"
+#include "Snapshot.h"
 
 typedef pcl::PointCloud<pcl::PointXYZRGB> PointColorCloud;
 using namespace std;
@@ -24,91 +31,211 @@ private:
     ros::NodeHandle n;
     ros::Subscriber cloud_sub;
     ros::Subscriber color_sub;
+    ros::Subscriber info_sub;
     ros::Publisher pub;
-    bool has_cloud;
+    //Set from the viewer's thread, read by the cloud callback; both only
+    //under color_mutex, so the color is never seen half written
     bool has_desired_color;
-    bool segmented;
-    PointColorCloud::Ptr cloud;
-    PointColorCloud::Ptr segmented_cloud;
-    pcl::IndicesPtr indices;
     pcl::PointRGB desired_color;
+    boost::mutex color_mutex;
+    //Written by the ROS callbacks, read by the viewer's thread
+    baxter_demos::Snapshot<PointColorCloud> cloud;
+    baxter_demos::Snapshot<PointColorCloud> segmented_cloud;
+    //Written by info_callback, read by the viewer's thread
+    baxter_demos::CameraIntrinsics camera;
+    boost::mutex camera_mutex;
+    baxter_demos::CloudEncoder decoder;
 
-public:
-    boost::mutex cloud_mutex;
+    //The color of a click is the median of the pixels in a window of
+    //(2*pick_window + 1)^2 around it, so a single noisy pixel doesn't decide
+    //it. Only pixels about as far from the camera as the clicked one count,
+    //so a click near an edge doesn't mix in the background.
+    static const int pick_window = 3;
+    static const float pick_depth_tolerance;
 
+public:
     bool hasCloud(){
-        return has_cloud;
+        return cloud.version() > 0;
     }
 
     bool hasDesiredColor(){
+        boost::mutex::scoped_lock lock(color_mutex);
+        return has_desired_color;
+    }
+
+    //False until a color has been picked
+    bool getDesiredColor(pcl::PointRGB& color){
+        boost::mutex::scoped_lock lock(color_mutex);
+        color = desired_color;
         return has_desired_color;
     }
 
     bool wasSegmented(){
-        return segmented;
+        return segmented_cloud.version() > 0;
+    }
+
+    PointColorCloud::ConstPtr getCloud(){
+        return cloud.get();
     }
 
-    PointColorCloud::Ptr getCloud(){
-        return cloud;
+    PointColorCloud::ConstPtr getSegmentedCloud(){
+        return segmented_cloud.get();
     }
 
-    PointColorCloud::Ptr getSegmentedCloud(){
-        return segmented_cloud;
+    //Count the clouds published so far, to tell a new one from the last
+    unsigned int getCloudVersion(){
+        return cloud.version();
+    }
+
+    unsigned int getSegmentedVersion(){
+        return segmented_cloud.version();
     }
 
     ColorPicker(){
         cloud_sub = n.subscribe("/camera/depth_registered/points", 1000,
                                    &ColorPicker::callback, this);
-        color_sub = n.subscribe("/object_tracker/segmented_cloud", 1000,
-                                   &ColorPicker::segmented_callback, this);
+        info_sub = n.subscribe("/camera/depth_registered/camera_info", 1,
+                                   &ColorPicker::info_callback, this);
+        //Which view of the segmentation to show: cloud, labels, targets,
+        //preview or compressed. Anything but cloud is fine over a slow link.
+        ros::NodeHandle private_n("~");
+        string output;
+        private_n.param<string>("output", output, "cloud");
+        if(output == "compressed"){
+            color_sub = n.subscribe("/object_tracker/segmented_compressed", 1,
+                                       &ColorPicker::compressed_callback, this);
+        } else if(output == "labels"){
+            color_sub = n.subscribe("/object_tracker/segmented_labels", 1,
+                                       &ColorPicker::labels_callback, this);
+        } else {
+            if(output != "cloud" && output != "targets" && output != "preview"){
+                ROS_WARN("Unknown output %s, showing the segmented cloud", output.c_str());
+                output = "cloud";
+            }
+            color_sub = n.subscribe("/object_tracker/segmented_" + output, 1,
+                                       &ColorPicker::segmented_callback, this);
+        }
 
         pub = n.advertise<geometry_msgs::Point>("/object_tracker/picked_color", 1000);
-        has_cloud = false;
-        segmented = false;
         has_desired_color = false;
-        cloud_mutex.unlock();
-        cloud = PointColorCloud::Ptr( new PointColorCloud());
-        segmented_cloud = PointColorCloud::Ptr( new PointColorCloud());
     }
 
+    //Every callback fills a buffer the viewer can't see and then publishes
+    //it, so the viewer never sees a half written cloud
     void segmented_callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
- 
         pcl::PCLPointCloud2 pcl_pc;
         pcl_conversions::toPCL(*msg, pcl_pc);
-        pcl::fromPCLPointCloud2(pcl_pc, *segmented_cloud);
-       
-        segmented = true;
+        PointColorCloud::Ptr next = segmented_cloud.acquire();
+        pcl::fromPCLPointCloud2(pcl_pc, *next);
+        segmented_cloud.publish(next);
     }
 
-    
-    void callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
-        //Update the class cloud ptr
-        indices = pcl::IndicesPtr( new vector<int>() );
+    void labels_callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
+        pcl::PCLPointCloud2 pcl_pc;
+        pcl_conversions::toPCL(*msg, pcl_pc);
+        PointColorCloud::Ptr next = segmented_cloud.acquire();
+        baxter_demos::CloudEncoder::decodeLabels(pcl_pc, *next);
+        segmented_cloud.publish(next);
+    }
+
+    void compressed_callback(const baxter_demos::CompressedCloud::ConstPtr& msg){
+        PointColorCloud::Ptr next = segmented_cloud.acquire();
+        decoder.decompress(msg->data, next);
+        segmented_cloud.publish(next);
+    }
 
+    void callback(const sensor_msgs::PointCloud2::ConstPtr& msg){
         pcl::PCLPointCloud2 pcl_pc;
         pcl_conversions::toPCL(*msg, pcl_pc);
-        cloud_mutex.lock();
-        pcl::fromPCLPointCloud2(pcl_pc, *cloud);
-        pcl::removeNaNFromPointCloud(*cloud, *cloud, *indices);
-        has_cloud = true;
-        cloud_mutex.unlock();
+        PointColorCloud::Ptr next = cloud.acquire();
+        //Kept organized (NaNs and all), so a click maps straight to a pixel
+        pcl::fromPCLPointCloud2(pcl_pc, *next);
+        cloud.publish(next);
 
-        if(has_desired_color){
+        pcl::PointRGB color;
+        if(getDesiredColor(color)){
             geometry_msgs::Point pub_msg;
-            pub_msg.x = (int) desired_color.r;
-            pub_msg.y = (int) desired_color.g;
-            pub_msg.z = (int) desired_color.b;
+            pub_msg.x = (int) color.r;
+            pub_msg.y = (int) color.g;
+            pub_msg.z = (int) color.b;
             pub.publish(pub_msg);
         }
     }
 
-    pcl::PointRGB getCloudColorAt(int x, int y){
-        pcl::PointXYZRGB cur = cloud->at(x, y);
+    void info_callback(const sensor_msgs::CameraInfo::ConstPtr& msg){
+        boost::mutex::scoped_lock lock(camera_mutex);
+        camera.fx = msg->K[0];
+        camera.cx = msg->K[2];
+        camera.fy = msg->K[4];
+        camera.cy = msg->K[5];
+        camera.width = msg->width;
+        camera.height = msg->height;
+    }
+
+    static bool isFinite(const pcl::PointXYZRGB& pt){
+        return pcl_isfinite(pt.x) && pcl_isfinite(pt.y) && pcl_isfinite(pt.z);
+    }
+
+    //Pixel of the organized cloud that p lands on, through camera. false if
+    //p is outside the image. The pixel itself may have no depth.
+    static bool projectToPixel(const PointColorCloud& cloud,
+                               const baxter_demos::CameraIntrinsics& camera,
+                               const pcl::PointXYZRGB& p, int& x, int& y){
+        if(!camera.valid() || !cloud.isOrganized()){
+            return false;
+        }
+        float u, v;
+        if(!camera.scaled(cloud.width, cloud.height).project(
+                                    Eigen::Vector3f(p.x, p.y, p.z), u, v)){
+            return false;
+        }
+        x = (int) (u + 0.5f);
+        y = (int) (v + 0.5f);
+        if(x < 0 || y < 0 || x >= (int) cloud.width || y >= (int) cloud.height){
+            return false;
+        }
+        return true;
+    }
+
+    //Median color around pixel (x, y) of the organized cloud, of the pixels
+    //within pick_depth_tolerance of depth. false if there are none.
+    static bool getWindowColorAt(const PointColorCloud& cloud, int x, int y,
+                                 float depth, pcl::PointRGB& color){
+        unsigned char r[(2*pick_window + 1)*(2*pick_window + 1)];
+        unsigned char g[(2*pick_window + 1)*(2*pick_window + 1)];
+        unsigned char b[(2*pick_window + 1)*(2*pick_window + 1)];
+        int n = 0;
+        const int x_end = std::min(x + pick_window, (int) cloud.width - 1);
+        const int y_end = std::min(y + pick_window, (int) cloud.height - 1);
+        for(int j = std::max(y - pick_window, 0); j <= y_end; j++){
+            for(int i = std::max(x - pick_window, 0); i <= x_end; i++){
+                const pcl::PointXYZRGB& pt = cloud.at(i, j);
+                if(!isFinite(pt) || std::fabs(pt.z - depth) > pick_depth_tolerance){
+                    continue;
+                }
+                r[n] = pt.r;
+                g[n] = pt.g;
+                b[n] = pt.b;
+                n++;
+            }
+        }
+        if(n == 0){
+            return false;
+        }
+        std::nth_element(r, r + n/2, r + n);
+        std::nth_element(g, g + n/2, g + n);
+        std::nth_element(b, b + n/2, b + n);
+        color = pcl::PointRGB(b[n/2], g[n/2], r[n/2]);
+        return true;
+    }
+
+    static pcl::PointRGB getCloudColorAt(const PointColorCloud& cloud, int x, int y){
+        pcl::PointXYZRGB cur = cloud.at(x, y);
         return pcl::PointRGB(cur.b, cur.g, cur.r);
     }
 
-    pcl::PointRGB getCloudColorAt(size_t n){
-        pcl::PointXYZRGB cur = cloud->at(n);
+    static pcl::PointRGB getCloudColorAt(const PointColorCloud& cloud, size_t n){
+        pcl::PointXYZRGB cur = cloud.at(n);
         return pcl::PointRGB(cur.b, cur.g, cur.r);
     }
 
@@ -123,23 +250,48 @@ public:
 
         desired_color = getCloudColorAt((size_t) n);*/
         
-        pcl::search::KdTree<pcl::PointXYZRGB> search;
-
-        search.setInputCloud(cloud);
+        //The cloud stays as it is for as long as the snapshot is held
+        PointColorCloud::ConstPtr snapshot = cloud.get();
+        if(!snapshot || snapshot->empty()){
+            return;
+        }
         pcl::PointXYZRGB picked_pt;
         event.getPoint(picked_pt.x, picked_pt.y, picked_pt.z);
 
-        vector<float> distances(1);
-        vector<int> search_indices(1);
-        search.nearestKSearch (picked_pt, 1, search_indices, distances);
-        desired_color = getCloudColorAt( (size_t) search_indices[0]);
+        baxter_demos::CameraIntrinsics intrinsics;
+        {
+            boost::mutex::scoped_lock lock(camera_mutex);
+            intrinsics = camera;
+        }
+
+        //The picked point is in the camera frame, so it projects straight
+        //to its pixel. The window around it is all that is looked at, even
+        //if the pixel itself is a hole; a pick that finds nothing there
+        //fails rather than searching the whole cloud.
+        int x, y;
+        if(!projectToPixel(*snapshot, intrinsics, picked_pt, x, y)){
+            cout << "Can't place the point in the image (no camera_info yet?), "
+                    "pick again" << endl;
+            return;
+        }
+        pcl::PointRGB color;
+        if(!getWindowColorAt(*snapshot, x, y, picked_pt.z, color)){
+            cout << "No points near the picked one, pick again" << endl;
+            return;
+        }
+        {
+            boost::mutex::scoped_lock lock(color_mutex);
+            desired_color = color;
+            has_desired_color = true;
+        }
 
-        cout << "Desired color: " << (int) desired_color.r << ", " <<
-                (int) desired_color.g << ", " << (int) desired_color.b << endl;
-        has_desired_color = true;
+        cout << "Desired color: " << (int) color.r << ", " <<
+                (int) color.g << ", " << (int) color.b << endl;
     }
 };
 
+const float ColorPicker::pick_depth_tolerance = 0.02;
+
 int main(int argc, char** argv){
 
     ros::init(argc, argv, "color_picker");
@@ -151,25 +303,20 @@ int main(int argc, char** argv){
 
     ros::Rate loop_rate(100);
 
-    while(ros::ok && !cloud_viewer.wasStopped()){
-        ros::spinOnce();
-        loop_rate.sleep();
-        if(color_picker.hasCloud() && color_picker.getCloud() != NULL){
-            break;
-        }
-    }
-
-    color_picker.cloud_mutex.lock();
-    PointColorCloud::Ptr cloud = color_picker.getCloud(); 
-    
-    color_picker.cloud_mutex.unlock();
-
-    while(ros::ok && !cloud_viewer.wasStopped()){
+    //Show the segmented cloud once there is one, the camera's until then,
+    //and only hand the viewer clouds it hasn't shown yet
+    unsigned int shown_cloud = 0;
+    unsigned int shown_segmented = 0;
+    while(ros::ok() && !cloud_viewer.wasStopped()){
         ros::spinOnce();
         if(color_picker.wasSegmented()){
-            cloud_viewer.showCloud(color_picker.getSegmentedCloud());
-        } else {
-            cloud_viewer.showCloud(cloud);
+            if(color_picker.getSegmentedVersion() != shown_segmented){
+                shown_segmented = color_picker.getSegmentedVersion();
+                cloud_viewer.showCloud(color_picker.getSegmentedCloud());
+            }
+        } else if(color_picker.getCloudVersion() != shown_cloud){
+            shown_cloud = color_picker.getCloudVersion();
+            cloud_viewer.showCloud(color_picker.getCloud());
         }
         loop_rate.sleep();
     }
@@ -1,26 +1,44 @@
 #include "ros/ros.h"
 #include "CloudSegmenter.h"
+#include "CloudViewerThread.h"
 
 using namespace baxter_demos;
 
+// The segmenter as a standalone node, with a viewer. ROS callbacks run on
+// their own spinner and the viewer on its own thread, so processing runs at
+// the same rate whether the window is open or not.
 int main(int argc, char** argv){
     ros::init(argc, argv, "object_finder_3d");
+
+    //The nodelet, loaded by hand
     CloudSegmenter cs;
-    pcl::visualization::CloudViewer cloud_viewer("Cloud viewer");
-    cloud_viewer.registerPointPickingCallback(
-    &CloudSegmenter::getClickedPoint, cs, (void*) NULL );
-    ros::Rate loop_rate(100);
-    //event loop
-    while(ros::ok() && !cloud_viewer.wasStopped()){
-        ros::spinOnce();
+    nodelet::V_string my_argv(argv + 1, argv + argc);
+    cs.init(ros::this_node::getName(), ros::names::getRemappings(), my_argv);
+    ros::AsyncSpinner spinner(1);
+    spinner.start();
+
+    //How often the window may be redrawn and how many points it shows,
+    //independent of the camera's rate and resolution
+    ros::NodeHandle private_n("~");
+    double viewer_rate;
+    int viewer_max_points;
+    private_n.param("viewer_rate", viewer_rate, 30.0);
+    private_n.param("viewer_max_points", viewer_max_points, 100000);
+
+    //The segmented cloud once there is one, the camera's until then
+    cs.setViewerAttached(true);
+    CloudViewerThread viewer("Cloud viewer");
+    viewer.addSource(cs.getClusteredSnapshot());
+    viewer.addSource(cs.getCloudSnapshot());
+    viewer.setMaxRate(viewer_rate);
+    viewer.setMaxPoints(std::max(viewer_max_points, 0));
+    viewer.start();
+
+    ros::Rate loop_rate(10);
+    while(ros::ok() && !viewer.wasStopped()){
         loop_rate.sleep();
-        if(cs.hasColor()){
-            pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr cloud = cs.getClusteredCloudPtr();
-            cloud_viewer.showCloud(cloud);
-        } else if(cs.hasCloud()){
-            pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr cloud = cs.getCloudPtr();
-            cloud_viewer.showCloud(cloud);
-        }
     }
+    viewer.stop();
+    spinner.stop();
     return 0;
 }
@@ -0,0 +1,544 @@
+// Replays a directory of PCD files through the segmentation pipeline and
+// reports how long each stage takes, without ROS, a camera or TF.
+//
+// usage: segmentation_benchmark <pcd directory> [options]
+//   --color r g b   add a target color (default: one target, 255 0 0)
+//   --passes n      replay the directory n times (default 1)
+//   --leaf size     voxel size in meters
+//   --gate          enable the color gate in front of region growing
+//   --parallel n    grow regions with RegionGrower on n threads (0: all cores)
+//   --incremental   only segment again what changed since the last frame
+//   --verify        segment every frame a second time with a full pass and
+//                   report how far the clusters are from it
+//   --verify-pcl    the same, with pcl::RegionGrowingRGB doing the full pass
+//   --check-colors  before replaying, compare the color gate's lookup table
+//                   with the exact HSV test on every 24 bit color
+//   --check-exclusion n
+//                   before replaying, drop n blocks at random points of every
+//                   cloud, remove them with BoxExclusion and with a
+//                   ConditionalRemoval per block, and compare the two
+//
+// Clouds are loaded before timing starts, so disk IO is not measured. The
+// second pass of --verify is neither timed nor counted.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+#include <boost/atomic.hpp>
+
+#include <pcl/pcl_macros.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/common/time.h>
+#include <pcl/common/transforms.h>
+#include <pcl/filters/conditional_removal.h>
+
+#include "SegmentationPipeline.h"
+#include "ObjectTracker.h"
+#include "ColorClassifier.h"
+#include "BoxExclusion.h"
+
+using namespace baxter_demos;
+
+//Every allocation through new in this process is counted. Eigen's aligned
+//allocations go to malloc directly and are not. --parallel allocates from
+//several threads at once, hence the atomics; the order of the updates
+//doesn't matter, only their sum.
+static boost::atomic<size_t> allocation_count(0);
+static boost::atomic<size_t> allocation_bytes(0);
+
+void* operator new(size_t size) throw(std::bad_alloc){
+    allocation_count.fetch_add(1, boost::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, boost::memory_order_relaxed);
+    void* p = std::malloc(size > 0 ? size : 1);
+    if(!p){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc){
+    return operator new(size);
+}
+
+void operator delete(void* p) throw(){
+    std::free(p);
+}
+
+void operator delete[](void* p) throw(){
+    std::free(p);
+}
+
+enum Stage { FILTER, OUTLIERS, REGIONS, BOXES, TRACKING, TOTAL, NUM_STAGES };
+static const char* stage_names[NUM_STAGES] = {"filter", "outliers", "regions", "boxes",
+                                              "tracking", "total"};
+
+static double percentile(std::vector<double> values, double q){
+    if(values.empty()){
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t i = (size_t) (q*(values.size() - 1) + 0.5);
+    return values[std::min(i, values.size() - 1)];
+}
+
+static double mean(const std::vector<double>& values){
+    if(values.empty()){
+        return 0;
+    }
+    double sum = 0;
+    for(size_t i = 0; i < values.size(); i++){
+        sum += values[i];
+    }
+    return sum/values.size();
+}
+
+// How two segmentations of the same cloud differ. Every cluster is matched
+// with the reference cluster it shares the most points with; a point agrees
+// if its cluster and the reference cluster it is in are matched with each
+// other. Points neither of them clusters are left out.
+struct ClusterAgreement {
+    size_t clusters;
+    size_t reference_clusters;
+    //Matched clusters with exactly the same points
+    size_t identical;
+    //Points in a cluster of either
+    size_t points;
+    size_t agreeing_points;
+
+    ClusterAgreement() : clusters(0), reference_clusters(0), identical(0), points(0),
+                         agreeing_points(0) {}
+
+    void add(const ClusterAgreement& other){
+        clusters += other.clusters;
+        reference_clusters += other.reference_clusters;
+        identical += other.identical;
+        points += other.points;
+        agreeing_points += other.agreeing_points;
+    }
+
+    double agreement() const {
+        return points > 0 ? (double) agreeing_points/points : 1;
+    }
+};
+
+static void labelClusters(const std::vector<pcl::PointIndices>& clusters, size_t num_points,
+                          std::vector<int>& labels){
+    labels.assign(num_points, -1);
+    for(size_t c = 0; c < clusters.size(); c++){
+        for(size_t i = 0; i < clusters[c].indices.size(); i++){
+            labels[clusters[c].indices[i]] = c;
+        }
+    }
+}
+
+//For each cluster, the other cluster it overlaps most and by how much
+static void matchClusters(const std::vector<pcl::PointIndices>& clusters,
+                          const std::vector<int>& other_labels,
+                          std::vector<int>& match, std::vector<size_t>& overlap){
+    match.assign(clusters.size(), -1);
+    overlap.assign(clusters.size(), 0);
+    std::map<int, size_t> counts;
+    for(size_t c = 0; c < clusters.size(); c++){
+        counts.clear();
+        for(size_t i = 0; i < clusters[c].indices.size(); i++){
+            const int other = other_labels[clusters[c].indices[i]];
+            if(other >= 0){
+                counts[other]++;
+            }
+        }
+        for(std::map<int, size_t>::const_iterator it = counts.begin(); it != counts.end(); it++){
+            if(it->second > overlap[c]){
+                match[c] = it->first;
+                overlap[c] = it->second;
+            }
+        }
+    }
+}
+
+static ClusterAgreement compareClusters(const std::vector<pcl::PointIndices>& clusters,
+                                        const std::vector<pcl::PointIndices>& reference,
+                                        size_t num_points){
+    std::vector<int> labels, reference_labels;
+    labelClusters(clusters, num_points, labels);
+    labelClusters(reference, num_points, reference_labels);
+    std::vector<int> match, reference_match;
+    std::vector<size_t> overlap, reference_overlap;
+    matchClusters(clusters, reference_labels, match, overlap);
+    matchClusters(reference, labels, reference_match, reference_overlap);
+
+    ClusterAgreement result;
+    result.clusters = clusters.size();
+    result.reference_clusters = reference.size();
+    for(size_t c = 0; c < clusters.size(); c++){
+        const int r = match[c];
+        if(r >= 0 && reference_match[r] == (int) c &&
+           overlap[c] == clusters[c].indices.size() &&
+           overlap[c] == reference[r].indices.size()){
+            result.identical++;
+        }
+    }
+    for(size_t p = 0; p < num_points; p++){
+        const int c = labels[p];
+        const int r = reference_labels[p];
+        if(c < 0 && r < 0){
+            continue;
+        }
+        result.points++;
+        if(c >= 0 && r >= 0 && match[c] == r && reference_match[r] == c){
+            result.agreeing_points++;
+        }
+    }
+    return result;
+}
+
+// How often the lookup table of ColorClassifier gives the same answer as
+// the exact test, over every color
+static void checkColors(const std::vector<pcl::PointRGB>& targets, int radius){
+    ColorClassifier classifier;
+    classifier.setTargets(targets, radius);
+    size_t agree = 0, false_accepts = 0, false_rejects = 0, exact_accepts = 0;
+    const size_t colors = 1 << 24;
+    for(size_t c = 0; c < colors; c++){
+        const boost::uint8_t r = c >> 16, g = c >> 8, b = c;
+        const ColorClassifier::TargetMask table = classifier.match(r, g, b);
+        const ColorClassifier::TargetMask exact =
+                ColorClassifier::matchExact(targets, radius, r, g, b);
+        agree += table == exact;
+        false_accepts += (table & ~exact) != 0;
+        false_rejects += (exact & ~table) != 0;
+        exact_accepts += exact != 0;
+    }
+    std::printf("color table vs exact test, radius %d, %lu target(s):\n", radius,
+                (unsigned long) targets.size());
+    std::printf("colors agreeing:      %.4f%%\n", 100.0*agree/colors);
+    std::printf("accepted:             %lu exactly, %lu more, %lu fewer by the table\n\n",
+                (unsigned long) exact_accepts, (unsigned long) false_accepts,
+                (unsigned long) false_rejects);
+}
+
+static bool isFinite(const pcl::PointXYZRGB& pt){
+    return pcl_isfinite(pt.x) && pcl_isfinite(pt.y) && pcl_isfinite(pt.z);
+}
+
+// The way obstacles were cut out before BoxExclusion: per box, move the
+// cloud into the box's frame, NaN the points ConditionalRemoval finds inside
+// the box and move the cloud back
+static void excludeBoxReference(PointColorCloud& cloud, const Eigen::Vector3f& center,
+                                const Eigen::Matrix3f& rotation, float side){
+    Eigen::Affine3f box_to_cloud = Eigen::Affine3f::Identity();
+    box_to_cloud.translate(center);
+    box_to_cloud.rotate(rotation);
+    pcl::transformPointCloud(cloud, cloud, box_to_cloud.inverse());
+
+    pcl::ConditionOr<pcl::PointXYZRGB>::Ptr outside(new pcl::ConditionOr<pcl::PointXYZRGB>);
+    const char* fields[] = {"x", "y", "z"};
+    for(int i = 0; i < 3; i++){
+        outside->addComparison(pcl::FieldComparison<pcl::PointXYZRGB>::ConstPtr(
+                new pcl::FieldComparison<pcl::PointXYZRGB>(fields[i], pcl::ComparisonOps::LT,
+                                                            -side/2)));
+        outside->addComparison(pcl::FieldComparison<pcl::PointXYZRGB>::ConstPtr(
+                new pcl::FieldComparison<pcl::PointXYZRGB>(fields[i], pcl::ComparisonOps::GT,
+                                                            side/2)));
+    }
+    pcl::ConditionalRemoval<pcl::PointXYZRGB> removal;
+    removal.setCondition(outside);
+    removal.setInputCloud(cloud.makeShared());
+    removal.setKeepOrganized(true);
+    removal.filter(cloud);
+
+    pcl::transformPointCloud(cloud, cloud, box_to_cloud);
+}
+
+// Whether BoxExclusion removes the same points as the per-box reference,
+// with blocks the size CloudSegmenter cuts out of the obstacle cloud
+static void checkExclusion(const std::vector<PointColorCloud::Ptr>& clouds,
+                           const SegmenterParams& params, int boxes){
+    const float side = params.object_side + 2*params.exclusion_padding;
+    std::srand(1);
+    size_t points = 0, removed = 0, reference_removed = 0, disagree = 0;
+    double milliseconds = 0, reference_milliseconds = 0;
+    BoxExclusion exclusion;
+    std::vector<int> kept;
+    for(size_t c = 0; c < clouds.size(); c++){
+        const PointColorCloud& cloud = *clouds[c];
+        std::vector<int> finite;
+        for(size_t i = 0; i < cloud.size(); i++){
+            if(isFinite(cloud[i])){
+                finite.push_back(i);
+            }
+        }
+        if(finite.empty()){
+            continue;
+        }
+
+        std::vector<Eigen::Vector3f> centers;
+        std::vector<Eigen::Matrix3f> rotations;
+        exclusion.clear();
+        for(int b = 0; b < boxes; b++){
+            centers.push_back(cloud[finite[std::rand() % finite.size()]].getVector3fMap());
+            rotations.push_back(Eigen::Quaternionf(
+                    Eigen::Vector4f::Random().normalized()).toRotationMatrix());
+            exclusion.addBox(centers.back(), rotations.back(),
+                             Eigen::Vector3f(side/2, side/2, side/2));
+        }
+
+        pcl::StopWatch watch;
+        exclusion.filter(cloud, kept);
+        milliseconds += watch.getTime();
+
+        PointColorCloud reference = cloud;
+        watch.reset();
+        for(int b = 0; b < boxes; b++){
+            excludeBoxReference(reference, centers[b], rotations[b], side);
+        }
+        reference_milliseconds += watch.getTime();
+
+        //kept is in ascending order
+        size_t k = 0;
+        for(size_t i = 0; i < cloud.size(); i++){
+            const bool is_kept = k < kept.size() && kept[k] == (int) i;
+            k += is_kept;
+            if(!isFinite(cloud[i])){
+                continue;
+            }
+            const bool reference_kept = isFinite(reference[i]);
+            points++;
+            removed += !is_kept;
+            reference_removed += !reference_kept;
+            disagree += is_kept != reference_kept;
+        }
+    }
+    std::printf("BoxExclusion vs ConditionalRemoval per box, %d boxes of %.3f m:\n", boxes,
+                side);
+    std::printf("points removed:       %lu of %lu, reference %lu, disagreeing %lu\n",
+                (unsigned long) removed, (unsigned long) points,
+                (unsigned long) reference_removed, (unsigned long) disagree);
+    std::printf("ms per cloud:         %.3f, reference %.3f\n\n",
+                milliseconds/clouds.size(), reference_milliseconds/clouds.size());
+}
+
+static void usage(const char* name){
+    std::cout << "usage: " << name << " <pcd directory> [--color r g b]... [--passes n]"
+              << " [--leaf size] [--gate] [--parallel threads]"
+              << " [--incremental] [--verify] [--verify-pcl] [--check-colors]"
+              << " [--check-exclusion boxes]" << std::endl;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        usage(argv[0]);
+        return 1;
+    }
+
+    SegmenterParams params;
+    std::vector<pcl::PointRGB> targets;
+    int passes = 1;
+    bool verify = false;
+    bool verify_pcl = false;
+    bool check_colors = false;
+    int check_boxes = 0;
+    for(int i = 2; i < argc; i++){
+        if(!std::strcmp(argv[i], "--color") && i + 3 < argc){
+            //bgr!
+            targets.push_back(pcl::PointRGB(std::atoi(argv[i+3]), std::atoi(argv[i+2]),
+                                            std::atoi(argv[i+1])));
+            i += 3;
+        } else if(!std::strcmp(argv[i], "--passes") && i + 1 < argc){
+            passes = std::max(1, std::atoi(argv[++i]));
+        } else if(!std::strcmp(argv[i], "--leaf") && i + 1 < argc){
+            params.leaf_size = std::atof(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--gate")){
+            params.color_gate = true;
+        } else if(!std::strcmp(argv[i], "--parallel") && i + 1 < argc){
+            params.parallel_regions = true;
+            params.region_threads = std::max(0, std::atoi(argv[++i]));
+        } else if(!std::strcmp(argv[i], "--incremental")){
+            params.incremental = true;
+        } else if(!std::strcmp(argv[i], "--verify")){
+            verify = true;
+        } else if(!std::strcmp(argv[i], "--check-colors")){
+            check_colors = true;
+        } else if(!std::strcmp(argv[i], "--check-exclusion") && i + 1 < argc){
+            check_boxes = std::max(1, std::atoi(argv[++i]));
+        } else if(!std::strcmp(argv[i], "--verify-pcl")){
+            verify = true;
+            verify_pcl = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    //Load everything up front, in file name order
+    std::vector<std::string> paths;
+    boost::filesystem::path dir(argv[1]);
+    if(!boost::filesystem::is_directory(dir)){
+        std::cout << argv[1] << " is not a directory" << std::endl;
+        return 1;
+    }
+    for(boost::filesystem::directory_iterator it(dir);
+            it != boost::filesystem::directory_iterator(); it++){
+        if(it->path().extension() == ".pcd"){
+            paths.push_back(it->path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    if(targets.empty()){
+        targets.push_back(pcl::PointRGB(0, 0, 255));
+    }
+
+    if(check_colors){
+        checkColors(targets, params.gate_radius);
+    }
+
+    std::vector<PointColorCloud::Ptr> clouds;
+    for(size_t i = 0; i < paths.size(); i++){
+        PointColorCloud::Ptr cloud(new PointColorCloud);
+        if(pcl::io::loadPCDFile(paths[i], *cloud) == -1){
+            std::cout << "Couldn't read " << paths[i] << ", skipping it" << std::endl;
+            continue;
+        }
+        clouds.push_back(cloud);
+    }
+    if(clouds.empty()){
+        std::cout << "No point clouds found in " << argv[1] << std::endl;
+        return 1;
+    }
+    if(check_boxes > 0){
+        checkExclusion(clouds, params, check_boxes);
+    }
+    std::cout << "Replaying " << clouds.size() << " clouds " << passes << " time(s)"
+              << std::endl;
+
+    SegmentationPipeline pipeline;
+    ObjectTracker tracker;
+    TrackerUpdate track_update;
+    std::vector<double> times[NUM_STAGES];
+    std::vector<double> allocations;
+    std::vector<double> allocated_bytes;
+    size_t boxes_found = 0;
+    //One frame for the whole run, recycled like the nodelet's frames
+    PipelineFrame frame;
+    std::vector<Eigen::Vector3f> positions;
+    QuaternionList orientations;
+
+    //The full pass --verify compares against, with the same region growing
+    //engine (incremental segmentation always uses RegionGrower), or with
+    //pcl::RegionGrowingRGB for --verify-pcl
+    SegmentationPipeline reference;
+    PipelineFrame reference_frame;
+    SegmenterParams reference_params = params;
+    reference_params.incremental = false;
+    reference_params.parallel_regions = !verify_pcl &&
+                                        (params.parallel_regions || params.incremental);
+    reference_frame.color_clusters = false;
+    ClusterAgreement agreement;
+    double worst_agreement = 1;
+    size_t worst_frame = 0;
+    double verify_seconds = 0;
+
+    const double frame_period = 1.0/30;
+    size_t frame_number = 0;
+    pcl::StopWatch wall_clock;
+    for(int pass = 0; pass < passes; pass++){
+        for(size_t c = 0; c < clouds.size(); c++, frame_number++){
+            const size_t count_before = allocation_count.load();
+            const size_t bytes_before = allocation_bytes.load();
+            pcl::StopWatch frame_watch;
+            pcl::StopWatch watch;
+
+            frame.replaced_buffers = 0;
+            frame.params = params;
+            frame.targets = targets;
+
+            pipeline.filter(CloudView::fromCloud(*clouds[c]), frame);
+            times[FILTER].push_back(watch.getTime());
+
+            watch.reset();
+            pipeline.removeOutliers(frame);
+            times[OUTLIERS].push_back(watch.getTime());
+
+            watch.reset();
+            pipeline.growRegions(frame);
+            frame.search.reset();
+            times[REGIONS].push_back(watch.getTime());
+
+            watch.reset();
+            pipeline.fitBoxes(frame);
+            times[BOXES].push_back(watch.getTime());
+
+            //The boxes stay in the camera frame, there is no TF here
+            watch.reset();
+            positions.clear();
+            orientations.clear();
+            for(size_t i = 0; i < frame.boxes.size(); i++){
+                positions.push_back(frame.boxes[i].get_position());
+                orientations.push_back(Eigen::Quaternionf(frame.boxes[i].get_rotational_matrix()));
+            }
+            tracker.update(positions, orientations, frame.box_targets,
+                           frame_number*frame_period, track_update);
+            times[TRACKING].push_back(watch.getTime());
+
+            boxes_found += frame.boxes.size();
+            times[TOTAL].push_back(frame_watch.getTime());
+            allocations.push_back(allocation_count.load() - count_before);
+            allocated_bytes.push_back(allocation_bytes.load() - bytes_before);
+
+            if(verify){
+                pcl::StopWatch verify_watch;
+                reference_frame.params = reference_params;
+                reference_frame.targets = targets;
+                reference.filter(CloudView::fromCloud(*clouds[c]), reference_frame);
+                reference.removeOutliers(reference_frame);
+                reference.growRegions(reference_frame);
+                reference_frame.search.reset();
+                if(reference_frame.cloud->size() != frame.cloud->size()){
+                    std::cout << "Frame " << frame_number << " was filtered differently"
+                              << " by the full pass" << std::endl;
+                    return 1;
+                }
+                const ClusterAgreement frame_agreement = compareClusters(
+                        frame.clusters, reference_frame.clusters, frame.cloud->size());
+                agreement.add(frame_agreement);
+                if(frame_agreement.agreement() < worst_agreement){
+                    worst_agreement = frame_agreement.agreement();
+                    worst_frame = frame_number;
+                }
+                verify_seconds += verify_watch.getTimeSeconds();
+            }
+        }
+    }
+    const double elapsed = wall_clock.getTimeSeconds() - verify_seconds;
+
+    std::printf("\n%-10s %10s %10s %10s\n", "stage", "p50 ms", "p99 ms", "mean ms");
+    for(int s = 0; s < NUM_STAGES; s++){
+        std::printf("%-10s %10.3f %10.3f %10.3f\n", stage_names[s],
+                    percentile(times[s], 0.5), percentile(times[s], 0.99), mean(times[s]));
+    }
+    std::printf("\nframes:               %lu\n", (unsigned long) frame_number);
+    std::printf("frames per second:    %.1f\n", frame_number/elapsed);
+    std::printf("boxes per frame:      %.2f\n", (double) boxes_found/frame_number);
+    std::printf("allocations / frame:  p50 %.0f, p99 %.0f, mean %.1f\n",
+                percentile(allocations, 0.5), percentile(allocations, 0.99),
+                mean(allocations));
+    std::printf("allocated KB / frame: %.1f\n", mean(allocated_bytes)/1024);
+    if(verify){
+        std::printf("\nagainst a full pass%s:\n",
+                    verify_pcl ? " with pcl::RegionGrowingRGB" : "");
+        std::printf("clusters:             %lu, full pass %lu, identical %lu\n",
+                    (unsigned long) agreement.clusters,
+                    (unsigned long) agreement.reference_clusters,
+                    (unsigned long) agreement.identical);
+        std::printf("clustered points:     %.4f agree, worst frame %lu at %.4f\n",
+                    agreement.agreement(), (unsigned long) worst_frame, worst_agreement);
+    }
+    return 0;
+}